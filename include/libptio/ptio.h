@@ -10,9 +10,14 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <scsi/sg.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
  * CDB types.
  */
@@ -36,6 +41,7 @@ enum ptio_dxfer {
  */
 #define PTIO_VERBOSE			(1 << 0)
 #define PTIO_ATA			(1 << 1)
+#define PTIO_QUEUE_AT_TAIL		(1 << 2)
 
 #define PTIO_VENDOR_LEN	9
 #define PTIO_ID_LEN	17
@@ -48,6 +54,145 @@ enum ptio_dxfer {
 #define PTIO_SENSE_MAX_LENGTH	64
 #define PTIO_CDB_MAX_SIZE	32
 
+/*
+ * Log message levels.
+ */
+enum ptio_log_level {
+	PTIO_LOG_ERROR = 1,
+	PTIO_LOG_WARNING,
+	PTIO_LOG_INFO,
+	PTIO_LOG_DEBUG,
+};
+
+/*
+ * Command classes, used to select a command default timeout.
+ */
+enum ptio_cmd_class {
+	PTIO_CMD_CLASS_DEFAULT,	/* Unknown commands: 30 s */
+	PTIO_CMD_CLASS_QUICK,	/* Identification and status: 10 s */
+	PTIO_CMD_CLASS_IO,	/* Read, write, verify, flush, trim: 30 s */
+	PTIO_CMD_CLASS_LONG,	/* Sanitize, format, firmware, ...: 10 min */
+
+	PTIO_CMD_NR_CLASSES,
+};
+
+/*
+ * Action taken after a command timeout, in addition to the command abort
+ * done by the kernel.
+ */
+enum ptio_escalation {
+	PTIO_ESCALATE_NONE,
+	PTIO_ESCALATE_LUN_RESET,	/* LUN reset */
+	PTIO_ESCALATE_TARGET_RESET,	/* LUN reset, then target reset */
+};
+
+/*
+ * Device command statistics.
+ */
+struct ptio_dev_stats {
+	unsigned long long	nr_cmds;
+	unsigned long long	nr_errors;
+	unsigned long long	nr_timeouts;
+	unsigned long long	nr_deadline_expired;
+	unsigned long long	nr_lun_resets;
+	unsigned long long	nr_target_resets;
+	unsigned long long	nr_reset_failures;
+	unsigned long long	nr_retries;
+	unsigned long long	nr_retries_exhausted;
+	unsigned long long	nr_throttled;
+	unsigned long long	throttle_ns;
+	unsigned long long	nr_power_checks;
+	unsigned long long	nr_power_skips;
+	unsigned long long	nr_power_defers;
+	unsigned long long	nr_power_cached;
+	unsigned long long	nr_cache_hits;
+	unsigned long long	nr_cache_misses;
+	unsigned long long	nr_cache_invalidations;
+	unsigned long long	nr_numa_local;
+	unsigned long long	nr_numa_remote;
+};
+
+/*
+ * Power gating: handling of commands that would spin up the media of a
+ * device in standby.
+ */
+enum ptio_power_gate {
+	PTIO_POWER_GATE_NONE,	/* Always execute commands */
+	PTIO_POWER_GATE_SKIP,	/* Fail commands with -EAGAIN */
+	PTIO_POWER_GATE_DEFER,	/* Wait for the device to become active */
+	PTIO_POWER_GATE_CACHE,	/* Use the last response, or skip */
+};
+
+struct ptio_cache;
+
+/*
+ * QoS token bucket limiting the commands per second and bytes per second,
+ * with bursts of up to @burst_ms worth of commands (0 for 100 ms). With
+ * @target_lat_us not 0, the limits are lowered while the average command
+ * latency is above the target. A bucket can be used by a single device, or
+ * shared by several devices to limit a tenant. Initialize with
+ * ptio_init_qos().
+ */
+struct ptio_qos {
+	unsigned int		iops;
+	unsigned long long	bps;
+	unsigned int		burst_ms;
+	unsigned int		target_lat_us;
+
+	/* Throttling statistics */
+	unsigned long long	nr_throttled;
+	unsigned long long	throttle_ns;
+
+	/* Private */
+	unsigned long long	iops_tat;
+	unsigned long long	bytes_tat;
+	unsigned long long	avg_lat_ns;
+	unsigned long long	adjust_ns;
+	unsigned int		scale;
+};
+
+extern void ptio_init_qos(struct ptio_qos *qos, unsigned int iops,
+			  unsigned long long bps, unsigned int target_lat_us);
+
+/*
+ * Retry classes of transient command failures.
+ */
+enum ptio_retry_class {
+	PTIO_RETRY_UNIT_ATTENTION,	/* UNIT ATTENTION */
+	PTIO_RETRY_NOT_READY,		/* NOT READY, becoming ready */
+	PTIO_RETRY_ABORTED,		/* ABORTED COMMAND, transport error */
+	PTIO_RETRY_BUSY,		/* BUSY, TASK SET FULL, host busy */
+
+	PTIO_RETRY_NR_CLASSES,
+};
+
+/*
+ * Command retry policy: maximum number of retries per class, and minimum
+ * and maximum delay in ms of the exponential backoff between retries. A
+ * zeroed policy disables retries.
+ */
+struct ptio_retry_policy {
+	unsigned int		max_retries[PTIO_RETRY_NR_CLASSES];
+	unsigned int		min_delay;
+	unsigned int		max_delay;
+};
+
+extern void ptio_init_retry_policy(struct ptio_retry_policy *policy);
+
+/*
+ * Device descriptor.
+ *
+ * Concurrency: the library has no global mutable state, except for the log
+ * sink which must be set with ptio_set_log_fn() before any device is used.
+ * Once a device is open, ptio_exec_cmd() and the health, zone, firmware,
+ * scan, trim and zero engines can be called concurrently from several
+ * threads on the same device, each thread using its own struct ptio_cmd and
+ * buffers. The device fields must not be modified while commands are being
+ * issued, so ptio_open_dev(), ptio_close_dev(), ptio_get_dev_information(),
+ * ptio_revalidate_dev() and ptio_revalidate_devs() must not run concurrently
+ * with any other call on the same device. Calls on different devices are
+ * always independent.
+ */
 struct ptio_dev {
 	/* Device file path and basename */
 	char			*path;
@@ -71,8 +216,135 @@ struct ptio_dev {
 	size_t			logical_block_size;
 	size_t			physical_block_size;
 	unsigned long long	capacity;
+
+	/* NUMA node of the device host adapter (-1 if unknown) */
+	int			numa_node;
+
+	/*
+	 * Logging: maximum message level (0 for PTIO_LOG_INFO, or
+	 * PTIO_LOG_DEBUG with PTIO_VERBOSE), and rate limit in messages per
+	 * second with a maximum burst (0 for the defaults, a rate of UINT_MAX
+	 * to disable rate limiting).
+	 */
+	enum ptio_log_level	log_level;
+	unsigned int		log_rate;
+	unsigned int		log_burst;
+
+	/*
+	 * Command timeouts in ms per command class (0 for the defaults), and
+	 * the reset escalation done after a timeout. @deadline is an absolute
+	 * CLOCK_MONOTONIC time in ns (0 for none): commands are not issued
+	 * past the deadline and fail with -ETIME, and command timeouts are
+	 * limited to the time left until the deadline. The deadline can be
+	 * changed at any time to cancel commands not yet issued.
+	 */
+	unsigned int		timeouts[PTIO_CMD_NR_CLASSES];
+	enum ptio_escalation	escalation;
+	unsigned long long	deadline;
+
+	/* Retries of transient failures (no retries by default) */
+	struct ptio_retry_policy retry;
+
+	/*
+	 * QoS: device limits (none by default), and optional tenant limits
+	 * shared with other devices. Commands are queued at the head of the
+	 * device queue, unless PTIO_QUEUE_AT_TAIL is set in @flags.
+	 */
+	struct ptio_qos		qos;
+	struct ptio_qos		*tenant;
+
+	/*
+	 * Power gating. With PTIO_POWER_GATE_DEFER, commands are skipped if
+	 * the device is still in standby after @power_defer_ms (0 for 60 s).
+	 */
+	enum ptio_power_gate	power_gate;
+	unsigned int		power_defer_ms;
+
+	/*
+	 * Response cache of identification commands (INQUIRY, READ CAPACITY,
+	 * IDENTIFY DEVICE, GPL directory), with responses reused for up to
+	 * @cache_ttl ms (0 to disable the cache, the default). The cache is
+	 * dropped on revalidate, on UNIT ATTENTION, and when a command that
+	 * may change the device configuration is executed.
+	 */
+	unsigned int		cache_ttl;
+
+	/* Private */
+	unsigned long long	log_tat;
+	unsigned int		log_suppressed;
+	struct ptio_dev_stats	stats;
+	unsigned long long	power_active_ns;
+	struct ptio_cache	*cache;
+	bool			async;
+	bool			escalate;
+};
+
+/*
+ * Log sink. @dev is NULL for messages not related to a device.
+ */
+typedef void (*ptio_log_fn)(struct ptio_dev *dev, enum ptio_log_level level,
+			    const char *format, va_list ap, void *data);
+
+extern void ptio_set_log_fn(ptio_log_fn fn, void *data);
+
+/*
+ * ATA registers returned by an ATA PASS-THROUGH command.
+ */
+struct ptio_ata_regs {
+	uint8_t			error;
+	uint8_t			status;
+	uint8_t			device;
+	bool			extend;
+	uint16_t		count;
+	uint64_t		lba;
 };
 
+/*
+ * Decoded sense classification and field flags.
+ */
+#define PTIO_SENSE_VALID		(1 << 0)
+#define PTIO_SENSE_DEFERRED		(1 << 1)
+#define PTIO_SENSE_RETRYABLE		(1 << 2)
+#define PTIO_SENSE_RECOVERED		(1 << 3)
+#define PTIO_SENSE_NOT_READY		(1 << 4)
+#define PTIO_SENSE_MEDIUM_ERROR		(1 << 5)
+#define PTIO_SENSE_HARDWARE_ERROR	(1 << 6)
+#define PTIO_SENSE_ILLEGAL_REQUEST	(1 << 7)
+#define PTIO_SENSE_UNIT_ATTENTION	(1 << 8)
+#define PTIO_SENSE_DATA_PROTECT		(1 << 9)
+#define PTIO_SENSE_ABORTED		(1 << 10)
+#define PTIO_SENSE_INFO			(1 << 16) /* @info is valid */
+#define PTIO_SENSE_CMD_INFO		(1 << 17) /* @cmd_info is valid */
+#define PTIO_SENSE_SKS			(1 << 18) /* @sks is valid */
+#define PTIO_SENSE_PROGRESS		(1 << 19) /* @progress is valid */
+#define PTIO_SENSE_ATA_REGS		(1 << 20) /* @ata is valid */
+#define PTIO_SENSE_ATA_PARTIAL		(1 << 21) /* @ata upper bytes lost */
+
+/*
+ * Decoded fixed or descriptor format sense data. @progress is the progress
+ * indication of a NOT READY or NO SENSE sense key, out of 65536.
+ */
+struct ptio_sense {
+	uint32_t		flags;
+	uint8_t			response_code;
+	uint8_t			key;
+	uint8_t			asc;
+	uint8_t			ascq;
+	uint64_t		info;
+	uint64_t		cmd_info;
+	uint8_t			sks[3];
+	uint16_t		progress;
+	struct ptio_ata_regs	ata;
+};
+
+static inline uint16_t ptio_sense_asc_ascq(struct ptio_sense *s)
+{
+	return (uint16_t)s->asc << 8 | s->ascq;
+}
+
+extern int ptio_decode_sense(uint8_t *sense, size_t sensesz,
+			     struct ptio_sense *s);
+
 /*
  * Command flags.
  */
@@ -81,6 +353,23 @@ struct ptio_dev {
 #define PTIO_CMD_ATA_ZERO_BYTE_BLOCK	(1 << 0)
 /* Force ATA PASSTHROUGH t_length to indicate number of LBAs */
 #define PTIO_CMD_ATA_LBA_LEN		(1 << 1)
+/*
+ * Set ATA PASSTHROUGH ck_cond so that the device output registers are
+ * returned in @sense.ata. The command then succeeds with PTIO_SENSE_ATA_REGS
+ * set in @sense.flags, unless the device reported an error.
+ */
+#define PTIO_CMD_ATA_CK_COND		(1 << 2)
+/* Queue the command at the tail of the device queue */
+#define PTIO_CMD_QUEUE_AT_TAIL		(1 << 3)
+
+struct ptio_cmd;
+
+/*
+ * Completion callback of a command submitted with ptio_submit_cmd(). @ret
+ * is the command result, as returned by ptio_exec_cmd().
+ */
+typedef void (*ptio_cmd_done_fn)(struct ptio_dev *dev, struct ptio_cmd *cmd,
+				 int ret, void *data);
 
 /*
  * Command descriptor.
@@ -100,30 +389,480 @@ struct ptio_cmd {
 	uint8_t			sense_buf[PTIO_SENSE_MAX_LENGTH];
 	uint8_t			sense_key;
 	uint16_t		asc_ascq;
+	struct ptio_sense	sense;
+
+	/* Number of retries done */
+	unsigned int		retries;
+
+	/* Completed with a saved response, without device access */
+	bool			cached;
+
+	/* Private */
+	bool			async;
+	unsigned long long	start_ns;
+	ptio_cmd_done_fn	done;
+	void			*done_data;
 };
 
 extern int ptio_open_dev(struct ptio_dev *dev, enum ptio_dxfer dxfer);
 extern void ptio_close_dev(struct ptio_dev *dev);
 
+/*
+ * Asynchronous command execution, for SCSI generic (/dev/sgN) devices only.
+ * Up to 16 commands can be outstanding on a device file. A command submitted
+ * with ptio_submit_cmd() is completed by ptio_complete_cmds(), which calls
+ * the command completion callback, when the device completion fd is
+ * readable. A device group aggregates the completion fds of many devices
+ * into a single fd. Asynchronous commands are not retried, throttled, gated
+ * or served from the response cache, as that could block the caller.
+ * The command and its buffer must remain valid until completion.
+ * The device deadline is checked on submission only: the timeout of a
+ * submitted command is limited to the time left until the deadline at that
+ * time, but the sg driver cannot abort individual commands, so moving the
+ * deadline earlier does not cancel outstanding commands. The reset
+ * escalation of timed out commands is done once all available completions
+ * were processed.
+ */
+struct ptio_dev_group;
+
+extern int ptio_submit_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd,
+			   uint8_t *cdb, size_t cdbsz,
+			   enum ptio_cdb_type cdb_type,
+			   uint8_t *buf, size_t bufsz,
+			   enum ptio_dxfer dxfer, uint32_t flags,
+			   unsigned int timeout,
+			   ptio_cmd_done_fn done, void *data);
+extern int ptio_dev_completion_fd(struct ptio_dev *dev);
+extern int ptio_complete_cmds(struct ptio_dev *dev);
+
+extern struct ptio_dev_group *ptio_open_dev_group(void);
+extern void ptio_close_dev_group(struct ptio_dev_group *grp);
+extern int ptio_dev_group_add(struct ptio_dev_group *grp,
+			      struct ptio_dev *dev);
+extern int ptio_dev_group_remove(struct ptio_dev_group *grp,
+				 struct ptio_dev *dev);
+extern int ptio_dev_group_fd(struct ptio_dev_group *grp);
+extern int ptio_dev_group_complete(struct ptio_dev_group *grp,
+				   int timeout_ms);
+
 extern int ptio_revalidate_dev(struct ptio_dev *dev);
+extern int ptio_revalidate_devs(struct ptio_dev **devs, unsigned int nr_devs);
 extern int ptio_get_dev_information(struct ptio_dev *dev);
 extern const char *ptio_ata_acs_ver(struct ptio_dev *dev);
 
 extern int ptio_parse_cdb(char *cdb_str, uint8_t *cdb);
 
 extern uint8_t *ptio_alloc_buf(size_t bufsz);
+extern uint8_t *ptio_alloc_dev_buf(struct ptio_dev *dev, size_t bufsz);
+extern int ptio_dev_bind_thread(struct ptio_dev *dev);
 extern uint8_t *ptio_read_buf(char *path, size_t *bufsz);
 extern int ptio_write_buf(char *path, uint8_t *buf, size_t bufsz);
 extern void ptio_print_buf(uint8_t *buf, size_t bufsz);
 
+/*
+ * Buffer dump output formats and flags.
+ */
+enum ptio_dump_fmt {
+	PTIO_DUMP_HEX,		/* Hexadecimal table, as ptio_print_buf() */
+	PTIO_DUMP_BASE64,	/* Base64 with 76 characters lines */
+	PTIO_DUMP_RAW,		/* Binary buffer content */
+};
+
+/* Collapse runs of identical hexadecimal table lines into "*" */
+#define PTIO_DUMP_SQUEEZE	(1 << 0)
+
+extern int ptio_dump_buf(int fd, uint8_t *buf, size_t bufsz,
+			 enum ptio_dump_fmt fmt, unsigned int flags);
+
+/*
+ * Device internal status logs: ATA Current and Saved Device Internal Status
+ * logs, or the SCSI error history (a new snapshot for the current log).
+ */
+enum ptio_status_log {
+	PTIO_STATUS_LOG_CURRENT,
+	PTIO_STATUS_LOG_SAVED,
+};
+
+extern int ptio_dump_status_log(struct ptio_dev *dev,
+				enum ptio_status_log log, int fd,
+				unsigned int nr_bufs,
+				unsigned long long *size);
+
 extern int ptio_exec_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd,
 		uint8_t *cdb, size_t cdbsz, enum ptio_cdb_type cdb_type,
 			 uint8_t *buf, size_t bufsz, enum ptio_dxfer dxfer,
 			 uint32_t flags);
 
+extern int ptio_exec_cmd_timeout(struct ptio_dev *dev, struct ptio_cmd *cmd,
+				 uint8_t *cdb, size_t cdbsz,
+				 enum ptio_cdb_type cdb_type,
+				 uint8_t *buf, size_t bufsz,
+				 enum ptio_dxfer dxfer, uint32_t flags,
+				 unsigned int timeout);
+
+extern enum ptio_cmd_class ptio_cmd_class(struct ptio_cmd *cmd);
+extern void ptio_get_dev_stats(struct ptio_dev *dev,
+			       struct ptio_dev_stats *stats);
+
 extern void ptio_print_sense(struct ptio_dev *dev,
 			     uint8_t *sense, size_t sensesz);
 
+/*
+ * Health counter sources.
+ */
+enum ptio_counter_src {
+	PTIO_COUNTER_ATA_DEVSTAT = 0,	/* ATA Device Statistics log (04h) */
+	PTIO_COUNTER_SCSI_LOG,		/* SCSI LOG SENSE page */
+};
+
+/*
+ * Health counter flags.
+ */
+#define PTIO_COUNTER_VALID		(1 << 0)
+#define PTIO_COUNTER_NORMALIZED		(1 << 1)
+#define PTIO_COUNTER_HAS_DELTA		(1 << 2)
+
+/*
+ * Decoded health counter. For ATA Device Statistics, @id is the byte offset of
+ * the statistic in its log page. For SCSI log pages, @id is the log parameter
+ * code.
+ */
+struct ptio_counter {
+	uint8_t			src;
+	uint8_t			page;
+	uint8_t			subpage;
+	uint8_t			flags;
+	uint16_t		id;
+	uint64_t		val;
+	int64_t			delta;
+};
+
+/*
+ * Health page to poll: ATA Device Statistics pages are polled only for ATA
+ * devices and SCSI log pages only for SCSI devices.
+ */
+struct ptio_health_page {
+	enum ptio_counter_src	src;
+	uint8_t			page;
+	uint8_t			subpage;
+};
+
+/*
+ * Per device health sample.
+ */
+struct ptio_health_dev {
+	struct ptio_dev		*dev;
+
+	/* Result of the last sample */
+	int			error;
+	unsigned int		nr_cmds;
+	unsigned long long	time_ns;
+	unsigned long long	interval_ns;
+
+	unsigned int		nr_counters;
+	struct ptio_counter	*counters;
+
+	/* Private */
+	bool			probed;
+	unsigned int		nr_prev_counters;
+	struct ptio_counter	*prev_counters;
+	unsigned int		max_counters;
+	uint8_t			ata_first_page;
+	uint8_t			ata_nr_pages;
+	uint8_t			*scsi_pages;
+	uint8_t			*buf;
+	size_t			bufsz;
+};
+
+/*
+ * Health poller for a set of devices.
+ */
+struct ptio_health {
+	unsigned int		nr_threads;
+
+	unsigned int		nr_pages;
+	struct ptio_health_page	*pages;
+
+	unsigned int		nr_devs;
+	struct ptio_health_dev	*devs;
+};
+
+extern struct ptio_health *ptio_alloc_health(struct ptio_dev **devs,
+					unsigned int nr_devs,
+					struct ptio_health_page *pages,
+					unsigned int nr_pages,
+					unsigned int nr_threads);
+extern int ptio_sample_health(struct ptio_health *h);
+extern void ptio_free_health(struct ptio_health *h);
+
+/*
+ * Zone types.
+ */
+#define PTIO_ZONE_TYPE_CONVENTIONAL	0x01
+#define PTIO_ZONE_TYPE_SEQWRITE_REQ	0x02
+#define PTIO_ZONE_TYPE_SEQWRITE_PREF	0x03
+#define PTIO_ZONE_TYPE_SOBR		0x04
+#define PTIO_ZONE_TYPE_GAP		0x05
+
+/*
+ * Zone conditions.
+ */
+#define PTIO_ZONE_COND_NOT_WP		0x00
+#define PTIO_ZONE_COND_EMPTY		0x01
+#define PTIO_ZONE_COND_IMP_OPEN		0x02
+#define PTIO_ZONE_COND_EXP_OPEN		0x03
+#define PTIO_ZONE_COND_CLOSED		0x04
+#define PTIO_ZONE_COND_INACTIVE		0x05
+#define PTIO_ZONE_COND_READONLY		0x0D
+#define PTIO_ZONE_COND_FULL		0x0E
+#define PTIO_ZONE_COND_OFFLINE		0x0F
+
+/*
+ * Zone cache of a zoned device, using one array per zone attribute. Zone start
+ * and write pointer positions are in logical blocks. @zone_size is 0 if the
+ * device zones do not all have the same size (ignoring the last zone).
+ */
+struct ptio_zones {
+	unsigned int		nr_zones;
+	unsigned long long	zone_size;
+	unsigned long long	capacity;
+
+	uint64_t		*start;
+	uint64_t		*wp;
+	uint8_t			*type;
+	uint8_t			*cond;
+
+	/* Private */
+	uint64_t		*dirty;
+	size_t			bufsz;
+	unsigned int		qd;
+	bool			ncq_probed;
+	bool			ncq_mgmt_out;
+};
+
+/*
+ * Zone operations.
+ */
+enum ptio_zone_op {
+	PTIO_ZONE_OP_CLOSE = 0x01,
+	PTIO_ZONE_OP_FINISH = 0x02,
+	PTIO_ZONE_OP_OPEN = 0x03,
+	PTIO_ZONE_OP_RESET = 0x04,
+};
+
+/*
+ * Range of zones for a zone operation.
+ */
+struct ptio_zone_range {
+	unsigned int		zno;
+	unsigned int		nr_zones;
+};
+
+extern struct ptio_zones *ptio_report_zones(struct ptio_dev *dev,
+					    size_t bufsz, unsigned int qd);
+extern void ptio_invalidate_zones(struct ptio_zones *zones,
+				  unsigned int zno, unsigned int nr_zones);
+extern int ptio_refresh_zones(struct ptio_dev *dev, struct ptio_zones *zones);
+extern int ptio_zone_op(struct ptio_dev *dev, struct ptio_zones *zones,
+			enum ptio_zone_op op, struct ptio_zone_range *ranges,
+			unsigned int nr_ranges, unsigned int qd, int *status);
+extern void ptio_free_zones(struct ptio_zones *zones);
+
+static inline unsigned long long ptio_zone_len(struct ptio_zones *zones,
+					       unsigned int zno)
+{
+	if (zno + 1 < zones->nr_zones)
+		return zones->start[zno + 1] - zones->start[zno];
+	return zones->capacity - zones->start[zno];
+}
+
+extern int ptio_zone_no(struct ptio_zones *zones, unsigned long long lba);
+
+/*
+ * Firmware image file mapped in memory.
+ */
+struct ptio_fw_image {
+	int			fd;
+	size_t			size;
+	uint8_t			*data;
+};
+
+/*
+ * Firmware download flags. By default, the firmware is downloaded and saved
+ * with activation deferred until ptio_activate_fw() is called.
+ */
+#define PTIO_FW_IMMEDIATE	(1 << 0) /* Activate once downloaded */
+#define PTIO_FW_ACT_POWER_ON	(1 << 1) /* SCSI: also activate on power on */
+#define PTIO_FW_ACT_HARD_RESET	(1 << 2) /* SCSI: also activate on reset */
+
+/*
+ * Per device firmware download state. @done is the number of bytes of the
+ * image already downloaded and can be read while the download progresses.
+ */
+struct ptio_fw_dev {
+	struct ptio_dev		*dev;
+
+	int			error;
+	size_t			done;
+	size_t			segsz;
+	size_t			min_segsz;
+	size_t			max_segsz;
+	uint8_t			mode;
+	bool			activate_pending;
+	unsigned long long	time_ns;
+
+	/* Private */
+	uint8_t			mode_specific;
+	bool			dma;
+};
+
+typedef void (*ptio_fw_progress_fn)(struct ptio_fw_dev *fwd, void *data);
+
+extern int ptio_open_fw_image(const char *path, struct ptio_fw_image *img);
+extern void ptio_close_fw_image(struct ptio_fw_image *img);
+extern int ptio_download_fw(struct ptio_fw_image *img,
+			    struct ptio_fw_dev *fwds, unsigned int nr_devs,
+			    unsigned int nr_threads, unsigned int flags,
+			    ptio_fw_progress_fn progress, void *data);
+extern int ptio_activate_fw(struct ptio_fw_dev *fwds, unsigned int nr_devs,
+			    unsigned int nr_threads);
+
+/*
+ * Range of logical blocks.
+ */
+struct ptio_extent {
+	uint64_t		lba;
+	uint64_t		nr_blocks;
+};
+
+/*
+ * Media scan flags.
+ */
+#define PTIO_SCAN_RESUME	(1 << 0) /* Resume from the checkpoint file */
+
+/*
+ * Per device media scan. The range to scan is specified with @lba and
+ * @nr_blocks (0 meaning up to the last LBA of the device). If @checkpoint is
+ * not NULL, the scan progress and bad extents are periodically saved to that
+ * file. @max_chunk is the maximum number of blocks verified per command
+ * (0 for the default). @done is the LBA below which all blocks have been
+ * verified and can be read while the scan progresses. The device information
+ * must have been obtained with ptio_get_dev_information().
+ */
+struct ptio_scan_dev {
+	struct ptio_dev		*dev;
+	uint64_t		lba;
+	uint64_t		nr_blocks;
+	uint64_t		max_chunk;
+	const char		*checkpoint;
+
+	int			error;
+	uint64_t		done;
+	unsigned long long	nr_cmds;
+	unsigned long long	time_ns;
+
+	/* Sorted bad extents */
+	unsigned int		nr_bad;
+	uint64_t		nr_bad_blocks;
+	struct ptio_extent	*bad;
+
+	/* Private */
+	unsigned int		max_bad;
+};
+
+extern int ptio_scan_media(struct ptio_scan_dev *sds, unsigned int nr_devs,
+			   unsigned int nr_threads, unsigned int qd,
+			   unsigned int flags);
+extern void ptio_free_scan_dev(struct ptio_scan_dev *sd);
+
+/*
+ * Deallocation flags.
+ */
+#define PTIO_TRIM_NO_NCQ	(1 << 0) /* Do not use queued TRIM */
+
+extern int ptio_trim(struct ptio_dev *dev, struct ptio_extent *extents,
+		     unsigned int nr_extents, unsigned int qd,
+		     unsigned int flags);
+
+/*
+ * Zeroing flags.
+ */
+#define PTIO_ZERO_UNMAP		(1 << 0) /* Allow deallocating blocks */
+#define PTIO_ZERO_SANITIZE	(1 << 1) /* Allow sanitize overwrite */
+
+/*
+ * Zeroing methods.
+ */
+enum ptio_zero_method {
+	PTIO_ZERO_METHOD_NONE = 0,
+	PTIO_ZERO_METHOD_SANITIZE,
+	PTIO_ZERO_METHOD_ZERO_EXT,
+	PTIO_ZERO_METHOD_WRITE_SAME,
+	PTIO_ZERO_METHOD_WRITE,
+};
+
+/*
+ * Per device zeroing. The range to zero is specified with @lba and
+ * @nr_blocks (0 meaning up to the last LBA of the device). @done is the
+ * number of blocks zeroed so far and @bytes_per_sec the average throughput.
+ * The device information must have been obtained with
+ * ptio_get_dev_information().
+ */
+struct ptio_zero_dev {
+	struct ptio_dev		*dev;
+	uint64_t		lba;
+	uint64_t		nr_blocks;
+
+	int			error;
+	enum ptio_zero_method	method;
+	uint64_t		done;
+	unsigned long long	time_ns;
+	unsigned long long	bytes_per_sec;
+};
+
+typedef void (*ptio_zero_progress_fn)(struct ptio_zero_dev *zd, void *data);
+
+extern int ptio_zero(struct ptio_zero_dev *zds, unsigned int nr_devs,
+		     unsigned int nr_threads, unsigned int qd,
+		     unsigned int flags, ptio_zero_progress_fn progress,
+		     void *data);
+
+/*
+ * Device registry: SCSI block and SCSI generic devices present in the
+ * system, kept up to date using kernel uevents. @flags has PTIO_ATA set for
+ * ATA devices. @generation is incremented whenever the kernel reports a
+ * change for the device, e.g. a capacity change or a rescan, so that the
+ * users of the device can revalidate it.
+ */
+#define PTIO_REG_NAME_LEN	32
+#define PTIO_REG_PATH_LEN	40
+
+enum ptio_reg_event {
+	PTIO_REG_ADD,
+	PTIO_REG_REMOVE,
+	PTIO_REG_CHANGE,
+};
+
+struct ptio_reg_dev {
+	char			name[PTIO_REG_NAME_LEN];
+	char			path[PTIO_REG_PATH_LEN];
+	unsigned int		flags;
+	unsigned long long	generation;
+};
+
+struct ptio_reg;
+
+typedef void (*ptio_reg_fn)(struct ptio_reg *reg, enum ptio_reg_event event,
+			    const struct ptio_reg_dev *rdev, void *data);
+
+extern struct ptio_reg *ptio_open_reg(ptio_reg_fn fn, void *data);
+extern void ptio_close_reg(struct ptio_reg *reg);
+extern int ptio_reg_fd(struct ptio_reg *reg);
+extern int ptio_reg_process(struct ptio_reg *reg, int timeout_ms);
+extern int ptio_reg_get_dev(struct ptio_reg *reg, const char *name,
+			    struct ptio_reg_dev *rdev);
+extern unsigned int ptio_reg_nr_devs(struct ptio_reg *reg);
+
 static inline bool ptio_dev_is_ata(struct ptio_dev *dev)
 {
 	return dev->flags & PTIO_ATA;
@@ -269,4 +1008,8 @@ static inline uint64_t ptio_get_le64(uint8_t *buf)
 #endif
 }
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* LIBPTIO_H */
@@ -0,0 +1,861 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * SPDX-FileCopyrightText: 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#ifndef LIBPTIO_HPP
+#define LIBPTIO_HPP
+
+/*
+ * C++20 interface to libptio: RAII device and buffer handles, and constexpr
+ * CDB builders. CDBs built with constant arguments are folded at compile
+ * time, and ATA commands are built directly as ATA PASS-THROUGH (16) CDBs,
+ * so executing them does not involve any ATA command table lookup.
+ * With compilers supporting coroutines, commands can also be awaited with
+ * co_await, using the asynchronous command interface.
+ */
+#if __cplusplus < 202002L
+#error "libptio/ptio.hpp requires C++20"
+#endif
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <span>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine)
+#include <atomic>
+#include <cerrno>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#endif
+
+#include <libptio/ptio.h>
+
+namespace ptio {
+
+/*
+ * A SCSI CDB of N bytes, with the data transfer direction of the command.
+ */
+template <std::size_t N>
+struct cdb {
+	static_assert(N >= 6 && N <= PTIO_CDB_MAX_SIZE, "Invalid CDB size");
+
+	std::array<uint8_t, N>	bytes{};
+	enum ptio_dxfer		dxfer = PTIO_DXFER_NONE;
+
+	static constexpr std::size_t size() noexcept { return N; }
+	constexpr uint8_t &operator[](std::size_t i) noexcept
+	{
+		return bytes[i];
+	}
+	constexpr uint8_t operator[](std::size_t i) const noexcept
+	{
+		return bytes[i];
+	}
+	constexpr bool operator==(const cdb &) const = default;
+};
+
+namespace detail {
+
+constexpr void put_be16(uint8_t *p, uint16_t v) noexcept
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+constexpr void put_be32(uint8_t *p, uint32_t v) noexcept
+{
+	put_be16(p, v >> 16);
+	put_be16(p + 2, v);
+}
+
+constexpr void put_be64(uint8_t *p, uint64_t v) noexcept
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v);
+}
+
+} /* namespace detail */
+
+/*
+ * SCSI commands.
+ */
+namespace scsi {
+
+constexpr cdb<6> test_unit_ready() noexcept
+{
+	return {};
+}
+
+constexpr cdb<6> request_sense(uint8_t alloc_len, bool desc = true) noexcept
+{
+	cdb<6> c{};
+
+	c[0] = 0x03;
+	c[1] = desc;
+	c[4] = alloc_len;
+	c.dxfer = PTIO_DXFER_FROM_DEV;
+
+	return c;
+}
+
+constexpr cdb<6> inquiry(uint16_t alloc_len) noexcept
+{
+	cdb<6> c{};
+
+	c[0] = 0x12;
+	detail::put_be16(&c[3], alloc_len);
+	c.dxfer = PTIO_DXFER_FROM_DEV;
+
+	return c;
+}
+
+constexpr cdb<6> inquiry_vpd(uint8_t page, uint16_t alloc_len) noexcept
+{
+	cdb<6> c = inquiry(alloc_len);
+
+	c[1] = 0x01; /* EVPD */
+	c[2] = page;
+
+	return c;
+}
+
+constexpr cdb<6> start_stop_unit(bool start,
+				 uint8_t power_cond = 0) noexcept
+{
+	cdb<6> c{};
+
+	c[0] = 0x1B;
+	c[4] = (power_cond & 0x0f) << 4 | start;
+
+	return c;
+}
+
+constexpr cdb<10> read_capacity10() noexcept
+{
+	cdb<10> c{};
+
+	c[0] = 0x25;
+	c.dxfer = PTIO_DXFER_FROM_DEV;
+
+	return c;
+}
+
+constexpr cdb<10> log_sense(uint8_t page, uint8_t subpage,
+			    uint16_t alloc_len) noexcept
+{
+	cdb<10> c{};
+
+	c[0] = 0x4D;
+	c[2] = 0x40 | (page & 0x3f); /* Cumulative values */
+	c[3] = subpage;
+	detail::put_be16(&c[7], alloc_len);
+	c.dxfer = PTIO_DXFER_FROM_DEV;
+
+	return c;
+}
+
+constexpr cdb<12> report_luns(uint32_t alloc_len) noexcept
+{
+	cdb<12> c{};
+
+	c[0] = 0xA0;
+	detail::put_be32(&c[6], alloc_len);
+	c.dxfer = PTIO_DXFER_FROM_DEV;
+
+	return c;
+}
+
+constexpr cdb<16> read_capacity16(uint32_t alloc_len = 32) noexcept
+{
+	cdb<16> c{};
+
+	c[0] = 0x9E;
+	c[1] = 0x10; /* READ CAPACITY (16) service action */
+	detail::put_be32(&c[10], alloc_len);
+	c.dxfer = PTIO_DXFER_FROM_DEV;
+
+	return c;
+}
+
+namespace detail {
+
+constexpr cdb<16> rw16(uint8_t opcode, uint64_t lba, uint32_t nr_blocks,
+		       uint8_t flags, enum ptio_dxfer dxfer) noexcept
+{
+	cdb<16> c{};
+
+	c[0] = opcode;
+	c[1] = flags;
+	ptio::detail::put_be64(&c[2], lba);
+	ptio::detail::put_be32(&c[10], nr_blocks);
+	c.dxfer = dxfer;
+
+	return c;
+}
+
+} /* namespace detail */
+
+constexpr cdb<16> read16(uint64_t lba, uint32_t nr_blocks,
+			 bool fua = false) noexcept
+{
+	return detail::rw16(0x88, lba, nr_blocks, fua << 3,
+			    PTIO_DXFER_FROM_DEV);
+}
+
+constexpr cdb<16> write16(uint64_t lba, uint32_t nr_blocks,
+			  bool fua = false) noexcept
+{
+	return detail::rw16(0x8A, lba, nr_blocks, fua << 3,
+			    PTIO_DXFER_TO_DEV);
+}
+
+constexpr cdb<16> verify16(uint64_t lba, uint32_t nr_blocks) noexcept
+{
+	/* BYTCHK=0: medium verification only, no data transfer */
+	return detail::rw16(0x8F, lba, nr_blocks, 0, PTIO_DXFER_NONE);
+}
+
+constexpr cdb<16> sync_cache16(uint64_t lba = 0,
+			       uint32_t nr_blocks = 0) noexcept
+{
+	return detail::rw16(0x91, lba, nr_blocks, 0, PTIO_DXFER_NONE);
+}
+
+} /* namespace scsi */
+
+/*
+ * ATA commands, as ATA PASS-THROUGH (16) CDBs. The command descriptors
+ * match the ATA command table used for PTIO_CDB_ATA commands.
+ */
+namespace ata {
+
+enum class prot : uint8_t {
+	non_data	= 0x03,
+	pio_in		= 0x04,
+	pio_out		= 0x05,
+	dma		= 0x06,
+	exec_diag	= 0x08,
+	ncq		= 0x0C,
+};
+
+struct command {
+	uint8_t			opcode;
+	prot			protocol;
+	bool			lba_48;
+	enum ptio_dxfer		dxfer;
+};
+
+inline constexpr command check_power_mode_cmd
+	{ 0xE5, prot::non_data, false, PTIO_DXFER_NONE };
+inline constexpr command data_set_management_cmd
+	{ 0x06, prot::dma, true, PTIO_DXFER_TO_DEV };
+inline constexpr command download_microcode_cmd
+	{ 0x92, prot::pio_out, false, PTIO_DXFER_TO_DEV };
+inline constexpr command download_microcode_dma_cmd
+	{ 0x93, prot::dma, false, PTIO_DXFER_TO_DEV };
+inline constexpr command flush_cache_cmd
+	{ 0xE7, prot::non_data, false, PTIO_DXFER_NONE };
+inline constexpr command flush_cache_ext_cmd
+	{ 0xEA, prot::non_data, true, PTIO_DXFER_NONE };
+inline constexpr command identify_device_cmd
+	{ 0xEC, prot::pio_in, false, PTIO_DXFER_FROM_DEV };
+inline constexpr command idle_immediate_cmd
+	{ 0xE1, prot::non_data, false, PTIO_DXFER_NONE };
+inline constexpr command read_buffer_cmd
+	{ 0xE4, prot::pio_in, false, PTIO_DXFER_FROM_DEV };
+inline constexpr command read_buffer_dma_cmd
+	{ 0xE9, prot::dma, false, PTIO_DXFER_FROM_DEV };
+inline constexpr command read_dma_ext_cmd
+	{ 0x25, prot::dma, true, PTIO_DXFER_FROM_DEV };
+inline constexpr command read_fpdma_queued_cmd
+	{ 0x60, prot::ncq, true, PTIO_DXFER_FROM_DEV };
+inline constexpr command read_log_dma_ext_cmd
+	{ 0x47, prot::dma, true, PTIO_DXFER_FROM_DEV };
+inline constexpr command read_log_ext_cmd
+	{ 0x2F, prot::pio_in, true, PTIO_DXFER_FROM_DEV };
+inline constexpr command read_verify_sectors_ext_cmd
+	{ 0x42, prot::non_data, true, PTIO_DXFER_NONE };
+inline constexpr command sanitize_device_cmd
+	{ 0xB4, prot::non_data, true, PTIO_DXFER_NONE };
+inline constexpr command set_features_cmd
+	{ 0xEF, prot::non_data, false, PTIO_DXFER_NONE };
+inline constexpr command smart_cmd
+	{ 0xB0, prot::non_data, false, PTIO_DXFER_NONE };
+inline constexpr command smart_read_log_cmd
+	{ 0xB0, prot::pio_in, false, PTIO_DXFER_FROM_DEV };
+inline constexpr command standby_immediate_cmd
+	{ 0xE0, prot::non_data, false, PTIO_DXFER_NONE };
+inline constexpr command write_dma_ext_cmd
+	{ 0x35, prot::dma, true, PTIO_DXFER_TO_DEV };
+inline constexpr command write_dma_fua_ext_cmd
+	{ 0x3D, prot::dma, true, PTIO_DXFER_TO_DEV };
+inline constexpr command write_fpdma_queued_cmd
+	{ 0x61, prot::ncq, true, PTIO_DXFER_TO_DEV };
+inline constexpr command write_log_dma_ext_cmd
+	{ 0x57, prot::dma, true, PTIO_DXFER_TO_DEV };
+inline constexpr command zero_ext_cmd
+	{ 0x44, prot::non_data, true, PTIO_DXFER_NONE };
+
+/*
+ * Build the ATA PASS-THROUGH (16) CDB of the command @C, using the same
+ * encoding as for PTIO_CDB_ATA commands: for NCQ commands, the transfer
+ * length is in the FEATURE field, otherwise in the COUNT field, in 512 B
+ * blocks. The command descriptor is a template argument so that its
+ * consistency is checked at compile time.
+ */
+template <command C>
+constexpr cdb<16> build(uint16_t feature, uint16_t count, uint64_t lba,
+			uint8_t device = 0x40, bool ck_cond = false) noexcept
+{
+	static_assert(C.protocol != prot::ncq || C.lba_48,
+		      "NCQ commands are 48-bits commands");
+	static_assert(C.protocol != prot::non_data ||
+		      C.dxfer == PTIO_DXFER_NONE,
+		      "Non-data commands do not transfer data");
+	static_assert(C.protocol == prot::non_data ||
+		      C.protocol == prot::exec_diag ||
+		      C.dxfer != PTIO_DXFER_NONE,
+		      "Data commands need a transfer direction");
+
+	uint8_t t_length = 0, t_dir = 0;
+	cdb<16> c{};
+
+	if constexpr (C.dxfer != PTIO_DXFER_NONE) {
+		t_length = C.protocol == prot::ncq ? 0x1 : 0x2;
+		t_dir = C.dxfer == PTIO_DXFER_FROM_DEV;
+	}
+
+	c[0] = 0x85; /* ATA 16 */
+	c[1] = (static_cast<uint8_t>(C.protocol) & 0x0f) << 1 | C.lba_48;
+	/* off_line=0, t_type=0, byt_blk=1 */
+	c[2] = ck_cond << 5 | t_dir << 3 | 1 << 2 | t_length;
+
+	if constexpr (C.lba_48) {
+		detail::put_be16(&c[3], feature);
+		detail::put_be16(&c[5], count);
+		c[7] = lba >> 24; /* LBA 31:24 */
+		c[9] = lba >> 32; /* LBA 39:32 */
+		c[11] = lba >> 40; /* LBA 47:40 */
+	} else {
+		c[4] = feature;
+		c[6] = count;
+		c[7] = (lba >> 24) & 0x0f; /* LBA 27:24 */
+	}
+	c[8] = lba; /* LBA 7:0 */
+	c[10] = lba >> 8; /* LBA 15:8 */
+	c[12] = lba >> 16; /* LBA 23:16 */
+	c[13] = device;
+	c[14] = C.opcode;
+	c.dxfer = C.dxfer;
+
+	return c;
+}
+
+constexpr cdb<16> identify_device() noexcept
+{
+	return build<identify_device_cmd>(0, 1, 0, 0);
+}
+
+constexpr cdb<16> check_power_mode() noexcept
+{
+	/* The power mode is returned in the COUNT output register */
+	return build<check_power_mode_cmd>(0, 0, 0, 0, true);
+}
+
+constexpr cdb<16> read_log_ext(uint8_t log, uint16_t page,
+			       uint16_t nr_pages) noexcept
+{
+	return build<read_log_ext_cmd>(0, nr_pages,
+				       (uint64_t)page << 8 | log, 0);
+}
+
+constexpr cdb<16> read_log_dma_ext(uint8_t log, uint16_t page,
+				   uint16_t nr_pages) noexcept
+{
+	return build<read_log_dma_ext_cmd>(0, nr_pages,
+					   (uint64_t)page << 8 | log, 0);
+}
+
+constexpr cdb<16> read_dma_ext(uint64_t lba, uint16_t nr_sectors) noexcept
+{
+	return build<read_dma_ext_cmd>(0, nr_sectors, lba);
+}
+
+constexpr cdb<16> write_dma_ext(uint64_t lba, uint16_t nr_sectors) noexcept
+{
+	return build<write_dma_ext_cmd>(0, nr_sectors, lba);
+}
+
+constexpr cdb<16> read_fpdma_queued(uint64_t lba, uint16_t nr_sectors,
+				    uint8_t tag = 0) noexcept
+{
+	return build<read_fpdma_queued_cmd>(nr_sectors, tag << 3, lba);
+}
+
+constexpr cdb<16> write_fpdma_queued(uint64_t lba, uint16_t nr_sectors,
+				     uint8_t tag = 0) noexcept
+{
+	return build<write_fpdma_queued_cmd>(nr_sectors, tag << 3, lba);
+}
+
+constexpr cdb<16> read_verify_sectors_ext(uint64_t lba,
+					  uint16_t nr_sectors) noexcept
+{
+	return build<read_verify_sectors_ext_cmd>(0, nr_sectors, lba);
+}
+
+constexpr cdb<16> flush_cache_ext() noexcept
+{
+	return build<flush_cache_ext_cmd>(0, 0, 0);
+}
+
+constexpr cdb<16> zero_ext(uint64_t lba, uint16_t nr_sectors,
+			   bool trim = false) noexcept
+{
+	return build<zero_ext_cmd>(trim, nr_sectors, lba);
+}
+
+constexpr cdb<16> set_features(uint8_t feature, uint8_t count = 0) noexcept
+{
+	return build<set_features_cmd>(feature, count, 0, 0);
+}
+
+constexpr cdb<16> smart_return_status() noexcept
+{
+	/* The status is returned in the LBA output registers */
+	return build<smart_cmd>(0xDA, 0, 0xC24F00, 0, true);
+}
+
+constexpr cdb<16> smart_read_log(uint8_t log, uint8_t nr_pages) noexcept
+{
+	return build<smart_read_log_cmd>(0xD5, nr_pages,
+					 0xC24F00 | log, 0);
+}
+
+constexpr cdb<16> standby_immediate() noexcept
+{
+	return build<standby_immediate_cmd>(0, 0, 0, 0);
+}
+
+constexpr cdb<16> idle_immediate() noexcept
+{
+	return build<idle_immediate_cmd>(0, 0, 0, 0);
+}
+
+} /* namespace ata */
+
+/*
+ * Buffer suitable for command data transfers (page aligned).
+ */
+class buffer {
+public:
+	explicit buffer(std::size_t size)
+		: data_(ptio_alloc_buf(size)), size_(size)
+	{
+		if (!data_)
+			throw std::bad_alloc();
+	}
+
+	/* Buffer allocated on the NUMA node of the host adapter of @dev */
+	buffer(struct ptio_dev *dev, std::size_t size)
+		: data_(ptio_alloc_dev_buf(dev, size)), size_(size)
+	{
+		if (!data_)
+			throw std::bad_alloc();
+	}
+
+	buffer(buffer &&other) noexcept
+		: data_(std::exchange(other.data_, nullptr)),
+		  size_(std::exchange(other.size_, 0))
+	{
+	}
+
+	buffer &operator=(buffer &&other) noexcept
+	{
+		if (this != &other) {
+			std::free(data_);
+			data_ = std::exchange(other.data_, nullptr);
+			size_ = std::exchange(other.size_, 0);
+		}
+		return *this;
+	}
+
+	buffer(const buffer &) = delete;
+	buffer &operator=(const buffer &) = delete;
+
+	~buffer()
+	{
+		std::free(data_);
+	}
+
+	uint8_t *data() noexcept { return data_; }
+	const uint8_t *data() const noexcept { return data_; }
+	std::size_t size() const noexcept { return size_; }
+
+	std::span<uint8_t> span() noexcept { return { data_, size_ }; }
+	operator std::span<uint8_t>() noexcept { return span(); }
+
+private:
+	uint8_t			*data_;
+	std::size_t		size_;
+};
+
+/*
+ * Open device. The device is opened on construction, throwing
+ * std::system_error on failure, and closed on destruction. Command
+ * execution returns the libptio error code, as ptio_exec_cmd() does, so that
+ * command failures do not need exceptions.
+ */
+class device {
+public:
+	explicit device(std::string path,
+			enum ptio_dxfer dxfer = PTIO_DXFER_FROM_DEV)
+		: path_(std::move(path))
+	{
+		int ret;
+
+		dev_.path = path_.data();
+		dev_.fd = -1;
+		ret = ptio_open_dev(&dev_, dxfer);
+		if (ret)
+			throw std::system_error(ret < -1 ? -ret : EIO,
+						std::generic_category(),
+						"Open " + path_ + " failed");
+	}
+
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	~device()
+	{
+		ptio_close_dev(&dev_);
+	}
+
+	struct ptio_dev *get() noexcept { return &dev_; }
+	struct ptio_dev *operator->() noexcept { return &dev_; }
+	bool is_ata() noexcept { return ptio_dev_is_ata(&dev_); }
+
+	int get_information() noexcept
+	{
+		return ptio_get_dev_information(&dev_);
+	}
+
+	int revalidate() noexcept
+	{
+		return ptio_revalidate_dev(&dev_);
+	}
+
+	/*
+	 * Execute the command @c, transferring data in the direction of the
+	 * command, if @buf is not empty.
+	 */
+	template <std::size_t N>
+	int exec(struct ptio_cmd &cmd, const cdb<N> &c,
+		 std::span<uint8_t> buf = {}, uint32_t flags = 0,
+		 unsigned int timeout = 0) noexcept
+	{
+		return ptio_exec_cmd_timeout(&dev_, &cmd,
+				const_cast<uint8_t *>(c.bytes.data()), N,
+				PTIO_CDB_SCSI, buf.data(), buf.size(),
+				buf.empty() ? PTIO_DXFER_NONE : c.dxfer,
+				flags, timeout);
+	}
+
+	template <std::size_t N>
+	int exec(const cdb<N> &c, std::span<uint8_t> buf = {},
+		 uint32_t flags = 0, unsigned int timeout = 0) noexcept
+	{
+		struct ptio_cmd cmd;
+
+		return exec(cmd, c, buf, flags, timeout);
+	}
+
+private:
+	std::string		path_;
+	struct ptio_dev		dev_{};
+};
+
+#if defined(__cpp_impl_coroutine)
+
+/*
+ * Coroutine support: a scheduler executes the commands awaited by
+ * coroutines using the asynchronous command interface, and so requires SCSI
+ * generic devices. Devices are distributed over the scheduler threads, and
+ * a coroutine awaiting a command is resumed by the thread of the device
+ * once the command completes, e.g.:
+ *
+ *	ptio::task scrub(ptio::scheduler &sched, ptio::device &dev)
+ *	{
+ *		int ret = co_await sched.exec(dev, ptio::scsi::verify16(0, 8));
+ *		...
+ *	}
+ */
+
+/*
+ * Detached coroutine: it starts executing immediately, and its frame is
+ * destroyed when it returns.
+ */
+class task {
+public:
+	struct promise_type {
+		task get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+class scheduler {
+	class worker;
+
+public:
+	/*
+	 * Base of command awaiters. A command that cannot be submitted
+	 * because too many commands are outstanding on the device is queued
+	 * and submitted again once a command completes.
+	 */
+	class awaiter_base {
+	public:
+		bool await_ready() const noexcept { return false; }
+
+		bool await_suspend(std::coroutine_handle<> h) noexcept
+		{
+			handle_ = h;
+			return worker_->submit(this);
+		}
+
+		int await_resume() const noexcept { return ret_; }
+
+	protected:
+		friend class scheduler;
+
+		awaiter_base(scheduler *sched, device &dev,
+			     std::span<uint8_t> buf, uint32_t flags,
+			     unsigned int timeout)
+			: worker_(sched->worker_of(dev)), dev_(dev.get()),
+			  buf_(buf), flags_(flags), timeout_(timeout)
+		{
+		}
+
+		virtual ~awaiter_base() = default;
+		virtual int submit() noexcept = 0;
+
+		static void done(struct ptio_dev *, struct ptio_cmd *,
+				 int ret, void *data) noexcept
+		{
+			auto *a = static_cast<awaiter_base *>(data);
+
+			a->ret_ = ret;
+			a->handle_.resume();
+		}
+
+		worker				*worker_;
+		struct ptio_dev			*dev_;
+		std::span<uint8_t>		buf_;
+		uint32_t			flags_;
+		unsigned int			timeout_;
+		struct ptio_cmd			cmd_;
+		int				ret_ = 0;
+		std::coroutine_handle<>		handle_;
+	};
+
+	template <std::size_t N>
+	class awaiter : public awaiter_base {
+	public:
+		awaiter(scheduler *sched, device &dev, const cdb<N> &c,
+			std::span<uint8_t> buf, uint32_t flags,
+			unsigned int timeout)
+			: awaiter_base(sched, dev, buf, flags, timeout), cdb_(c)
+		{
+		}
+
+	private:
+		int submit() noexcept override
+		{
+			return ptio_submit_cmd(dev_, &cmd_,
+				cdb_.bytes.data(), N, PTIO_CDB_SCSI,
+				buf_.data(), buf_.size(),
+				buf_.empty() ? PTIO_DXFER_NONE : cdb_.dxfer,
+				flags_, timeout_, &awaiter_base::done, this);
+		}
+
+		cdb<N>				cdb_;
+	};
+
+	/*
+	 * Create a scheduler with @nr_threads threads, each polling the
+	 * devices it is assigned. All coroutines awaiting commands must be
+	 * done before the scheduler is destroyed.
+	 */
+	explicit scheduler(unsigned int nr_threads = 1)
+	{
+		if (!nr_threads)
+			nr_threads = 1;
+		for (unsigned int i = 0; i < nr_threads; i++)
+			workers_.push_back(std::make_unique<worker>());
+		for (auto &w : workers_)
+			w->start();
+	}
+
+	scheduler(const scheduler &) = delete;
+	scheduler &operator=(const scheduler &) = delete;
+
+	~scheduler()
+	{
+		for (auto &w : workers_)
+			w->stop();
+	}
+
+	/*
+	 * Assign a device to a scheduler thread. All devices must be added
+	 * before commands are awaited.
+	 */
+	void add(device &dev)
+	{
+		worker *w = workers_[devs_.size() % workers_.size()].get();
+		int ret;
+
+		ret = ptio_dev_group_add(w->group(), dev.get());
+		if (ret)
+			throw std::system_error(-ret, std::generic_category(),
+						"Add device to scheduler failed");
+		devs_.emplace(dev.get(), w);
+	}
+
+	/*
+	 * Get an awaitable executing the command @c, as device::exec() does.
+	 * Awaiting it gives the command result.
+	 */
+	template <std::size_t N>
+	awaiter<N> exec(device &dev, const cdb<N> &c,
+			std::span<uint8_t> buf = {}, uint32_t flags = 0,
+			unsigned int timeout = 0)
+	{
+		return awaiter<N>(this, dev, c, buf, flags, timeout);
+	}
+
+private:
+	class worker {
+	public:
+		worker()
+		{
+			grp_ = ptio_open_dev_group();
+			if (!grp_)
+				throw std::bad_alloc();
+		}
+
+		~worker()
+		{
+			ptio_close_dev_group(grp_);
+		}
+
+		struct ptio_dev_group *group() noexcept { return grp_; }
+
+		void start()
+		{
+			thread_ = std::thread([this] { run(); });
+		}
+
+		void stop()
+		{
+			stop_ = true;
+			if (thread_.joinable())
+				thread_.join();
+		}
+
+		/*
+		 * Submit the command of @a. Return false if the command
+		 * failed, in which case the coroutine is not suspended.
+		 */
+		bool submit(awaiter_base *a) noexcept
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			int ret;
+
+			ret = a->submit();
+			if (!ret)
+				return true;
+			if (ret == -EAGAIN) {
+				pending_.push_back(a);
+				return true;
+			}
+
+			a->ret_ = ret;
+			return false;
+		}
+
+	private:
+		/* Poll timeout, to notice a stop request */
+		static constexpr int poll_ms = 100;
+
+		void run()
+		{
+			std::vector<awaiter_base *> failed;
+
+			while (!stop_) {
+				ptio_dev_group_complete(grp_, poll_ms);
+
+				/* Retry the commands waiting for a slot */
+				{
+					std::lock_guard<std::mutex> lock(lock_);
+					std::vector<awaiter_base *> p;
+					int ret;
+
+					p.swap(pending_);
+					for (auto *a : p) {
+						ret = a->submit();
+						if (ret == -EAGAIN) {
+							pending_.push_back(a);
+						} else if (ret) {
+							a->ret_ = ret;
+							failed.push_back(a);
+						}
+					}
+				}
+
+				for (auto *a : failed)
+					a->handle_.resume();
+				failed.clear();
+			}
+		}
+
+		struct ptio_dev_group		*grp_;
+		std::thread			thread_;
+		std::atomic<bool>		stop_ = false;
+		std::mutex			lock_;
+		std::vector<awaiter_base *>	pending_;
+	};
+
+	worker *worker_of(device &dev)
+	{
+		auto it = devs_.find(dev.get());
+
+		if (it == devs_.end())
+			throw std::invalid_argument("Device not added to scheduler");
+		return it->second;
+	}
+
+	std::vector<std::unique_ptr<worker>>		workers_;
+	std::unordered_map<struct ptio_dev *, worker *>	devs_;
+};
+
+#endif /* __cpp_impl_coroutine */
+
+} /* namespace ptio */
+
+#endif /* LIBPTIO_HPP */
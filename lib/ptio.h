@@ -13,17 +13,98 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <time.h>
+#include <sched.h>
 #include <sys/ioctl.h>
 
 int ptio_get_sense(struct ptio_dev *dev, struct ptio_cmd *cmd);
 
+int ptio_init_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd,
+		  uint8_t *cdb, size_t cdbsz, enum ptio_cdb_type cdb_type,
+		  uint8_t *buf, size_t bufsz, enum ptio_dxfer dxfer,
+		  uint32_t flags);
+void ptio_init_io_hdr(struct ptio_dev *dev, struct ptio_cmd *cmd,
+		      unsigned int timeout);
+int ptio_finish_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd, int ret);
+
+bool ptio_sysfs_exists(struct ptio_dev *dev, const char *format, ...);
 unsigned long ptio_sysfs_get_ulong_attr(struct ptio_dev *dev,
 				       const char *format, ...);
 int ptio_sysfs_set_attr(struct ptio_dev *dev, const char *val,
 		       const char *format, ...);
 
+/*
+ * SCSI host, channel, target and LUN of a device.
+ */
+struct ptio_hctl {
+	unsigned int		host;
+	unsigned int		channel;
+	unsigned int		target;
+	unsigned long long	lun;
+};
+
+struct stat;
+int ptio_dev_get_type(struct ptio_dev *dev, struct stat *st);
+int ptio_dev_get_hctl(struct ptio_dev *dev, struct ptio_hctl *hctl);
+int ptio_scsi_host_scan(struct ptio_dev *dev, struct ptio_hctl *hctl);
+
+typedef int (*ptio_job_fn)(void *data, unsigned int idx,
+			   unsigned int worker);
+int ptio_run_jobs(unsigned int nr_jobs, unsigned int nr_threads,
+		  ptio_job_fn fn, void *data);
+int ptio_run_dev_jobs(struct ptio_dev *dev, unsigned int nr_jobs,
+		      unsigned int nr_threads, ptio_job_fn fn, void *data);
+
+int ptio_numa_get_dev_node(struct ptio_dev *dev, struct stat *st);
+int ptio_numa_get_cpus(struct ptio_dev *dev, int node, cpu_set_t *cpus);
+void ptio_numa_account(struct ptio_dev *dev);
+
+size_t ptio_dev_max_xfer(struct ptio_dev *dev);
+
+int ptio_cmd_timeout(struct ptio_dev *dev, struct ptio_cmd *cmd,
+		     unsigned int timeout);
+void ptio_dev_escalate(struct ptio_dev *dev);
+
+void ptio_qos_throttle(struct ptio_dev *dev, struct ptio_cmd *cmd);
+void ptio_qos_complete(struct ptio_dev *dev, unsigned long long lat_ns);
+
+int ptio_power_gate(struct ptio_dev *dev, struct ptio_cmd *cmd);
+void ptio_power_done(struct ptio_dev *dev, struct ptio_cmd *cmd);
+
+void ptio_cache_store(struct ptio_dev *dev, struct ptio_cmd *cmd);
+bool ptio_cache_lookup(struct ptio_dev *dev, struct ptio_cmd *cmd,
+		       unsigned long long max_age_ns);
+void ptio_cache_invalidate(struct ptio_dev *dev);
+bool ptio_cache_get_response(struct ptio_dev *dev, struct ptio_cmd *cmd);
+void ptio_cache_cmd_done(struct ptio_dev *dev, struct ptio_cmd *cmd, int ret);
+void ptio_cache_free(struct ptio_dev *dev);
+
+#define ptio_dev_stat_inc(dev, field)	\
+	__atomic_fetch_add(&(dev)->stats.field, 1, __ATOMIC_RELAXED)
+
+/*
+ * ATA PASS-THROUGH protocols.
+ */
+#define PTIO_SAT_PROT_NON_DATA	0x03
+#define PTIO_SAT_PROT_PIO_IN	0x04
+#define PTIO_SAT_PROT_PIO_OUT	0x05
+#define PTIO_SAT_PROT_DMA	0x06
+#define PTIO_SAT_PROT_NCQ	0x0C
+
 int ptio_ata_prepare_cdb(struct ptio_dev *dev, struct ptio_cmd *cmd,
 			 uint8_t *cdb, size_t cdbsz);
+void ptio_ata_set_cdb16(uint8_t *cdb, uint8_t prot, enum ptio_dxfer dxfer,
+			uint8_t opcode, uint16_t feature, uint16_t count,
+			uint64_t lba);
+void ptio_ata_set_cdb32(uint8_t *cdb, uint8_t prot, enum ptio_dxfer dxfer,
+			uint8_t opcode, uint16_t feature, uint16_t count,
+			uint64_t lba, uint32_t aux);
+int ptio_ata_read_log(struct ptio_dev *dev, uint8_t log,
+		      uint16_t page, bool initialize,
+		      struct ptio_cmd *cmd, uint8_t *buf, size_t bufsz);
+int ptio_ata_log_nr_pages(struct ptio_dev *dev, uint8_t log);
+int ptio_ata_identify(struct ptio_dev *dev, uint8_t *buf);
+bool ptio_ata_set_ck_cond(uint8_t *cdb, size_t cdbsz);
 int ptio_ata_get_information(struct ptio_dev *dev);
 int ptio_ata_revalidate(struct ptio_dev *dev);
 
@@ -37,19 +118,59 @@ int ptio_scsi_vpd_inquiry(struct ptio_dev *dev, uint8_t page,
 int ptio_scsi_get_information(struct ptio_dev *dev);
 int ptio_scsi_revalidate(struct ptio_dev *dev);
 
+static inline unsigned long long ptio_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 static inline bool ptio_verbose(struct ptio_dev *dev)
 {
 	return dev->flags & PTIO_VERBOSE;
 }
 
-#define ptio_dev_info(dev,format,args...)		\
-	printf("PTIO (%s): " format, (dev)->name, ##args)
+void ptio_log_msg(struct ptio_dev *dev, enum ptio_log_level level,
+		  const char *format, ...)
+	__attribute__ ((format (printf, 3, 4)));
+
+static inline enum ptio_log_level ptio_dev_log_level(struct ptio_dev *dev)
+{
+	if (!dev)
+		return PTIO_LOG_INFO;
+	if (dev->log_level)
+		return dev->log_level;
+	return ptio_verbose(dev) ? PTIO_LOG_DEBUG : PTIO_LOG_INFO;
+}
+
+void ptio_log_buf(struct ptio_dev *dev, enum ptio_log_level level,
+		  uint8_t *buf, size_t bufsz);
+
+/*
+ * The level of a message is checked first so that the message arguments
+ * are not evaluated and the message is not formatted if it is not emitted.
+ */
+#define ptio_log(dev,level,format,args...)			\
+	do {							\
+		if ((level) <= ptio_dev_log_level(dev))		\
+			ptio_log_msg(dev, level, format, ##args);	\
+	} while (0)
+
+#define ptio_err(format,args...)				\
+	ptio_log(NULL, PTIO_LOG_ERROR, format, ##args)
+
+#define ptio_dev_err(dev,format,args...)			\
+	ptio_log(dev, PTIO_LOG_ERROR, format, ##args)
+
+#define ptio_dev_warn(dev,format,args...)			\
+	ptio_log(dev, PTIO_LOG_WARNING, format, ##args)
 
-#define ptio_dev_err(dev,format,args...)		\
-	fprintf(stderr, "PTIO (%s): [ERROR]: " format, (dev)->name, ##args)
+#define ptio_dev_info(dev,format,args...)			\
+	ptio_log(dev, PTIO_LOG_INFO, format, ##args)
 
-#define ptio_dev_verbose(dev,format,args...)		\
-	if (ptio_verbose(dev))				\
-		ptio_dev_info(dev, format, ##args)
+#define ptio_dev_verbose(dev,format,args...)			\
+	ptio_log(dev, PTIO_LOG_DEBUG, format, ##args)
 
 #endif /* PTIO_H */
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sysmacros.h>
+#include <linux/major.h>
+
+#include "ptio.h"
+
+/*
+ * Commands are submitted with write() and completed with read() on the SCSI
+ * generic device file, using the sg v3 interface. The device file is set to
+ * non-blocking mode so that submissions fail with -EAGAIN instead of
+ * blocking and so that all available completions can be reaped.
+ */
+#define PTIO_ASYNC_MAX_EVENTS	64
+
+struct ptio_dev_group {
+	int			epfd;
+	unsigned int		nr_devs;
+};
+
+/*
+ * Prepare a device for asynchronous commands: write() and read() of
+ * sg_io_hdr_t are only supported by SCSI generic devices, and would
+ * transfer data with a block device.
+ */
+static int ptio_async_init_dev(struct ptio_dev *dev)
+{
+	struct stat st;
+	int flags;
+
+	if (dev->async)
+		return 0;
+
+	if (fstat(dev->fd, &st) < 0) {
+		ptio_dev_err(dev, "Get device file stat failed %d (%s)\n",
+			     errno, strerror(errno));
+		return -errno;
+	}
+
+	if (!S_ISCHR(st.st_mode) || major(st.st_rdev) != SCSI_GENERIC_MAJOR) {
+		ptio_dev_err(dev,
+			"Asynchronous commands need a SCSI generic device\n");
+		return -EOPNOTSUPP;
+	}
+
+	flags = fcntl(dev->fd, F_GETFL);
+	if (flags < 0 || fcntl(dev->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		ptio_dev_err(dev, "Set non-blocking mode failed %d (%s)\n",
+			     errno, strerror(errno));
+		return -errno;
+	}
+
+	dev->async = true;
+
+	return 0;
+}
+
+/*
+ * Submit a command without waiting for its completion. @done is called
+ * with @data from ptio_complete_cmds() or ptio_dev_group_complete() once
+ * the command completes. Return 0 if the command was submitted, -EAGAIN if
+ * too many commands are outstanding, and a negative error code otherwise,
+ * in which case @done is not called.
+ */
+int ptio_submit_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd,
+		    uint8_t *cdb, size_t cdbsz, enum ptio_cdb_type cdb_type,
+		    uint8_t *buf, size_t bufsz, enum ptio_dxfer dxfer,
+		    uint32_t flags, unsigned int timeout,
+		    ptio_cmd_done_fn done, void *data)
+{
+	ssize_t ret;
+
+	ret = ptio_async_init_dev(dev);
+	if (ret)
+		return ret;
+
+	ret = ptio_init_cmd(dev, cmd, cdb, cdbsz, cdb_type,
+			    buf, bufsz, dxfer, flags);
+	if (ret)
+		return ret;
+
+	cmd->async = true;
+	cmd->done = done;
+	cmd->done_data = data;
+
+	ret = ptio_cmd_timeout(dev, cmd, timeout);
+	if (ret < 0) {
+		ptio_dev_err(dev, "Device deadline expired\n");
+		return ret;
+	}
+
+	ptio_init_io_hdr(dev, cmd, ret);
+	cmd->io_hdr.usr_ptr = cmd;
+
+	cmd->start_ns = ptio_now_ns();
+	do {
+		ret = write(dev->fd, &cmd->io_hdr, sizeof(cmd->io_hdr));
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		/* The sg driver reports a full command queue with EDOM */
+		if (errno == EAGAIN || errno == EDOM)
+			return -EAGAIN;
+		ret = -errno;
+		ptio_dev_err(dev, "Submit command failed %d (%s)\n",
+			     errno, strerror(errno));
+		return ret;
+	}
+
+	ptio_dev_stat_inc(dev, nr_cmds);
+	ptio_numa_account(dev);
+
+	return 0;
+}
+
+/*
+ * Get a file descriptor that is readable when commands submitted to @dev
+ * completed, to be used with poll(), select() or epoll.
+ */
+int ptio_dev_completion_fd(struct ptio_dev *dev)
+{
+	int ret;
+
+	ret = ptio_async_init_dev(dev);
+	if (ret)
+		return ret;
+
+	return dev->fd;
+}
+
+static int ptio_reap_cmds(struct ptio_dev *dev)
+{
+	struct ptio_cmd *cmd;
+	sg_io_hdr_t hdr;
+	ssize_t ret;
+	int nr = 0;
+
+	for (;;) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.interface_id = 'S';
+		ret = read(dev->fd, &hdr, sizeof(hdr));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			ret = -errno;
+			ptio_dev_err(dev, "Get command completion failed %d (%s)\n",
+				     errno, strerror(errno));
+			return ret;
+		}
+
+		cmd = hdr.usr_ptr;
+		cmd->io_hdr = hdr;
+
+		ptio_qos_complete(dev, ptio_now_ns() - cmd->start_ns);
+
+		ret = ptio_finish_cmd(dev, cmd, ptio_get_sense(dev, cmd));
+		if (cmd->done)
+			cmd->done(dev, cmd, ret, cmd->done_data);
+		nr++;
+	}
+
+	return nr;
+}
+
+/*
+ * Do the reset escalation of commands that timed out, after their
+ * completion callbacks were called: resets block until done.
+ */
+static void ptio_async_escalate(struct ptio_dev *dev)
+{
+	if (__atomic_exchange_n(&dev->escalate, false, __ATOMIC_RELAXED))
+		ptio_dev_escalate(dev);
+}
+
+/*
+ * Complete all the commands of @dev that the device completed, calling
+ * their completion callback. This does not wait for outstanding commands.
+ * Return the number of commands completed, or a negative error code.
+ */
+int ptio_complete_cmds(struct ptio_dev *dev)
+{
+	int ret;
+
+	ret = ptio_reap_cmds(dev);
+	ptio_async_escalate(dev);
+
+	return ret;
+}
+
+/*
+ * Create a device group, to wait for the completion of commands submitted
+ * to many devices using a single file descriptor.
+ */
+struct ptio_dev_group *ptio_open_dev_group(void)
+{
+	struct ptio_dev_group *grp;
+
+	grp = calloc(1, sizeof(*grp));
+	if (!grp) {
+		ptio_err("Allocate device group failed\n");
+		return NULL;
+	}
+
+	grp->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (grp->epfd < 0) {
+		ptio_err("Create epoll instance failed %d (%s)\n",
+			 errno, strerror(errno));
+		free(grp);
+		return NULL;
+	}
+
+	return grp;
+}
+
+void ptio_close_dev_group(struct ptio_dev_group *grp)
+{
+	if (!grp)
+		return;
+
+	close(grp->epfd);
+	free(grp);
+}
+
+int ptio_dev_group_add(struct ptio_dev_group *grp, struct ptio_dev *dev)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = dev,
+	};
+	int ret;
+
+	ret = ptio_async_init_dev(dev);
+	if (ret)
+		return ret;
+
+	if (epoll_ctl(grp->epfd, EPOLL_CTL_ADD, dev->fd, &ev) < 0) {
+		ret = -errno;
+		ptio_dev_err(dev, "Add device to group failed %d (%s)\n",
+			     errno, strerror(errno));
+		return ret;
+	}
+
+	grp->nr_devs++;
+
+	return 0;
+}
+
+int ptio_dev_group_remove(struct ptio_dev_group *grp, struct ptio_dev *dev)
+{
+	int ret;
+
+	if (epoll_ctl(grp->epfd, EPOLL_CTL_DEL, dev->fd, NULL) < 0) {
+		ret = -errno;
+		ptio_dev_err(dev, "Remove device from group failed %d (%s)\n",
+			     errno, strerror(errno));
+		return ret;
+	}
+
+	grp->nr_devs--;
+
+	return 0;
+}
+
+/*
+ * Get a file descriptor that is readable when a command submitted to any
+ * device of the group completed. This can itself be added to the caller
+ * epoll instance.
+ */
+int ptio_dev_group_fd(struct ptio_dev_group *grp)
+{
+	return grp->epfd;
+}
+
+/*
+ * Wait up to @timeout_ms (-1 for no limit, 0 to not wait) for command
+ * completions, and complete the commands of all devices of the group that
+ * have completions. Return the number of commands completed, or a negative
+ * error code.
+ */
+int ptio_dev_group_complete(struct ptio_dev_group *grp, int timeout_ms)
+{
+	struct epoll_event evs[PTIO_ASYNC_MAX_EVENTS];
+	int i, n, ret, nr = 0;
+
+	n = epoll_wait(grp->epfd, evs, PTIO_ASYNC_MAX_EVENTS, timeout_ms);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		ret = -errno;
+		ptio_err("Wait for completions failed %d (%s)\n",
+			 errno, strerror(errno));
+		return ret;
+	}
+
+	for (i = 0; i < n; i++) {
+		ret = ptio_reap_cmds(evs[i].data.ptr);
+		if (ret < 0) {
+			nr = ret;
+			break;
+		}
+		nr += ret;
+	}
+
+	/* Escalate once the completions of all devices were processed */
+	for (i = 0; i < n; i++)
+		ptio_async_escalate(evs[i].data.ptr);
+
+	return nr;
+}
@@ -12,7 +12,6 @@
 #include <errno.h>
 #include <assert.h>
 #include <ctype.h>
-#include <dirent.h>
 
 #include "ptio.h"
 
@@ -43,7 +42,7 @@ enum ptio_ata_prot {
 
 struct ptio_ata_cmd {
 	uint8_t			opcode;
-	bool			(*match)(struct ptio_ata_cmd *,
+	bool			(*match)(const struct ptio_ata_cmd *,
 					 uint8_t *, size_t);
 	uint16_t		match_data;
 	enum ptio_ata_prot	prot;
@@ -52,14 +51,14 @@ struct ptio_ata_cmd {
 	const char		*name;
 };
 
-static bool ptio_ata_match_opcode(struct ptio_ata_cmd *cmd,
+static bool ptio_ata_match_opcode(const struct ptio_ata_cmd *cmd,
 				  uint8_t *cdb, size_t cdbsz)
 {
 	/* For both 28-bits and 48-bits CDBs, the last byte is the opcode. */
 	return cdb[cdbsz - 1] == cmd->opcode;
 }
 
-static bool ptio_ata_match_feat(struct ptio_ata_cmd *cmd,
+static bool ptio_ata_match_feat(const struct ptio_ata_cmd *cmd,
 				uint8_t *cdb, size_t cdbsz)
 {
 	uint16_t features;
@@ -76,7 +75,7 @@ static bool ptio_ata_match_feat(struct ptio_ata_cmd *cmd,
 	return features == cmd->match_data;
 }
 
-static bool ptio_ata_match_feat_f(struct ptio_ata_cmd *cmd,
+static bool ptio_ata_match_feat_f(const struct ptio_ata_cmd *cmd,
 				  uint8_t *cdb, size_t cdbsz)
 {
 	uint16_t features;
@@ -94,7 +93,7 @@ static bool ptio_ata_match_feat_f(struct ptio_ata_cmd *cmd,
 	return (features & 0x0F) == cmd->match_data;
 }
 
-static bool ptio_ata_match_fq(struct ptio_ata_cmd *cmd,
+static bool ptio_ata_match_fq(const struct ptio_ata_cmd *cmd,
 			      uint8_t *cdb, size_t cdbsz)
 {
 	uint16_t count;
@@ -113,7 +112,7 @@ static bool ptio_ata_match_fq(struct ptio_ata_cmd *cmd,
 	return ((count >> 8) & 0x0F) == cmd->match_data;
 }
 
-static struct ptio_ata_cmd ata_cmd[] =
+static const struct ptio_ata_cmd ata_cmd[] =
 {
 	{ 0xE5, ptio_ata_match_opcode, 0x00, PTIO_ATA_NOD, false, false, "CHECK_POWER_MODE" },
 	{ 0x14, ptio_ata_match_opcode, 0x00, PTIO_ATA_NOD, false,  true, "CLEAR_DEVICE_FAULT_EXT" },
@@ -230,13 +229,16 @@ static struct ptio_ata_cmd ata_cmd[] =
 	{  },
 };
 
-static struct ptio_ata_cmd vendor_atacmd;
-
-static struct ptio_ata_cmd *ptio_ata_find_cmd(struct ptio_dev *dev,
-					      struct ptio_cmd *cmd,
-					      uint8_t *cdb, size_t cdbsz)
+/*
+ * Find the descriptor of the command defined by @cdb. For unknown commands,
+ * @vendor, which is provided by the caller, is initialized and returned, so
+ * that no shared state is modified.
+ */
+static const struct ptio_ata_cmd *
+ptio_ata_find_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd,
+		  uint8_t *cdb, size_t cdbsz, struct ptio_ata_cmd *vendor)
 {
-	struct ptio_ata_cmd *atacmd = &ata_cmd[0];
+	const struct ptio_ata_cmd *atacmd = &ata_cmd[0];
 
 	while (atacmd->name) {
 		if (atacmd->match(atacmd, cdb, cdbsz)) {
@@ -254,16 +256,17 @@ static struct ptio_ata_cmd *ptio_ata_find_cmd(struct ptio_dev *dev,
 			 cdb[cdbsz - 1],
 			 cdbsz == PTIO_ATA_LBA48_CDBSZ ? 48 : 28);
 
-	vendor_atacmd.opcode = cdb[cdbsz - 1];
+	memset(vendor, 0, sizeof(*vendor));
+	vendor->opcode = cdb[cdbsz - 1];
 	if (!cmd->bufsz)
-		vendor_atacmd.prot = PTIO_ATA_NOD;
+		vendor->prot = PTIO_ATA_NOD;
 	else
-		vendor_atacmd.prot = PTIO_ATA_DMA;
-	vendor_atacmd.ncq = false;
-	vendor_atacmd.lba_48 = (cdbsz == PTIO_ATA_LBA48_CDBSZ);
-	vendor_atacmd.name = "Vendor unique";
+		vendor->prot = PTIO_ATA_DMA;
+	vendor->ncq = false;
+	vendor->lba_48 = (cdbsz == PTIO_ATA_LBA48_CDBSZ);
+	vendor->name = "Vendor unique";
 
-	return &vendor_atacmd;
+	return vendor;
 }
 
 /*
@@ -271,10 +274,10 @@ static struct ptio_ata_cmd *ptio_ata_find_cmd(struct ptio_dev *dev,
  */
 static int ptio_ata_prepare_scsi_cdb(struct ptio_dev *dev,
 				     struct ptio_cmd *cmd,
-				     struct ptio_ata_cmd *atacmd,
+				     const struct ptio_ata_cmd *atacmd,
 				     uint8_t *cdb, size_t cdbsz)
 {
-	uint8_t t_dir, t_length, t_type;
+	uint8_t t_dir, t_length, t_type, ck_cond;
 	uint8_t prot, extend, byte_block;
 	uint64_t lba;
 
@@ -331,6 +334,11 @@ static int ptio_ata_prepare_scsi_cdb(struct ptio_dev *dev,
 	else
 		t_type = 0;
 
+	if (cmd->flags & PTIO_CMD_ATA_CK_COND)
+		ck_cond = 1;
+	else
+		ck_cond = 0;
+
 	if (atacmd->lba_48)
 		extend = 1;
 	else
@@ -343,6 +351,7 @@ static int ptio_ata_prepare_scsi_cdb(struct ptio_dev *dev,
 
 	cmd->cdb[1] = ((prot & 0x0f) << 1) | (extend & 0x01);
 	cmd->cdb[2] =
+		((ck_cond & 0x01) << 5) |
 		((t_type & 0x01) << 4) |
 		((t_dir & 0x01) << 3) |
 		((byte_block & 0x01) << 2) |
@@ -406,7 +415,8 @@ static int ptio_ata_prepare_scsi_cdb(struct ptio_dev *dev,
 int ptio_ata_prepare_cdb(struct ptio_dev *dev, struct ptio_cmd *cmd,
 			 uint8_t *cdb, size_t cdbsz)
 {
-	struct ptio_ata_cmd *atacmd;
+	const struct ptio_ata_cmd *atacmd;
+	struct ptio_ata_cmd vendor;
 
 	/* Check the CDB size */
 	if (cdbsz != PTIO_ATA_LBA28_CDBSZ && cdbsz != PTIO_ATA_LBA48_CDBSZ) {
@@ -415,7 +425,7 @@ int ptio_ata_prepare_cdb(struct ptio_dev *dev, struct ptio_cmd *cmd,
 	}
 
 	/* Find a matching command for the CDB and re-check its size */
-	atacmd = ptio_ata_find_cmd(dev, cmd, cdb, cdbsz);
+	atacmd = ptio_ata_find_cmd(dev, cmd, cdb, cdbsz, &vendor);
 	if (atacmd->lba_48 && cdbsz != PTIO_ATA_LBA48_CDBSZ) {
 		ptio_dev_err(dev,
 			     "%s is a 48-bits commands: CDB must be %d B\n",
@@ -433,12 +443,104 @@ int ptio_ata_prepare_cdb(struct ptio_dev *dev, struct ptio_cmd *cmd,
 	return ptio_ata_prepare_scsi_cdb(dev, cmd, atacmd, cdb, cdbsz);
 }
 
+/*
+ * Initialize an ATA 16 passthrough CDB for a 48-bits command using the SAT
+ * protocol @prot. The transfer length, if any, is in 512 B blocks and
+ * specified by the COUNT field, or by the FEATURE field for NCQ commands.
+ */
+void ptio_ata_set_cdb16(uint8_t *cdb, uint8_t prot, enum ptio_dxfer dxfer,
+			uint8_t opcode, uint16_t feature, uint16_t count,
+			uint64_t lba)
+{
+	uint8_t t_length = 0, t_dir = 0;
+
+	if (dxfer != PTIO_DXFER_NONE) {
+		t_length = prot == PTIO_SAT_PROT_NCQ ? 0x1 : 0x2;
+		t_dir = dxfer == PTIO_DXFER_FROM_DEV;
+	}
+
+	memset(cdb, 0, 16);
+	cdb[0] = 0x85; /* ATA 16 */
+	cdb[1] = ((prot & 0x0f) << 1) | 0x01; /* ext=1 */
+	/* off_line=0, ck_cond=0, t_type=0, byt_blk=1 */
+	cdb[2] = ((t_dir & 0x01) << 3) | (1 << 2) | t_length;
+	ptio_set_be16(&cdb[3], feature);
+	ptio_set_be16(&cdb[5], count);
+	cdb[7] = (lba >> 24) & 0xff; /* LBA 31:24 */
+	cdb[8] = lba & 0xff; /* LBA 7:0 */
+	cdb[9] = (lba >> 32) & 0xff; /* LBA 39:32 */
+	cdb[10] = (lba >> 8) & 0xff; /* LBA 15:8 */
+	cdb[11] = (lba >> 40) & 0xff; /* LBA 47:40 */
+	cdb[12] = (lba >> 16) & 0xff; /* LBA 23:16 */
+	cdb[13] = 1 << 6; /* Device: LBA mode */
+	cdb[14] = opcode;
+}
+
+/*
+ * Set the ck_cond bit of an ATA PASS-THROUGH (12), (16) or (32) CDB so that
+ * the device output registers are returned as sense data. Return false if
+ * @cdb is not an ATA PASS-THROUGH CDB.
+ */
+bool ptio_ata_set_ck_cond(uint8_t *cdb, size_t cdbsz)
+{
+	switch (cdb[0]) {
+	case 0xa1: /* ATA 12 */
+	case 0x85: /* ATA 16 */
+		if (cdbsz < 12)
+			return false;
+		cdb[2] |= 0x20;
+		return true;
+	case 0x7f: /* Variable length CDB */
+		if (cdbsz < 32 || ptio_get_be16(&cdb[8]) != 0x1ff0)
+			return false;
+		cdb[11] |= 0x20;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Initialize an ATA PASS-THROUGH (32) CDB for a 48-bits command. Unlike the
+ * ATA 16 CDB, this CDB allows specifying the AUXILIARY field, which is needed
+ * for some NCQ commands.
+ */
+void ptio_ata_set_cdb32(uint8_t *cdb, uint8_t prot, enum ptio_dxfer dxfer,
+			uint8_t opcode, uint16_t feature, uint16_t count,
+			uint64_t lba, uint32_t aux)
+{
+	uint8_t t_length = 0, t_dir = 0;
+
+	if (dxfer != PTIO_DXFER_NONE) {
+		t_length = prot == PTIO_SAT_PROT_NCQ ? 0x1 : 0x2;
+		t_dir = dxfer == PTIO_DXFER_FROM_DEV;
+	}
+
+	memset(cdb, 0, 32);
+	cdb[0] = 0x7f; /* Variable length CDB */
+	cdb[7] = 0x18; /* Additional CDB length */
+	ptio_set_be16(&cdb[8], 0x1ff0); /* ATA PASS-THROUGH (32) */
+	cdb[10] = ((prot & 0x0f) << 1) | 0x01; /* ext=1 */
+	cdb[11] = ((t_dir & 0x01) << 3) | (1 << 2) | t_length;
+	cdb[14] = (lba >> 40) & 0xff; /* LBA 47:40 */
+	cdb[15] = (lba >> 32) & 0xff; /* LBA 39:32 */
+	cdb[16] = (lba >> 24) & 0xff; /* LBA 31:24 */
+	cdb[17] = (lba >> 16) & 0xff; /* LBA 23:16 */
+	cdb[18] = (lba >> 8) & 0xff; /* LBA 15:8 */
+	cdb[19] = lba & 0xff; /* LBA 7:0 */
+	ptio_set_be16(&cdb[20], feature);
+	ptio_set_be16(&cdb[22], count);
+	cdb[24] = 1 << 6; /* Device: LBA mode */
+	cdb[25] = opcode;
+	ptio_set_be32(&cdb[28], aux);
+}
+
 /*
  * Read a log page.
  */
-static int ptio_ata_read_log(struct ptio_dev *dev, uint8_t log,
-			    uint16_t page, bool initialize,
-			    struct ptio_cmd *cmd, uint8_t *buf, size_t bufsz)
+int ptio_ata_read_log(struct ptio_dev *dev, uint8_t log,
+		      uint16_t page, bool initialize,
+		      struct ptio_cmd *cmd, uint8_t *buf, size_t bufsz)
 {
 	uint8_t cdb[16] = {};
 
@@ -518,6 +620,26 @@ int ptio_ata_log_nr_pages(struct ptio_dev *dev, uint8_t log)
 	return ptio_get_le16(&buf[log * 2]);
 }
 
+/*
+ * Get the 512 B of IDENTIFY DEVICE data of @dev.
+ */
+int ptio_ata_identify(struct ptio_dev *dev, uint8_t *buf)
+{
+	uint8_t cdb[PTIO_ATA_LBA28_CDBSZ] = {};
+	struct ptio_cmd cmd;
+	int ret;
+
+	cdb[7] = 0xEC; /* IDENTIFY DEVICE */
+	ret = ptio_exec_cmd(dev, &cmd, cdb, sizeof(cdb), PTIO_CDB_ATA,
+			    buf, 512, PTIO_DXFER_FROM_DEV, 0);
+	if (ret) {
+		ptio_dev_err(dev, "IDENTIFY DEVICE failed\n");
+		return ret;
+	}
+
+	return 0;
+}
+
 static int ptio_ata_get_acs_ver(struct ptio_dev *dev)
 {
 	uint8_t buf[512] = {};
@@ -603,60 +725,18 @@ int ptio_ata_get_information(struct ptio_dev *dev)
 }
 
 /*
- * Force device revalidation.
+ * Force device revalidation, scanning only the device channel, target and
+ * LUN rather than the entire host.
  */
 int ptio_ata_revalidate(struct ptio_dev *dev)
 {
-	const char *scan = "- - -";
-	char path[PATH_MAX];
-	char host[32], *h;
-	struct dirent *dirent;
-	FILE *f = NULL;
-	int ret = 0;
-	DIR *d;
-
-	sprintf(path, "/sys/block/%s/device/scsi_device", dev->name);
-	d = opendir(path);
-	if (!d) {
-		ptio_dev_err(dev, "Open %s failed\n", path);
-		return -1;
-	}
-
-	while ((dirent = readdir(d))) {
-		if (dirent->d_name[0] != '.')
-			break;
-	}
-	if (!dirent) {
-		ptio_dev_err(dev, "Read %s failed\n", path);
-		goto close;
-	}
-
-	strcpy(host, dirent->d_name);
-	h = strchr(host, ':');
-	if (!h) {
-		ptio_dev_err(dev, "Parse %s entry failed\n", path);
-		goto close;
-	}
-	*h = '\0';
-
-	sprintf(path, "/sys/class/scsi_host/host%s/scan", host);
-
-	f = fopen(path, "w");
-	if (!f) {
-		ptio_dev_err(dev, "Open %s failed\n", path);
-		goto close;
-	}
-
-	if (!fwrite(scan, strlen(scan), 1, f)) {
-		ptio_dev_err(dev, "Write %s failed\n", path);
-		ret = -1;
-	}
-
-	fclose(f);
+	struct ptio_hctl hctl;
+	int ret;
 
-close:
-	closedir(d);
+	ret = ptio_dev_get_hctl(dev, &hctl);
+	if (ret)
+		return ret;
 
-	return ret;
+	return ptio_scsi_host_scan(dev, &hctl);
 }
 
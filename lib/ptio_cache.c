@@ -0,0 +1,318 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ptio.h"
+
+/*
+ * Per device store of command responses, keyed on the command CDB.
+ */
+#define PTIO_CACHE_NR_BUCKETS	64
+#define PTIO_CACHE_MAX_BUFSZ	(64 * 1024)
+
+struct ptio_cache_entry {
+	struct ptio_cache_entry	*next;
+	uint8_t			cdb[PTIO_CDB_MAX_SIZE];
+	size_t			cdbsz;
+	unsigned long long	time_ns;
+	size_t			bufsz;
+	uint8_t			buf[];
+};
+
+struct ptio_cache {
+	pthread_mutex_t		lock;
+	struct ptio_cache_entry	*buckets[PTIO_CACHE_NR_BUCKETS];
+};
+
+static unsigned int ptio_cache_hash(uint8_t *cdb, size_t cdbsz)
+{
+	unsigned int h = 2166136261U;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < cdbsz; i++) {
+		h ^= cdb[i];
+		h *= 16777619U;
+	}
+
+	return h % PTIO_CACHE_NR_BUCKETS;
+}
+
+static struct ptio_cache *ptio_cache_get(struct ptio_dev *dev, bool create)
+{
+	struct ptio_cache *cache, *old = NULL;
+
+	cache = __atomic_load_n(&dev->cache, __ATOMIC_ACQUIRE);
+	if (cache || !create)
+		return cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	pthread_mutex_init(&cache->lock, NULL);
+
+	if (!__atomic_compare_exchange_n(&dev->cache, &old, cache, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* Lost the race */
+		pthread_mutex_destroy(&cache->lock);
+		free(cache);
+		return old;
+	}
+
+	return cache;
+}
+
+static struct ptio_cache_entry **
+ptio_cache_find(struct ptio_cache *cache, uint8_t *cdb, size_t cdbsz)
+{
+	struct ptio_cache_entry **e;
+
+	e = &cache->buckets[ptio_cache_hash(cdb, cdbsz)];
+	while (*e) {
+		if ((*e)->cdbsz == cdbsz && memcmp((*e)->cdb, cdb, cdbsz) == 0)
+			break;
+		e = &(*e)->next;
+	}
+
+	return e;
+}
+
+/*
+ * Save the data returned by a successful command.
+ */
+void ptio_cache_store(struct ptio_dev *dev, struct ptio_cmd *cmd)
+{
+	struct ptio_cache_entry *ent, **e;
+	struct ptio_cache *cache;
+
+	if (cmd->dxfer != PTIO_DXFER_FROM_DEV ||
+	    cmd->bufsz > PTIO_CACHE_MAX_BUFSZ)
+		return;
+
+	cache = ptio_cache_get(dev, true);
+	if (!cache)
+		return;
+
+	ent = malloc(sizeof(*ent) + cmd->bufsz);
+	if (!ent)
+		return;
+	memcpy(ent->cdb, cmd->cdb, cmd->cdbsz);
+	ent->cdbsz = cmd->cdbsz;
+	ent->time_ns = ptio_now_ns();
+	ent->bufsz = cmd->bufsz;
+	memcpy(ent->buf, cmd->buf, cmd->bufsz);
+
+	pthread_mutex_lock(&cache->lock);
+	e = ptio_cache_find(cache, cmd->cdb, cmd->cdbsz);
+	if (*e) {
+		ent->next = (*e)->next;
+		free(*e);
+	} else {
+		ent->next = NULL;
+	}
+	*e = ent;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Complete @cmd using the saved data of a previous execution, if it is not
+ * older than @max_age_ns (0 for no limit). Return true on success.
+ */
+bool ptio_cache_lookup(struct ptio_dev *dev, struct ptio_cmd *cmd,
+		       unsigned long long max_age_ns)
+{
+	struct ptio_cache_entry *ent;
+	struct ptio_cache *cache;
+	bool hit = false;
+
+	if (cmd->dxfer != PTIO_DXFER_FROM_DEV)
+		return false;
+
+	cache = ptio_cache_get(dev, false);
+	if (!cache)
+		return false;
+
+	pthread_mutex_lock(&cache->lock);
+	ent = *ptio_cache_find(cache, cmd->cdb, cmd->cdbsz);
+	if (ent && ent->bufsz <= cmd->bufsz &&
+	    (!max_age_ns || ptio_now_ns() - ent->time_ns <= max_age_ns)) {
+		memcpy(cmd->buf, ent->buf, ent->bufsz);
+		cmd->bufsz = ent->bufsz;
+		cmd->cached = true;
+		hit = true;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return hit;
+}
+
+/*
+ * Drop all saved responses.
+ */
+void ptio_cache_invalidate(struct ptio_dev *dev)
+{
+	struct ptio_cache_entry *ent, *next;
+	struct ptio_cache *cache;
+	int i;
+
+	cache = ptio_cache_get(dev, false);
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < PTIO_CACHE_NR_BUCKETS; i++) {
+		for (ent = cache->buckets[i]; ent; ent = next) {
+			next = ent->next;
+			free(ent);
+		}
+		cache->buckets[i] = NULL;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Test if the response of a prepared command can be cached: identification
+ * commands, for which the response does not change unless the device
+ * configuration changes.
+ */
+static bool ptio_cache_cmd_cacheable(struct ptio_cmd *cmd)
+{
+	uint8_t *cdb = cmd->cdb;
+
+	if (cmd->dxfer != PTIO_DXFER_FROM_DEV)
+		return false;
+
+	switch (cdb[0]) {
+	case 0x12: /* INQUIRY, including VPD pages */
+	case 0x25: /* READ CAPACITY (10) */
+		return true;
+	case 0x9E: /* READ CAPACITY (16) */
+		return (cdb[1] & 0x1F) == 0x10;
+	case 0xA1: /* ATA PASS-THROUGH (12) */
+		return cdb[9] == 0xEC; /* IDENTIFY DEVICE */
+	case 0x85: /* ATA PASS-THROUGH (16) */
+		switch (cdb[14]) {
+		case 0xEC: /* IDENTIFY DEVICE */
+			return true;
+		case 0x2F: /* READ LOG EXT */
+		case 0x47: /* READ LOG DMA EXT */
+			/* GPL directory and IDENTIFY DEVICE data log */
+			return cdb[8] == 0x00 || cdb[8] == 0x30;
+		default:
+			return false;
+		}
+	default:
+		return false;
+	}
+}
+
+/*
+ * Test if a prepared command only reads information from the device.
+ */
+static bool ptio_cache_cmd_read_only(struct ptio_cmd *cmd)
+{
+	uint8_t *cdb = cmd->cdb;
+	uint8_t opcode;
+
+	switch (cdb[0]) {
+	case 0x00: /* TEST UNIT READY */
+	case 0x03: /* REQUEST SENSE */
+	case 0x12: /* INQUIRY */
+	case 0x1A: /* MODE SENSE (6) */
+	case 0x1C: /* RECEIVE DIAGNOSTIC RESULTS */
+	case 0x25: /* READ CAPACITY (10) */
+	case 0x3C: /* READ BUFFER */
+	case 0x4D: /* LOG SENSE */
+	case 0x5A: /* MODE SENSE (10) */
+	case 0x9E: /* SERVICE ACTION IN (16) */
+	case 0xA0: /* REPORT LUNS */
+	case 0xA3: /* MAINTENANCE IN */
+		return true;
+	case 0x85: /* ATA PASS-THROUGH (16) */
+		opcode = cdb[14];
+		break;
+	case 0xA1: /* ATA PASS-THROUGH (12) */
+		opcode = cdb[9];
+		break;
+	default:
+		return false;
+	}
+
+	switch (opcode) {
+	case 0x2F: /* READ LOG EXT */
+	case 0x47: /* READ LOG DMA EXT */
+	case 0xB0: /* SMART */
+	case 0xE4: /* READ BUFFER */
+	case 0xE5: /* CHECK POWER MODE */
+	case 0xE9: /* READ BUFFER DMA */
+	case 0xEC: /* IDENTIFY DEVICE */
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Complete a prepared command using a cached response, if response caching
+ * is enabled and a response not older than the device cache TTL is saved.
+ */
+bool ptio_cache_get_response(struct ptio_dev *dev, struct ptio_cmd *cmd)
+{
+	if (!dev->cache_ttl || !ptio_cache_cmd_cacheable(cmd))
+		return false;
+
+	if (!ptio_cache_lookup(dev, cmd, dev->cache_ttl * 1000000ULL)) {
+		ptio_dev_stat_inc(dev, nr_cache_misses);
+		return false;
+	}
+
+	ptio_dev_stat_inc(dev, nr_cache_hits);
+	ptio_dev_verbose(dev, "Command completed from cache\n");
+
+	return true;
+}
+
+/*
+ * Update the cache once a command is executed: save the response of a
+ * cacheable command, and drop all responses when a command that may change
+ * the device configuration is executed, whether it succeeded or not.
+ * Commands accessing user data, e.g. writes, do not change cached responses.
+ */
+void ptio_cache_cmd_done(struct ptio_dev *dev, struct ptio_cmd *cmd, int ret)
+{
+	if (!__atomic_load_n(&dev->cache, __ATOMIC_ACQUIRE) && !dev->cache_ttl)
+		return;
+
+	if (!ptio_cache_cmd_read_only(cmd) &&
+	    ptio_cmd_class(cmd) != PTIO_CMD_CLASS_IO) {
+		ptio_dev_stat_inc(dev, nr_cache_invalidations);
+		ptio_cache_invalidate(dev);
+		return;
+	}
+
+	if (!ret && dev->cache_ttl && ptio_cache_cmd_cacheable(cmd))
+		ptio_cache_store(dev, cmd);
+}
+
+void ptio_cache_free(struct ptio_dev *dev)
+{
+	struct ptio_cache *cache = dev->cache;
+
+	if (!cache)
+		return;
+
+	ptio_cache_invalidate(dev);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+	dev->cache = NULL;
+}
@@ -18,6 +18,7 @@
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <libgen.h>
+#include <dirent.h>
 
 #include "ptio.h"
 
@@ -55,7 +56,7 @@ int ptio_parse_cdb(char *cdb_str, uint8_t *cdb)
 
 	while (p < p_end) {
 		if (cdbsz >= PTIO_CDB_MAX_SIZE) {
-			fprintf(stderr, "CDB is too large\n");
+			ptio_err("CDB is too large\n");
 			return -1;
 		}
 
@@ -65,13 +66,13 @@ int ptio_parse_cdb(char *cdb_str, uint8_t *cdb)
 		}
 
 		if (!isxdigit(*p)) {
-			fprintf(stderr, "Invalid character in CDB\n");
+			ptio_err("Invalid character in CDB\n");
 			return -1;
 		}
 
 		b = strtol(p, &pe, 16);
 		if (b > 0xff) {
-			fprintf(stderr, "Invalid value in CDB\n");
+			ptio_err("Invalid value in CDB\n");
 			return -1;
 		}
 		p = pe;
@@ -81,49 +82,27 @@ int ptio_parse_cdb(char *cdb_str, uint8_t *cdb)
 	}
 
 	if (!cdbsz) {
-		fprintf(stderr, "Empty CDB\n");
+		ptio_err("Empty CDB\n");
 		return -1;
 	}
 
 	return cdbsz;
 }
 
-/*
- * Print a buffer
- */
-void ptio_print_buf(uint8_t *buf, size_t bufsz)
-{
-	unsigned int l = 0, i;
-
-	printf("  +----------+-------------------------------------------------+\n");
-	printf("  |  OFFSET  | 00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F |\n");
-	printf("  +----------+-------------------------------------------------+\n");
-
-	while (l < bufsz) {
-		printf("  | %08x |", l);
-		for (i = 0; i < 16; i++, l++) {
-			if (l < bufsz)
-				printf(" %02x", (unsigned int)buf[l]);
-			else
-				printf("   ");
-		}
-		printf(" |\n");
-	}
-
-	printf("  +----------+-------------------------------------------------+\n");
-}
-
 #define ptio_cmd_driver_status(cmd)	((cmd)->io_hdr.driver_status & \
 					 PTIO_DRIVER_STATUS_MASK)
 #define ptio_cmd_driver_flags(cmd)	((cmd)->io_hdr.driver_status &  \
 					 PTIO_DRIVER_FLAGS_MASK)
 
-int ptio_exec_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd,
+/*
+ * Initialize a command and prepare its CDB.
+ */
+int ptio_init_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd,
 		  uint8_t *cdb, size_t cdbsz, enum ptio_cdb_type cdb_type,
 		  uint8_t *buf, size_t bufsz, enum ptio_dxfer dxfer,
 		  uint32_t flags)
 {
-	int ret, sg_dxfer;
+	int ret;
 
 	assert(cdbsz <= PTIO_CDB_MAX_SIZE);
 
@@ -133,17 +112,11 @@ int ptio_exec_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd,
 	cmd->dxfer = dxfer;
 	switch (dxfer) {
 	case PTIO_DXFER_NONE:
-		sg_dxfer = SG_DXFER_NONE;
 		break;
 	case PTIO_DXFER_FROM_DEV:
-		cmd->buf = buf;
-		cmd->bufsz = bufsz;
-		sg_dxfer = SG_DXFER_FROM_DEV;
-		break;
 	case PTIO_DXFER_TO_DEV:
 		cmd->buf = buf;
 		cmd->bufsz = bufsz;
-		sg_dxfer = SG_DXFER_TO_DEV;
 		break;
 	default:
 		ptio_dev_err(dev, "Invalid data transfer direction\n");
@@ -179,50 +152,163 @@ int ptio_exec_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd,
 	if (ptio_verbose(dev)) {
 		ptio_dev_info(dev, "Executing command, CDB %zu B, buffer %zu B:\n",
 			      cmd->cdbsz, cmd->bufsz);
-		ptio_print_buf(cmd->cdb, cmd->cdbsz);
+		ptio_log_buf(dev, PTIO_LOG_DEBUG, cmd->cdb, cmd->cdbsz);
 	}
 
-	/* Setup SGIO header */
+	return 0;
+}
+
+/*
+ * Setup the SG_IO header of a prepared command, with a timeout of
+ * @timeout ms.
+ */
+void ptio_init_io_hdr(struct ptio_dev *dev, struct ptio_cmd *cmd,
+		      unsigned int timeout)
+{
 	cmd->io_hdr.interface_id = 'S';
-	cmd->io_hdr.timeout = 30000;
-	cmd->io_hdr.flags = 0x20; /* At head (at tail = 0x10)*/
+	cmd->io_hdr.timeout = timeout;
+	if ((dev->flags & PTIO_QUEUE_AT_TAIL) ||
+	    (cmd->flags & PTIO_CMD_QUEUE_AT_TAIL))
+		cmd->io_hdr.flags = 0x10; /* At tail */
+	else
+		cmd->io_hdr.flags = 0x20; /* At head */
 
 	cmd->io_hdr.cmd_len = cmd->cdbsz;
 	cmd->io_hdr.cmdp = cmd->cdb;
 
 	cmd->io_hdr.dxferp = cmd->buf;
 	cmd->io_hdr.dxfer_len = cmd->bufsz;
-	cmd->io_hdr.dxfer_direction = sg_dxfer;
+	switch (cmd->dxfer) {
+	case PTIO_DXFER_FROM_DEV:
+		cmd->io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+		break;
+	case PTIO_DXFER_TO_DEV:
+		cmd->io_hdr.dxfer_direction = SG_DXFER_TO_DEV;
+		break;
+	default:
+		cmd->io_hdr.dxfer_direction = SG_DXFER_NONE;
+		break;
+	}
 
 	cmd->io_hdr.mx_sb_len = PTIO_SENSE_MAX_LENGTH;
 	cmd->io_hdr.sbp = cmd->sense_buf;
+}
 
-	/* Issue the command using SG_IO */
-	ret = ioctl(dev->fd, SG_IO, &cmd->io_hdr);
-	if (ret != 0) {
-		ret = -errno;
-		ptio_dev_err(dev, "SG_IO ioctl failed %d (%s)\n",
-			     errno, strerror(errno));
+/*
+ * Account for the completion of a command with the result @ret of
+ * ptio_get_sense(), and adjust the command buffer size for any residual.
+ */
+int ptio_finish_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd, int ret)
+{
+	if (ret) {
+		ptio_cache_cmd_done(dev, cmd, ret);
+		ptio_dev_stat_inc(dev, nr_errors);
+		if (ret == -ETIMEDOUT) {
+			ptio_dev_stat_inc(dev, nr_timeouts);
+			/* Do not block the completion of other commands */
+			if (cmd->async)
+				__atomic_store_n(&dev->escalate, true,
+						 __ATOMIC_RELAXED);
+			else
+				ptio_dev_escalate(dev);
+		}
 		return ret;
 	}
 
-	ret = ptio_get_sense(dev, cmd);
-	if (ret)
-		return ret;
-
 	if (cmd->io_hdr.resid) {
-		ptio_dev_info(dev, "SCSI command residual: %u B\n",
+		ptio_dev_verbose(dev, "SCSI command residual: %u B\n",
 			      cmd->io_hdr.resid);
 		cmd->bufsz -= cmd->io_hdr.resid;
 	}
 
+	ptio_cache_cmd_done(dev, cmd, 0);
+	ptio_power_done(dev, cmd);
+
 	return 0;
 }
 
+/*
+ * Execute a command with a timeout of @timeout ms. If @timeout is 0, the
+ * device timeout for the command class is used.
+ */
+int ptio_exec_cmd_timeout(struct ptio_dev *dev, struct ptio_cmd *cmd,
+			  uint8_t *cdb, size_t cdbsz,
+			  enum ptio_cdb_type cdb_type,
+			  uint8_t *buf, size_t bufsz,
+			  enum ptio_dxfer dxfer, uint32_t flags,
+			  unsigned int timeout)
+{
+	unsigned long long start;
+	int ret;
+
+	ret = ptio_init_cmd(dev, cmd, cdb, cdbsz, cdb_type,
+			    buf, bufsz, dxfer, flags);
+	if (ret)
+		return ret;
+
+	if (ptio_cache_get_response(dev, cmd))
+		return 0;
+
+	ret = ptio_power_gate(dev, cmd);
+	if (ret)
+		return ret > 0 ? 0 : ret;
+
+	ptio_qos_throttle(dev, cmd);
+
+	ret = ptio_cmd_timeout(dev, cmd, timeout);
+	if (ret < 0) {
+		ptio_dev_err(dev, "Device deadline expired\n");
+		return ret;
+	}
+
+	/* Setup SGIO header */
+	ptio_init_io_hdr(dev, cmd, ret);
+
+	/* Issue the command using SG_IO */
+	for (;;) {
+		ptio_dev_stat_inc(dev, nr_cmds);
+		ptio_numa_account(dev);
+		start = ptio_now_ns();
+		ret = ioctl(dev->fd, SG_IO, &cmd->io_hdr);
+		if (ret != 0) {
+			ret = -errno;
+			ptio_dev_err(dev, "SG_IO ioctl failed %d (%s)\n",
+				     errno, strerror(errno));
+			ptio_dev_stat_inc(dev, nr_errors);
+			return ret;
+		}
+
+		ptio_qos_complete(dev, ptio_now_ns() - start);
+
+		ret = ptio_get_sense(dev, cmd);
+		if (ret != -EAGAIN)
+			break;
+
+		/* Retry, with a timeout limited by the deadline */
+		ret = ptio_cmd_timeout(dev, cmd, timeout);
+		if (ret < 0) {
+			ptio_dev_err(dev, "Device deadline expired\n");
+			return ret;
+		}
+		cmd->io_hdr.timeout = ret;
+	}
+
+	return ptio_finish_cmd(dev, cmd, ret);
+}
+
+int ptio_exec_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd,
+		  uint8_t *cdb, size_t cdbsz, enum ptio_cdb_type cdb_type,
+		  uint8_t *buf, size_t bufsz, enum ptio_dxfer dxfer,
+		  uint32_t flags)
+{
+	return ptio_exec_cmd_timeout(dev, cmd, cdb, cdbsz, cdb_type,
+				     buf, bufsz, dxfer, flags, 0);
+}
+
 /*
  * Test if a sysfs attribute file exists.
  */
-static bool ptio_sysfs_exists(struct ptio_dev *dev, const char *format, ...)
+bool ptio_sysfs_exists(struct ptio_dev *dev, const char *format, ...)
 {
 	char path[PATH_MAX];
 	struct stat st;
@@ -326,6 +412,96 @@ int ptio_sysfs_set_attr(struct ptio_dev *dev, const char *val,
 	return ret;
 }
 
+/*
+ * Get the SCSI host, channel, target and LUN of a device from the name of
+ * its scsi_device sysfs entry.
+ */
+int ptio_dev_get_hctl(struct ptio_dev *dev, struct ptio_hctl *hctl)
+{
+	char path[PATH_MAX];
+	struct dirent *dirent;
+	int ret = 0;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/device/scsi_device",
+		 dev->name);
+	d = opendir(path);
+	if (!d) {
+		ptio_dev_err(dev, "Open %s failed\n", path);
+		return -1;
+	}
+
+	while ((dirent = readdir(d))) {
+		if (dirent->d_name[0] != '.')
+			break;
+	}
+	if (!dirent) {
+		ptio_dev_err(dev, "Read %s failed\n", path);
+		ret = -1;
+		goto close;
+	}
+
+	if (sscanf(dirent->d_name, "%u:%u:%u:%llu", &hctl->host,
+		   &hctl->channel, &hctl->target, &hctl->lun) != 4) {
+		ptio_dev_err(dev, "Parse %s entry failed\n", path);
+		ret = -1;
+	}
+
+close:
+	closedir(d);
+
+	return ret;
+}
+
+/*
+ * Scan the channel, target and LUN of @hctl on its SCSI host. No wildcard is
+ * ever used, so that other devices of the host are not rescanned.
+ */
+int ptio_scsi_host_scan(struct ptio_dev *dev, struct ptio_hctl *hctl)
+{
+	char val[64];
+	int ret;
+
+	snprintf(val, sizeof(val), "%u %u %llu",
+		 hctl->channel, hctl->target, hctl->lun);
+
+	ptio_dev_verbose(dev, "Scanning host%u: %s\n", hctl->host, val);
+
+	ret = ptio_sysfs_set_attr(dev, val, "/sys/class/scsi_host/host%u/scan",
+				  hctl->host);
+	if (ret)
+		ptio_dev_err(dev, "Scan host%u failed\n", hctl->host);
+
+	return ret;
+}
+
+/*
+ * Get the maximum number of bytes that a single command can transfer.
+ */
+#define PTIO_DEFAULT_MAX_XFER	(128 * 1024)
+
+size_t ptio_dev_max_xfer(struct ptio_dev *dev)
+{
+	unsigned long max_kb;
+	struct stat st;
+	int val;
+
+	if (fstat(dev->fd, &st) == 0 && S_ISCHR(st.st_mode)) {
+		/* For SG nodes, BLKSECTGET returns a number of bytes */
+		if (ioctl(dev->fd, BLKSECTGET, &val) == 0 && val > 0)
+			return val;
+		return PTIO_DEFAULT_MAX_XFER;
+	}
+
+	max_kb = ptio_sysfs_get_ulong_attr(dev,
+				"/sys/block/%s/queue/max_sectors_kb",
+				dev->name);
+	if (!max_kb)
+		return PTIO_DEFAULT_MAX_XFER;
+
+	return max_kb * 1024;
+}
+
 /*
  * Allocate a command buffer.
  */
@@ -334,7 +510,7 @@ uint8_t *ptio_alloc_buf(size_t bufsz)
 	void *buf;
 
 	if (posix_memalign(&buf, sysconf(_SC_PAGESIZE), bufsz)) {
-		fprintf(stderr, "Allocate %zu B buffer failed\n",
+		ptio_err("Allocate %zu B buffer failed\n",
 			bufsz);
 		return NULL;
 	}
@@ -353,7 +529,7 @@ uint8_t *ptio_read_buf(char *path, size_t *bufsz)
 	int fd;
 
 	if (stat(path, &st) < 0) {
-		fprintf(stderr, "Get %s stat failed %d (%s)\n",
+		ptio_err("Get %s stat failed %d (%s)\n",
 			path, errno, strerror(errno));
 		return NULL;
 	}
@@ -364,7 +540,7 @@ uint8_t *ptio_read_buf(char *path, size_t *bufsz)
 
 	fd = open(path, O_RDONLY);
 	if (fd < 0) {
-		fprintf(stderr, "Open %s failed %d (%s)\n",
+		ptio_err("Open %s failed %d (%s)\n",
 			path, errno, strerror(errno));
 		return NULL;
 	}
@@ -372,7 +548,7 @@ uint8_t *ptio_read_buf(char *path, size_t *bufsz)
 	while (sz < st.st_size) {
 		ret = read(fd, buf + sz, st.st_size - sz);
 		if (ret <= 0) {
-			fprintf(stderr, "Read %s failed %d (%s)\n",
+			ptio_err("Read %s failed %d (%s)\n",
 				path, errno, strerror(errno));
 			free(buf);
 			buf = NULL;
@@ -396,7 +572,7 @@ int ptio_write_buf(char *path, uint8_t *buf, size_t bufsz)
 
 	fd = open(path, O_WRONLY | O_CREAT, 0644);
 	if (fd < 0) {
-		fprintf(stderr, "Open %s failed %d (%s)\n",
+		ptio_err("Open %s failed %d (%s)\n",
 			path, errno, strerror(errno));
 		return -1;
 	}
@@ -404,7 +580,7 @@ int ptio_write_buf(char *path, uint8_t *buf, size_t bufsz)
 	while (sz < bufsz) {
 		ret = write(fd, buf + sz, bufsz - sz);
 		if (ret <= 0) {
-			fprintf(stderr, "Write %s failed %d (%s)\n",
+			ptio_err("Write %s failed %d (%s)\n",
 				path, errno, strerror(errno));
 			close(fd);
 			return -1;
@@ -417,7 +593,7 @@ int ptio_write_buf(char *path, uint8_t *buf, size_t bufsz)
 	return 0;
 }
 
-static int ptio_dev_get_type(struct ptio_dev *dev, struct stat *st)
+int ptio_dev_get_type(struct ptio_dev *dev, struct stat *st)
 {
 	char vendor[64];
 	bool is_ata;
@@ -460,13 +636,13 @@ int ptio_open_dev(struct ptio_dev *dev, enum ptio_dxfer dxfer)
 
 	/* Check that this is a block device */
 	if (stat(dev->path, &st) < 0) {
-		fprintf(stderr, "Get %s stat failed %d (%s)\n",
+		ptio_err("Get %s stat failed %d (%s)\n",
 			dev->path, errno, strerror(errno));
 		return -1;
 	}
 
 	if (!S_ISBLK(st.st_mode) && !S_ISCHR(st.st_mode)) {
-		fprintf(stderr, "Invalid device file %s\n",
+		ptio_err("Invalid device file %s\n",
 			dev->path);
 		return -1;
 	}
@@ -481,13 +657,13 @@ int ptio_open_dev(struct ptio_dev *dev, enum ptio_dxfer dxfer)
 		mode = O_RDONLY;
 		break;
 	default:
-		fprintf(stderr, "Invalid dxfer type\n");
+		ptio_err("Invalid dxfer type\n");
 		return -1;
 	}
 
 	dev->fd = open(dev->path, mode);
 	if (dev->fd < 0) {
-		fprintf(stderr, "Open %s failed %d (%s)\n",
+		ptio_err("Open %s failed %d (%s)\n",
 			dev->path, errno, strerror(errno));
 		return -1;
 	}
@@ -502,6 +678,8 @@ int ptio_open_dev(struct ptio_dev *dev, enum ptio_dxfer dxfer)
 		return ret;
 	}
 
+	dev->numa_node = ptio_numa_get_dev_node(dev, &st);
+
 	return 0;
 }
 
@@ -515,6 +693,8 @@ void ptio_close_dev(struct ptio_dev *dev)
 
 	close(dev->fd);
 	dev->fd = -1;
+
+	ptio_cache_free(dev);
 }
 
 /*
@@ -541,8 +721,73 @@ int ptio_get_dev_information(struct ptio_dev *dev)
  */
 int ptio_revalidate_dev(struct ptio_dev *dev)
 {
+	ptio_cache_invalidate(dev);
+
 	if (ptio_dev_is_ata(dev))
 		return ptio_ata_revalidate(dev);
 
 	return ptio_scsi_revalidate(dev);
 }
+
+/*
+ * Revalidate several devices. SCSI devices are rescanned individually. ATA
+ * devices are rescanned with one exact channel, target and LUN scan of their
+ * host, done only once for devices with the same host, channel, target and
+ * LUN (e.g. a disk and its SCSI generic node). Return 0 if all devices were
+ * revalidated, or the first error.
+ */
+int ptio_revalidate_devs(struct ptio_dev **devs, unsigned int nr_devs)
+{
+	struct ptio_hctl *hctl;
+	unsigned int i, j;
+	bool *done;
+	int ret = 0, r;
+
+	hctl = calloc(nr_devs, sizeof(*hctl));
+	done = calloc(nr_devs, sizeof(*done));
+	if (!hctl || !done) {
+		ptio_err("Allocate revalidate data failed\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_devs; i++) {
+		ptio_cache_invalidate(devs[i]);
+
+		if (ptio_dev_is_ata(devs[i]))
+			r = ptio_dev_get_hctl(devs[i], &hctl[i]);
+		else
+			r = ptio_scsi_revalidate(devs[i]);
+		if (r) {
+			if (!ret)
+				ret = r;
+			done[i] = true;
+		} else {
+			done[i] = !ptio_dev_is_ata(devs[i]);
+		}
+	}
+
+	for (i = 0; i < nr_devs; i++) {
+		if (done[i])
+			continue;
+
+		for (j = i; j < nr_devs; j++) {
+			if (done[j] || hctl[j].host != hctl[i].host ||
+			    hctl[j].channel != hctl[i].channel ||
+			    hctl[j].target != hctl[i].target ||
+			    hctl[j].lun != hctl[i].lun)
+				continue;
+			done[j] = true;
+		}
+
+		r = ptio_scsi_host_scan(devs[i], &hctl[i]);
+		if (r && !ret)
+			ret = r;
+	}
+
+out:
+	free(hctl);
+	free(done);
+
+	return ret;
+}
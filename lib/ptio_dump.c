@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ptio.h"
+
+/*
+ * Output is formatted in a buffer of this size and written with a single
+ * write() call whenever the buffer fills up.
+ */
+#define PTIO_DUMP_OUTBUF_SIZE	(64 * 1024)
+
+/* Size of a formatted hex table line */
+#define PTIO_DUMP_LINE_SIZE	65
+
+struct ptio_dump_out {
+	int		fd;
+	size_t		len;
+	char		buf[PTIO_DUMP_OUTBUF_SIZE];
+};
+
+static const char ptio_hex_digits[] = "0123456789abcdef";
+
+static const char ptio_base64_digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int ptio_dump_flush(struct ptio_dump_out *out)
+{
+	size_t ofst = 0;
+	ssize_t ret;
+
+	while (ofst < out->len) {
+		ret = write(out->fd, out->buf + ofst, out->len - ofst);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			ptio_err("Write dump output failed %d (%s)\n",
+				 errno, strerror(errno));
+			return ret;
+		}
+		ofst += ret;
+	}
+
+	out->len = 0;
+
+	return 0;
+}
+
+/*
+ * Reserve @len bytes of output, flushing the output buffer if needed.
+ */
+static char *ptio_dump_reserve(struct ptio_dump_out *out, size_t len,
+			       int *ret)
+{
+	char *p;
+
+	if (out->len + len > PTIO_DUMP_OUTBUF_SIZE) {
+		*ret = ptio_dump_flush(out);
+		if (*ret)
+			return NULL;
+	}
+
+	p = out->buf + out->len;
+	out->len += len;
+
+	return p;
+}
+
+static int ptio_dump_str(struct ptio_dump_out *out, const char *str)
+{
+	size_t len = strlen(str);
+	int ret = 0;
+	char *p;
+
+	p = ptio_dump_reserve(out, len, &ret);
+	if (p)
+		memcpy(p, str, len);
+
+	return ret;
+}
+
+/*
+ * Convert 16 bytes into 32 lower case hexadecimal digits.
+ */
+static inline void ptio_hex16(const uint8_t *buf, char *hex)
+{
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+	__m128i v, hi, lo, a, b;
+
+	v = _mm_loadu_si128((const __m128i *)buf);
+	hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+	lo = _mm_and_si128(v, mask);
+
+	/* Interleave to get the digits in output order */
+	a = _mm_unpacklo_epi8(hi, lo);
+	b = _mm_unpackhi_epi8(hi, lo);
+
+	/* '0' + n, plus the offset to 'a' for n > 9 */
+	a = _mm_add_epi8(_mm_add_epi8(a, zero),
+			 _mm_and_si128(_mm_cmpgt_epi8(a, nine), alpha));
+	b = _mm_add_epi8(_mm_add_epi8(b, zero),
+			 _mm_and_si128(_mm_cmpgt_epi8(b, nine), alpha));
+
+	_mm_storeu_si128((__m128i *)hex, a);
+	_mm_storeu_si128((__m128i *)(hex + 16), b);
+#else
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		hex[i * 2] = ptio_hex_digits[buf[i] >> 4];
+		hex[i * 2 + 1] = ptio_hex_digits[buf[i] & 0x0f];
+	}
+#endif
+}
+
+/*
+ * Format a hex table line for up to 16 bytes at offset @ofst.
+ */
+static void ptio_dump_hex_line(char *p, size_t ofst,
+			       const uint8_t *buf, size_t len)
+{
+	uint8_t tmp[16];
+	char hex[32];
+	int i;
+
+	if (len < 16) {
+		memset(tmp, 0, sizeof(tmp));
+		memcpy(tmp, buf, len);
+		buf = tmp;
+	}
+	ptio_hex16(buf, hex);
+
+	memcpy(p, "  | ", 4);
+	p += 4;
+	for (i = 7; i >= 0; i--)
+		*p++ = ptio_hex_digits[(ofst >> (i * 4)) & 0x0f];
+	memcpy(p, " |", 2);
+	p += 2;
+
+	for (i = 0; i < 16; i++, p += 3) {
+		p[0] = ' ';
+		if (i < (int)len) {
+			p[1] = hex[i * 2];
+			p[2] = hex[i * 2 + 1];
+		} else {
+			p[1] = ' ';
+			p[2] = ' ';
+		}
+	}
+
+	memcpy(p, " |\n", 3);
+}
+
+static int ptio_dump_hex(struct ptio_dump_out *out, uint8_t *buf,
+			 size_t bufsz, unsigned int flags)
+{
+	static const char *sep =
+		"  +----------+-------------------------------------------------+\n";
+	bool squeezed = false;
+	size_t ofst, len;
+	int ret;
+	char *p;
+
+	ret = ptio_dump_str(out, sep);
+	if (ret)
+		return ret;
+	ret = ptio_dump_str(out,
+		"  |  OFFSET  | 00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F |\n");
+	if (ret)
+		return ret;
+	ret = ptio_dump_str(out, sep);
+	if (ret)
+		return ret;
+
+	for (ofst = 0; ofst < bufsz; ofst += 16) {
+		len = bufsz - ofst < 16 ? bufsz - ofst : 16;
+
+		/*
+		 * Collapse full lines identical to the previous one, except
+		 * the last line so that the buffer size remains visible.
+		 */
+		if ((flags & PTIO_DUMP_SQUEEZE) && ofst && len == 16 &&
+		    ofst + 16 < bufsz &&
+		    memcmp(buf + ofst, buf + ofst - 16, 16) == 0) {
+			if (!squeezed) {
+				ret = ptio_dump_str(out,
+					"  | *        |                                                 |\n");
+				if (ret)
+					return ret;
+				squeezed = true;
+			}
+			continue;
+		}
+		squeezed = false;
+
+		p = ptio_dump_reserve(out, PTIO_DUMP_LINE_SIZE, &ret);
+		if (!p)
+			return ret;
+		ptio_dump_hex_line(p, ofst, buf + ofst, len);
+	}
+
+	return ptio_dump_str(out, sep);
+}
+
+static int ptio_dump_base64(struct ptio_dump_out *out, uint8_t *buf,
+			    size_t bufsz)
+{
+	size_t ofst = 0, i;
+	uint32_t v;
+	int ret = 0;
+	char *p;
+
+	/* 57 input bytes per 76 characters line */
+	while (ofst < bufsz) {
+		size_t len = bufsz - ofst < 57 ? bufsz - ofst : 57;
+
+		p = ptio_dump_reserve(out, ((len + 2) / 3) * 4 + 1, &ret);
+		if (!p)
+			return ret;
+
+		for (i = 0; i + 3 <= len; i += 3, p += 4) {
+			v = (uint32_t)buf[ofst + i] << 16 |
+				(uint32_t)buf[ofst + i + 1] << 8 |
+				buf[ofst + i + 2];
+			p[0] = ptio_base64_digits[(v >> 18) & 0x3f];
+			p[1] = ptio_base64_digits[(v >> 12) & 0x3f];
+			p[2] = ptio_base64_digits[(v >> 6) & 0x3f];
+			p[3] = ptio_base64_digits[v & 0x3f];
+		}
+
+		if (i < len) {
+			v = (uint32_t)buf[ofst + i] << 16;
+			if (i + 1 < len)
+				v |= (uint32_t)buf[ofst + i + 1] << 8;
+			p[0] = ptio_base64_digits[(v >> 18) & 0x3f];
+			p[1] = ptio_base64_digits[(v >> 12) & 0x3f];
+			p[2] = i + 1 < len ?
+				ptio_base64_digits[(v >> 6) & 0x3f] : '=';
+			p[3] = '=';
+			p += 4;
+		}
+
+		*p = '\n';
+		ofst += len;
+	}
+
+	return 0;
+}
+
+static int ptio_dump_raw(int fd, uint8_t *buf, size_t bufsz)
+{
+	size_t ofst = 0;
+	ssize_t ret;
+
+	/* No formatting: write directly from the buffer */
+	while (ofst < bufsz) {
+		ret = write(fd, buf + ofst, bufsz - ofst);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			ptio_err("Write dump output failed %d (%s)\n",
+				 errno, strerror(errno));
+			return ret;
+		}
+		ofst += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the content of a buffer to the file descriptor @fd using the
+ * output format @fmt. Output is formatted in memory and written in large
+ * chunks, so this is suitable for multi-MB buffers.
+ */
+int ptio_dump_buf(int fd, uint8_t *buf, size_t bufsz,
+		  enum ptio_dump_fmt fmt, unsigned int flags)
+{
+	struct ptio_dump_out *out;
+	int ret;
+
+	if (fmt == PTIO_DUMP_RAW)
+		return ptio_dump_raw(fd, buf, bufsz);
+
+	out = malloc(sizeof(*out));
+	if (!out) {
+		ptio_err("Allocate dump output buffer failed\n");
+		return -ENOMEM;
+	}
+	out->fd = fd;
+	out->len = 0;
+
+	switch (fmt) {
+	case PTIO_DUMP_HEX:
+		ret = ptio_dump_hex(out, buf, bufsz, flags);
+		break;
+	case PTIO_DUMP_BASE64:
+		ret = ptio_dump_base64(out, buf, bufsz);
+		break;
+	default:
+		ptio_err("Invalid dump format\n");
+		ret = -EINVAL;
+		break;
+	}
+
+	if (!ret)
+		ret = ptio_dump_flush(out);
+
+	free(out);
+
+	return ret;
+}
+
+/*
+ * Emit the content of a small buffer, e.g. a CDB, as a hex table through the
+ * log sink, so that it is not mixed with structured output on stdout.
+ */
+void ptio_log_buf(struct ptio_dev *dev, enum ptio_log_level level,
+		  uint8_t *buf, size_t bufsz)
+{
+	char line[PTIO_DUMP_LINE_SIZE + 1];
+	size_t ofst, len;
+
+	if (level > ptio_dev_log_level(dev))
+		return;
+
+	for (ofst = 0; ofst < bufsz; ofst += 16) {
+		len = bufsz - ofst < 16 ? bufsz - ofst : 16;
+		ptio_dump_hex_line(line, ofst, buf + ofst, len);
+		line[PTIO_DUMP_LINE_SIZE] = '\0';
+		ptio_log_msg(dev, level, "%s", line);
+	}
+}
+
+/*
+ * Print a buffer
+ */
+void ptio_print_buf(uint8_t *buf, size_t bufsz)
+{
+	/* Keep the order of any pending stdio output */
+	fflush(stdout);
+	ptio_dump_buf(STDOUT_FILENO, buf, bufsz, PTIO_DUMP_HEX, 0);
+}
@@ -0,0 +1,486 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ptio.h"
+
+/*
+ * ATA DOWNLOAD MICROCODE subcommands.
+ */
+#define PTIO_ATA_DM_OFFSETS		0x03
+#define PTIO_ATA_DM_FULL		0x07
+#define PTIO_ATA_DM_OFFSETS_DEFERRED	0x0E
+#define PTIO_ATA_DM_ACTIVATE		0x0F
+
+/*
+ * SCSI WRITE BUFFER modes.
+ */
+#define PTIO_SCSI_WB_OFFSETS_SAVE	0x07
+#define PTIO_SCSI_WB_OFFSETS_SELECT	0x0D
+#define PTIO_SCSI_WB_OFFSETS_DEFERRED	0x0E
+#define PTIO_SCSI_WB_ACTIVATE		0x0F
+
+/* The ATA buffer offset and block count are limited to 16-bits */
+#define PTIO_ATA_DM_MAX_BLOCKS		0xffff
+
+/*
+ * Supported Capabilities page (page 03h) of the IDENTIFY DEVICE data log:
+ * offset of the DOWNLOAD MICROCODE Capabilities qword.
+ */
+#define PTIO_ATA_LOG_IDENTIFY		0x30
+#define PTIO_ATA_IDENTIFY_CAP_PAGE	0x03
+#define PTIO_ATA_IDENTIFY_DM_CAP	0x10
+
+struct ptio_fw_work {
+	struct ptio_fw_image	*img;
+	struct ptio_fw_dev	*fwds;
+	unsigned int		flags;
+	ptio_fw_progress_fn	progress;
+	void			*data;
+};
+
+/*
+ * Map a firmware image file in memory. The image data is passed as is to
+ * the devices, without any copy.
+ */
+int ptio_open_fw_image(const char *path, struct ptio_fw_image *img)
+{
+	struct stat st;
+	int ret;
+
+	memset(img, 0, sizeof(*img));
+
+	img->fd = open(path, O_RDONLY);
+	if (img->fd < 0) {
+		ret = -errno;
+		ptio_err("Open %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		return ret;
+	}
+
+	if (fstat(img->fd, &st) < 0) {
+		ret = -errno;
+		ptio_err("Stat %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		goto close;
+	}
+
+	if (!st.st_size) {
+		ptio_err("%s: empty firmware image\n", path);
+		ret = -EINVAL;
+		goto close;
+	}
+
+	img->size = st.st_size;
+	img->data = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+	if (img->data == MAP_FAILED) {
+		ret = -errno;
+		ptio_err("Map %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		img->data = NULL;
+		goto close;
+	}
+
+	madvise(img->data, img->size, MADV_SEQUENTIAL);
+
+	return 0;
+
+close:
+	close(img->fd);
+	img->fd = -1;
+
+	return ret;
+}
+
+void ptio_close_fw_image(struct ptio_fw_image *img)
+{
+	if (img->data)
+		munmap(img->data, img->size);
+	if (img->fd >= 0)
+		close(img->fd);
+	memset(img, 0, sizeof(*img));
+	img->fd = -1;
+}
+
+/*
+ * Initialize an ATA 16 CDB for DOWNLOAD MICROCODE, which is a 28-bits
+ * command: the block count (7:0) is in the count field, the block count
+ * (15:8) in LBA (7:0) and the buffer offset in LBA (23:8).
+ */
+static void ptio_ata_dm_cdb(struct ptio_fw_dev *fwd, uint8_t *cdb,
+			    uint8_t subcmd, size_t ofst, size_t len)
+{
+	unsigned int nr_blocks = len >> 9;
+	uint64_t lba = ((uint64_t)(ofst >> 9) << 8) | (nr_blocks >> 8);
+
+	if (!len)
+		ptio_ata_set_cdb16(cdb, PTIO_SAT_PROT_NON_DATA,
+				   PTIO_DXFER_NONE, 0x92, subcmd, 0, 0);
+	else if (fwd->dma)
+		ptio_ata_set_cdb16(cdb, PTIO_SAT_PROT_DMA, PTIO_DXFER_TO_DEV,
+				   0x93, subcmd, nr_blocks & 0xff, lba);
+	else
+		ptio_ata_set_cdb16(cdb, PTIO_SAT_PROT_PIO_OUT,
+				   PTIO_DXFER_TO_DEV,
+				   0x92, subcmd, nr_blocks & 0xff, lba);
+
+	/* 28-bits command */
+	cdb[1] &= ~0x01;
+}
+
+/*
+ * Initialize a WRITE BUFFER CDB.
+ */
+static void ptio_scsi_wb_cdb(struct ptio_fw_dev *fwd, uint8_t *cdb,
+			     uint8_t mode, size_t ofst, size_t len)
+{
+	memset(cdb, 0, 10);
+	cdb[0] = 0x3B; /* WRITE BUFFER */
+	cdb[1] = mode | fwd->mode_specific << 5;
+	/* Buffer ID 0 */
+	cdb[3] = (ofst >> 16) & 0xff;
+	cdb[4] = (ofst >> 8) & 0xff;
+	cdb[5] = ofst & 0xff;
+	cdb[6] = (len >> 16) & 0xff;
+	cdb[7] = (len >> 8) & 0xff;
+	cdb[8] = len & 0xff;
+}
+
+static int ptio_fw_send(struct ptio_fw_dev *fwd, uint8_t mode,
+			uint8_t *buf, size_t ofst, size_t len)
+{
+	struct ptio_dev *dev = fwd->dev;
+	enum ptio_dxfer dxfer = len ? PTIO_DXFER_TO_DEV : PTIO_DXFER_NONE;
+	uint8_t cdb[16];
+	struct ptio_cmd cmd;
+	size_t cdbsz;
+
+	if (ptio_dev_is_ata(dev)) {
+		ptio_ata_dm_cdb(fwd, cdb, mode, ofst, len);
+		cdbsz = 16;
+	} else {
+		ptio_scsi_wb_cdb(fwd, cdb, mode, ofst, len);
+		cdbsz = 10;
+	}
+
+	return ptio_exec_cmd(dev, &cmd, cdb, cdbsz, PTIO_CDB_SCSI,
+			     buf, len, dxfer, 0);
+}
+
+/*
+ * Get the ATA DOWNLOAD MICROCODE capabilities and segment size limits from
+ * the IDENTIFY DEVICE data and from the Supported Capabilities page of the
+ * IDENTIFY DEVICE data log.
+ */
+static int ptio_fw_probe_ata(struct ptio_fw_dev *fwd, unsigned int flags,
+			     size_t size)
+{
+	struct ptio_dev *dev = fwd->dev;
+	uint8_t buf[512];
+	struct ptio_cmd cmd;
+	bool offsets, deferred = false;
+	unsigned int min, max;
+	uint64_t cap;
+	int ret;
+
+	if (flags & (PTIO_FW_ACT_POWER_ON | PTIO_FW_ACT_HARD_RESET)) {
+		ptio_dev_err(dev,
+			"Activation events are not supported for ATA devices\n");
+		return -EINVAL;
+	}
+
+	if (size & 511) {
+		ptio_dev_err(dev,
+			"Image size is not a multiple of 512 B\n");
+		return -EINVAL;
+	}
+
+	ret = ptio_ata_identify(dev, buf);
+	if (ret)
+		return ret;
+
+	if (!(ptio_get_le16(&buf[83 * 2]) & 0x0001)) {
+		ptio_dev_err(dev, "DOWNLOAD MICROCODE is not supported\n");
+		return -EOPNOTSUPP;
+	}
+
+	fwd->dma = ptio_get_le16(&buf[69 * 2]) & 0x0100;
+	offsets = ptio_get_le16(&buf[119 * 2]) & 0x0010;
+	min = ptio_get_le16(&buf[234 * 2]);
+	max = ptio_get_le16(&buf[235 * 2]);
+
+	if (ptio_ata_log_nr_pages(dev, PTIO_ATA_LOG_IDENTIFY) >
+	    PTIO_ATA_IDENTIFY_CAP_PAGE &&
+	    !ptio_ata_read_log(dev, PTIO_ATA_LOG_IDENTIFY,
+			       PTIO_ATA_IDENTIFY_CAP_PAGE, false, &cmd, buf,
+			       512)) {
+		cap = ptio_get_le64(&buf[PTIO_ATA_IDENTIFY_DM_CAP]);
+		if (cap & (1ULL << 63)) {
+			deferred = cap & (1ULL << 34);
+			offsets = cap & (1ULL << 32);
+			min = cap & 0xffff;
+			max = (cap >> 16) & 0xffff;
+		}
+	}
+
+	if (!min || min == 0xffff)
+		min = 1;
+	if (!max || max == 0xffff)
+		max = PTIO_ATA_DM_MAX_BLOCKS;
+	fwd->min_segsz = (size_t)min << 9;
+	fwd->max_segsz = (size_t)max << 9;
+
+	if (flags & PTIO_FW_IMMEDIATE) {
+		if (offsets) {
+			fwd->mode = PTIO_ATA_DM_OFFSETS;
+		} else {
+			fwd->mode = PTIO_ATA_DM_FULL;
+			fwd->min_segsz = size;
+		}
+	} else {
+		if (!deferred) {
+			ptio_dev_err(dev,
+				"Deferred microcode activation is not supported\n");
+			return -EOPNOTSUPP;
+		}
+		fwd->mode = PTIO_ATA_DM_OFFSETS_DEFERRED;
+	}
+
+	if (size > (size_t)PTIO_ATA_DM_MAX_BLOCKS << 9) {
+		ptio_dev_err(dev, "Image too large (%zu B)\n", size);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the SCSI WRITE BUFFER offset boundary and buffer capacity using
+ * READ BUFFER in descriptor mode.
+ */
+static int ptio_fw_probe_scsi(struct ptio_fw_dev *fwd, unsigned int flags,
+			      size_t size)
+{
+	struct ptio_dev *dev = fwd->dev;
+	uint8_t cdb[10] = {};
+	uint8_t buf[4] = {};
+	struct ptio_cmd cmd;
+	uint32_t capacity;
+	int ret;
+
+	cdb[0] = 0x3C; /* READ BUFFER */
+	cdb[1] = 0x03; /* Descriptor mode */
+	cdb[8] = sizeof(buf);
+	ret = ptio_exec_cmd(dev, &cmd, cdb, sizeof(cdb), PTIO_CDB_SCSI,
+			    buf, sizeof(buf), PTIO_DXFER_FROM_DEV, 0);
+	if (ret || cmd.bufsz < sizeof(buf)) {
+		ptio_dev_verbose(dev,
+				 "READ BUFFER descriptor failed, "
+				 "using default segment size\n");
+		fwd->min_segsz = 1;
+		fwd->max_segsz = 0xffffff;
+	} else if (buf[0] == 0xff) {
+		/* Offsets must be 0: single segment download */
+		fwd->min_segsz = size;
+		fwd->max_segsz = size;
+	} else {
+		capacity = (uint32_t)buf[1] << 16 | buf[2] << 8 | buf[3];
+		fwd->min_segsz = 1ULL << (buf[0] & 0x1f);
+		fwd->max_segsz = capacity ? capacity : 0xffffff;
+	}
+
+	if (size > 0xffffff) {
+		ptio_dev_err(dev, "Image too large (%zu B)\n", size);
+		return -EINVAL;
+	}
+
+	fwd->mode_specific = 0;
+	if (flags & PTIO_FW_IMMEDIATE) {
+		fwd->mode = PTIO_SCSI_WB_OFFSETS_SAVE;
+	} else if (flags & (PTIO_FW_ACT_POWER_ON | PTIO_FW_ACT_HARD_RESET)) {
+		fwd->mode = PTIO_SCSI_WB_OFFSETS_SELECT;
+		if (flags & PTIO_FW_ACT_POWER_ON)
+			fwd->mode_specific |= 0x04; /* PO_ACT */
+		if (flags & PTIO_FW_ACT_HARD_RESET)
+			fwd->mode_specific |= 0x02; /* HR_ACT */
+	} else {
+		fwd->mode = PTIO_SCSI_WB_OFFSETS_DEFERRED;
+	}
+
+	return 0;
+}
+
+/*
+ * Determine the download mode and the segment size to use for a device.
+ * The segment size is the largest multiple of the minimum segment size that
+ * the device and its host adapter can transfer in a single command.
+ */
+static int ptio_fw_probe(struct ptio_fw_dev *fwd, unsigned int flags,
+			 size_t size)
+{
+	struct ptio_dev *dev = fwd->dev;
+	size_t segsz;
+	int ret;
+
+	if (ptio_dev_is_ata(dev))
+		ret = ptio_fw_probe_ata(fwd, flags, size);
+	else
+		ret = ptio_fw_probe_scsi(fwd, flags, size);
+	if (ret)
+		return ret;
+
+	segsz = fwd->max_segsz;
+	if (segsz > ptio_dev_max_xfer(dev))
+		segsz = ptio_dev_max_xfer(dev);
+	if (segsz > size)
+		segsz = size;
+	if (segsz < size)
+		segsz -= segsz % fwd->min_segsz;
+	if (!segsz || (segsz < fwd->min_segsz && segsz < size)) {
+		ptio_dev_err(dev,
+			"Minimum segment size %zu B exceeds the maximum "
+			"transfer size\n", fwd->min_segsz);
+		return -EINVAL;
+	}
+
+	fwd->segsz = segsz;
+
+	ptio_dev_verbose(dev,
+			 "Firmware download: mode 0x%02x, %zu B segments "
+			 "(min %zu B, max %zu B)\n",
+			 fwd->mode, fwd->segsz,
+			 fwd->min_segsz, fwd->max_segsz);
+
+	return 0;
+}
+
+static inline bool ptio_fw_mode_is_deferred(struct ptio_fw_dev *fwd)
+{
+	if (ptio_dev_is_ata(fwd->dev))
+		return fwd->mode == PTIO_ATA_DM_OFFSETS_DEFERRED;
+	return fwd->mode == PTIO_SCSI_WB_OFFSETS_DEFERRED ||
+		fwd->mode == PTIO_SCSI_WB_OFFSETS_SELECT;
+}
+
+static int ptio_fw_download_job(void *data, unsigned int idx,
+				unsigned int worker)
+{
+	struct ptio_fw_work *w = data;
+	struct ptio_fw_image *img = w->img;
+	struct ptio_fw_dev *fwd = &w->fwds[idx];
+	unsigned long long start = ptio_now_ns();
+	size_t ofst, len;
+	int ret;
+
+	fwd->done = 0;
+	fwd->activate_pending = false;
+
+	ret = ptio_fw_probe(fwd, w->flags, img->size);
+	if (ret)
+		goto out;
+
+	for (ofst = 0; ofst < img->size; ofst += len) {
+		len = img->size - ofst;
+		if (len > fwd->segsz)
+			len = fwd->segsz;
+
+		ret = ptio_fw_send(fwd, fwd->mode, img->data + ofst,
+				   ofst, len);
+		if (ret) {
+			ptio_dev_err(fwd->dev,
+				"Firmware download failed at offset %zu\n",
+				ofst);
+			goto out;
+		}
+
+		__atomic_store_n(&fwd->done, ofst + len, __ATOMIC_RELAXED);
+		if (w->progress)
+			w->progress(fwd, w->data);
+	}
+
+	fwd->activate_pending = ptio_fw_mode_is_deferred(fwd);
+
+out:
+	fwd->time_ns = ptio_now_ns() - start;
+	fwd->error = ret;
+
+	return ret;
+}
+
+/*
+ * Download the firmware image @img to @nr_devs devices, using up to
+ * @nr_threads threads to update devices in parallel. Unless @flags specify
+ * PTIO_FW_IMMEDIATE, the new firmware is only saved on the devices and
+ * must be activated using ptio_activate_fw(). If not NULL, @progress is
+ * called after each segment download, possibly concurrently for different
+ * devices. The result for each device is in its ptio_fw_dev structure.
+ * The first error is returned.
+ */
+int ptio_download_fw(struct ptio_fw_image *img, struct ptio_fw_dev *fwds,
+		     unsigned int nr_devs, unsigned int nr_threads,
+		     unsigned int flags, ptio_fw_progress_fn progress,
+		     void *data)
+{
+	struct ptio_fw_work w = {
+		.img = img,
+		.fwds = fwds,
+		.flags = flags,
+		.progress = progress,
+		.data = data,
+	};
+
+	if (!img->data || !img->size)
+		return -EINVAL;
+
+	return ptio_run_jobs(nr_devs, nr_threads, ptio_fw_download_job, &w);
+}
+
+static int ptio_fw_activate_job(void *data, unsigned int idx,
+				unsigned int worker)
+{
+	struct ptio_fw_dev *fwd = &((struct ptio_fw_dev *)data)[idx];
+	uint8_t mode;
+	int ret;
+
+	if (!fwd->activate_pending)
+		return 0;
+
+	if (ptio_dev_is_ata(fwd->dev))
+		mode = PTIO_ATA_DM_ACTIVATE;
+	else
+		mode = PTIO_SCSI_WB_ACTIVATE;
+	fwd->mode_specific = 0;
+
+	ret = ptio_fw_send(fwd, mode, NULL, 0, 0);
+	if (ret) {
+		ptio_dev_err(fwd->dev, "Firmware activation failed\n");
+		fwd->error = ret;
+		return ret;
+	}
+
+	fwd->activate_pending = false;
+
+	return 0;
+}
+
+/*
+ * Activate the firmware downloaded in deferred mode to the devices of @fwds.
+ * Devices without a pending activation are ignored.
+ */
+int ptio_activate_fw(struct ptio_fw_dev *fwds, unsigned int nr_devs,
+		     unsigned int nr_threads)
+{
+	return ptio_run_jobs(nr_devs, nr_threads, ptio_fw_activate_job, fwds);
+}
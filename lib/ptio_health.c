@@ -0,0 +1,583 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ptio.h"
+
+#define PTIO_ATA_LOG_DEVSTAT		0x04
+#define PTIO_ATA_LOG_PAGE_SIZE		512
+
+#define PTIO_SCSI_LOG_SENSE_BUFSZ	65536
+
+/*
+ * Execute a LOG SENSE command to get the cumulative values of a log page.
+ */
+static int ptio_scsi_log_sense(struct ptio_dev *dev, uint8_t page,
+			       uint8_t subpage, struct ptio_cmd *cmd,
+			       uint8_t *buf, size_t bufsz)
+{
+	uint8_t cdb[10] = {};
+
+	cdb[0] = 0x4d; /* LOG SENSE */
+	cdb[2] = (0x01 << 6) | (page & 0x3f); /* PC = cumulative values */
+	cdb[3] = subpage;
+	ptio_set_be16(&cdb[7], bufsz > 0xffff ? 0xffff : bufsz);
+
+	return ptio_exec_cmd(dev, cmd, cdb, 10, PTIO_CDB_SCSI,
+			     buf, bufsz, PTIO_DXFER_FROM_DEV, 0);
+}
+
+static bool ptio_health_has_src(struct ptio_health *h,
+				enum ptio_counter_src src)
+{
+	unsigned int i;
+
+	for (i = 0; i < h->nr_pages; i++) {
+		if (h->pages[i].src == src)
+			return true;
+	}
+
+	return false;
+}
+
+static inline bool ptio_counter_match(struct ptio_counter *a,
+				      struct ptio_counter *b)
+{
+	return a->src == b->src && a->page == b->page &&
+		a->subpage == b->subpage && a->id == b->id;
+}
+
+/*
+ * Determine the range of ATA Device Statistics pages to read so that all
+ * supported pages can be read with a single READ LOG DMA EXT command.
+ */
+static int ptio_health_probe_ata(struct ptio_health *h,
+				 struct ptio_health_dev *hd)
+{
+	struct ptio_dev *dev = hd->dev;
+	struct ptio_health_page *hp;
+	int first = 256, last = -1;
+	struct ptio_cmd cmd;
+	unsigned int i, j, n;
+	int nr_pages, ret;
+	uint8_t *buf;
+
+	if (!ptio_health_has_src(h, PTIO_COUNTER_ATA_DEVSTAT))
+		return 0;
+
+	nr_pages = ptio_ata_log_nr_pages(dev, PTIO_ATA_LOG_DEVSTAT);
+	hd->nr_cmds++;
+	if (nr_pages < 0)
+		return nr_pages;
+	if (!nr_pages) {
+		ptio_dev_verbose(dev, "Device statistics log not supported\n");
+		return 0;
+	}
+
+	/* Get the list of supported pages */
+	buf = ptio_alloc_buf(PTIO_ATA_LOG_PAGE_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = ptio_ata_read_log(dev, PTIO_ATA_LOG_DEVSTAT, 0x00, false,
+				&cmd, buf, PTIO_ATA_LOG_PAGE_SIZE);
+	hd->nr_cmds++;
+	if (ret) {
+		ptio_dev_err(dev, "Read device statistics page 0 failed\n");
+		free(buf);
+		return ret;
+	}
+
+	n = buf[8];
+	if (n > PTIO_ATA_LOG_PAGE_SIZE - 9)
+		n = PTIO_ATA_LOG_PAGE_SIZE - 9;
+
+	for (i = 0; i < h->nr_pages; i++) {
+		hp = &h->pages[i];
+		if (hp->src != PTIO_COUNTER_ATA_DEVSTAT ||
+		    hp->page >= nr_pages)
+			continue;
+		for (j = 0; j < n; j++) {
+			if (buf[9 + j] != hp->page)
+				continue;
+			if (hp->page < first)
+				first = hp->page;
+			if (hp->page > last)
+				last = hp->page;
+			break;
+		}
+	}
+
+	free(buf);
+
+	if (last >= 0) {
+		hd->ata_first_page = first;
+		hd->ata_nr_pages = last - first + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the list of supported SCSI log pages.
+ */
+static int ptio_health_probe_scsi(struct ptio_health *h,
+				  struct ptio_health_dev *hd)
+{
+	struct ptio_dev *dev = hd->dev;
+	struct ptio_health_page *hp;
+	struct ptio_cmd cmd;
+	unsigned int i, j, n;
+	uint8_t *buf;
+	int ret;
+
+	if (!hd->scsi_pages) {
+		hd->scsi_pages = calloc(h->nr_pages, sizeof(uint8_t));
+		if (!hd->scsi_pages)
+			return -ENOMEM;
+	}
+
+	if (!ptio_health_has_src(h, PTIO_COUNTER_SCSI_LOG))
+		return 0;
+
+	buf = ptio_alloc_buf(PTIO_ATA_LOG_PAGE_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = ptio_scsi_log_sense(dev, 0x00, 0x00, &cmd,
+				  buf, PTIO_ATA_LOG_PAGE_SIZE);
+	hd->nr_cmds++;
+	if (ret) {
+		ptio_dev_err(dev, "Get supported log pages failed\n");
+		free(buf);
+		return ret;
+	}
+
+	n = ptio_get_be16(&buf[2]);
+	if (cmd.bufsz < 4)
+		n = 0;
+	else if (n > cmd.bufsz - 4)
+		n = cmd.bufsz - 4;
+
+	for (i = 0; i < h->nr_pages; i++) {
+		hp = &h->pages[i];
+		if (hp->src != PTIO_COUNTER_SCSI_LOG)
+			continue;
+		for (j = 0; j < n; j++) {
+			if ((buf[4 + j] & 0x3f) == hp->page) {
+				hd->scsi_pages[i] = 1;
+				break;
+			}
+		}
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+static int ptio_health_probe(struct ptio_health *h,
+			     struct ptio_health_dev *hd)
+{
+	size_t bufsz = 0;
+	unsigned int i;
+	int ret;
+
+	if (ptio_dev_is_ata(hd->dev)) {
+		ret = ptio_health_probe_ata(h, hd);
+		if (ret)
+			return ret;
+		bufsz = (size_t)hd->ata_nr_pages * PTIO_ATA_LOG_PAGE_SIZE;
+	} else {
+		ret = ptio_health_probe_scsi(h, hd);
+		if (ret)
+			return ret;
+		for (i = 0; i < h->nr_pages; i++) {
+			if (hd->scsi_pages[i]) {
+				bufsz = PTIO_SCSI_LOG_SENSE_BUFSZ;
+				break;
+			}
+		}
+	}
+
+	if (bufsz) {
+		hd->buf = ptio_alloc_dev_buf(hd->dev, bufsz);
+		if (!hd->buf)
+			return -ENOMEM;
+		hd->bufsz = bufsz;
+	}
+
+	hd->probed = true;
+
+	return 0;
+}
+
+static struct ptio_counter *ptio_health_add_counter(struct ptio_health_dev *hd)
+{
+	struct ptio_counter *c;
+	unsigned int max;
+
+	if (hd->nr_counters >= hd->max_counters) {
+		/*
+		 * Grow both the current and previous sample arrays so that
+		 * they can be swapped at the end of a sample.
+		 */
+		max = hd->max_counters ? hd->max_counters * 2 : 64;
+		c = realloc(hd->counters, max * sizeof(struct ptio_counter));
+		if (!c)
+			return NULL;
+		hd->counters = c;
+		c = realloc(hd->prev_counters,
+			    max * sizeof(struct ptio_counter));
+		if (!c)
+			return NULL;
+		hd->prev_counters = c;
+		hd->max_counters = max;
+	}
+
+	c = &hd->counters[hd->nr_counters];
+	memset(c, 0, sizeof(*c));
+	hd->nr_counters++;
+
+	return c;
+}
+
+/*
+ * Decode an ATA Device Statistics log page.
+ */
+static int ptio_health_decode_ata_page(struct ptio_health_dev *hd,
+				       uint8_t page, uint8_t *buf)
+{
+	struct ptio_counter *c;
+	uint64_t qw;
+	unsigned int i;
+
+	if (buf[2] != page) {
+		ptio_dev_err(hd->dev,
+			     "Invalid device statistics page number 0x%02x\n",
+			     buf[2]);
+		return -EIO;
+	}
+
+	for (i = 8; i < PTIO_ATA_LOG_PAGE_SIZE; i += 8) {
+		qw = ptio_get_le64(&buf[i]);
+
+		/* Statistic supported bit */
+		if (!(qw & (1ULL << 63)))
+			continue;
+
+		c = ptio_health_add_counter(hd);
+		if (!c)
+			return -ENOMEM;
+
+		c->src = PTIO_COUNTER_ATA_DEVSTAT;
+		c->page = page;
+		c->id = i;
+		if (qw & (1ULL << 62))
+			c->flags |= PTIO_COUNTER_VALID;
+		if (qw & (1ULL << 61))
+			c->flags |= PTIO_COUNTER_NORMALIZED;
+		c->val = qw & 0x00ffffffffffffffULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode a SCSI log page. Parameters with a value larger than 8 bytes are not
+ * counters and ignored.
+ */
+static int ptio_health_decode_scsi_page(struct ptio_health_dev *hd,
+					struct ptio_health_page *hp,
+					uint8_t *buf, size_t bufsz)
+{
+	struct ptio_counter *c;
+	size_t len, plen, i;
+	uint64_t val;
+	unsigned int j;
+
+	if (bufsz < 4 || (buf[0] & 0x3f) != hp->page) {
+		ptio_dev_err(hd->dev, "Invalid log page 0x%02x\n",
+			     buf[0] & 0x3f);
+		return -EIO;
+	}
+
+	len = ptio_get_be16(&buf[2]) + 4;
+	if (len > bufsz)
+		len = bufsz;
+
+	for (i = 4; i + 4 <= len; i += 4 + plen) {
+		plen = buf[i + 3];
+		if (i + 4 + plen > len || plen > 8)
+			continue;
+
+		val = 0;
+		for (j = 0; j < plen; j++)
+			val = (val << 8) | buf[i + 4 + j];
+
+		c = ptio_health_add_counter(hd);
+		if (!c)
+			return -ENOMEM;
+
+		c->src = PTIO_COUNTER_SCSI_LOG;
+		c->page = hp->page;
+		c->subpage = hp->subpage;
+		c->id = ptio_get_be16(&buf[i]);
+		c->flags = PTIO_COUNTER_VALID;
+		c->val = val;
+	}
+
+	return 0;
+}
+
+static struct ptio_counter *ptio_health_find_prev(struct ptio_health_dev *hd,
+						  struct ptio_counter *c,
+						  unsigned int hint)
+{
+	struct ptio_counter *p;
+	unsigned int i;
+
+	/* Counters are normally decoded in the same order for all samples */
+	if (hint < hd->nr_prev_counters) {
+		p = &hd->prev_counters[hint];
+		if (ptio_counter_match(p, c))
+			return p;
+	}
+
+	for (i = 0; i < hd->nr_prev_counters; i++) {
+		p = &hd->prev_counters[i];
+		if (ptio_counter_match(p, c))
+			return p;
+	}
+
+	return NULL;
+}
+
+static void ptio_health_calc_deltas(struct ptio_health_dev *hd)
+{
+	struct ptio_counter *c, *p;
+	unsigned int i;
+
+	for (i = 0; i < hd->nr_counters; i++) {
+		c = &hd->counters[i];
+		if (!(c->flags & PTIO_COUNTER_VALID))
+			continue;
+		p = ptio_health_find_prev(hd, c, i);
+		if (!p || !(p->flags & PTIO_COUNTER_VALID))
+			continue;
+		c->delta = (int64_t)(c->val - p->val);
+		c->flags |= PTIO_COUNTER_HAS_DELTA;
+	}
+}
+
+static int ptio_health_read_dev(struct ptio_health *h,
+				struct ptio_health_dev *hd)
+{
+	struct ptio_dev *dev = hd->dev;
+	struct ptio_health_page *hp;
+	unsigned long long now;
+	struct ptio_cmd cmd;
+	unsigned int i;
+	uint8_t page;
+	int ret;
+
+	if (!hd->probed) {
+		ret = ptio_health_probe(h, hd);
+		if (ret)
+			return ret;
+	}
+
+	now = ptio_now_ns();
+
+	if (ptio_dev_is_ata(dev)) {
+		if (!hd->ata_nr_pages)
+			goto done;
+
+		/* Read all pages at once */
+		ret = ptio_ata_read_log(dev, PTIO_ATA_LOG_DEVSTAT,
+					hd->ata_first_page, false, &cmd,
+					hd->buf, (size_t)hd->ata_nr_pages *
+					PTIO_ATA_LOG_PAGE_SIZE);
+		hd->nr_cmds++;
+		if (ret) {
+			ptio_dev_err(dev, "Read device statistics failed\n");
+			return ret;
+		}
+
+		for (i = 0; i < h->nr_pages; i++) {
+			hp = &h->pages[i];
+			if (hp->src != PTIO_COUNTER_ATA_DEVSTAT ||
+			    hp->page < hd->ata_first_page ||
+			    hp->page >= hd->ata_first_page + hd->ata_nr_pages)
+				continue;
+			page = hp->page - hd->ata_first_page;
+			ret = ptio_health_decode_ata_page(hd, hp->page,
+				&hd->buf[page * PTIO_ATA_LOG_PAGE_SIZE]);
+			if (ret)
+				return ret;
+		}
+
+		goto done;
+	}
+
+	for (i = 0; i < h->nr_pages; i++) {
+		hp = &h->pages[i];
+		if (!hd->scsi_pages[i])
+			continue;
+
+		ret = ptio_scsi_log_sense(dev, hp->page, hp->subpage, &cmd,
+					  hd->buf, hd->bufsz);
+		hd->nr_cmds++;
+		if (ret) {
+			ptio_dev_err(dev, "Get log page 0x%02x/0x%02x failed\n",
+				     hp->page, hp->subpage);
+			return ret;
+		}
+
+		ret = ptio_health_decode_scsi_page(hd, hp, hd->buf, cmd.bufsz);
+		if (ret)
+			return ret;
+	}
+
+done:
+	ptio_health_calc_deltas(hd);
+
+	if (hd->time_ns)
+		hd->interval_ns = now - hd->time_ns;
+	hd->time_ns = now;
+
+	return 0;
+}
+
+static int ptio_health_sample_dev(struct ptio_health *h,
+				  struct ptio_health_dev *hd)
+{
+	unsigned int nr_counters = hd->nr_counters;
+	struct ptio_counter *c;
+	int ret;
+
+	/* Save the previous sample */
+	c = hd->prev_counters;
+	hd->prev_counters = hd->counters;
+	hd->nr_prev_counters = hd->nr_counters;
+	hd->counters = c;
+	hd->nr_counters = 0;
+	hd->nr_cmds = 0;
+
+	ret = ptio_health_read_dev(h, hd);
+	if (ret) {
+		/*
+		 * Keep the last complete sample as the current one, so that
+		 * the deltas of the next sample are against it. The sample
+		 * before it was overwritten.
+		 */
+		c = hd->counters;
+		hd->counters = hd->prev_counters;
+		hd->nr_counters = nr_counters;
+		hd->prev_counters = c;
+		hd->nr_prev_counters = 0;
+	}
+
+	return ret;
+}
+
+static int ptio_health_job(void *data, unsigned int idx,
+			   unsigned int worker)
+{
+	struct ptio_health *h = data;
+	struct ptio_health_dev *hd = &h->devs[idx];
+
+	hd->error = ptio_health_sample_dev(h, hd);
+
+	return hd->error;
+}
+
+/*
+ * Allocate a health poller for @nr_devs devices. The health pages @pages are
+ * sampled for all devices using up to @nr_threads threads.
+ */
+struct ptio_health *ptio_alloc_health(struct ptio_dev **devs,
+				      unsigned int nr_devs,
+				      struct ptio_health_page *pages,
+				      unsigned int nr_pages,
+				      unsigned int nr_threads)
+{
+	struct ptio_health *h;
+	unsigned int i;
+
+	h = calloc(1, sizeof(struct ptio_health));
+	if (!h)
+		return NULL;
+
+	h->nr_threads = nr_threads ? nr_threads : 1;
+
+	h->pages = calloc(nr_pages, sizeof(struct ptio_health_page));
+	h->devs = calloc(nr_devs, sizeof(struct ptio_health_dev));
+	if (!h->pages || !h->devs) {
+		ptio_free_health(h);
+		return NULL;
+	}
+
+	for (i = 0; i < nr_pages; i++) {
+		if (pages[i].src != PTIO_COUNTER_ATA_DEVSTAT &&
+		    pages[i].src != PTIO_COUNTER_SCSI_LOG) {
+			ptio_err("Invalid health page source %d\n",
+				pages[i].src);
+			ptio_free_health(h);
+			return NULL;
+		}
+		h->pages[i] = pages[i];
+	}
+	h->nr_pages = nr_pages;
+
+	for (i = 0; i < nr_devs; i++)
+		h->devs[i].dev = devs[i];
+	h->nr_devs = nr_devs;
+
+	return h;
+}
+
+/*
+ * Sample the health counters of all devices. On return, the counters of each
+ * device hold the values of this sample together with their delta since the
+ * previous sample. Errors are reported per device: the first error is
+ * returned, and the counters of a device that failed are those of its last
+ * successful sample.
+ */
+int ptio_sample_health(struct ptio_health *h)
+{
+	return ptio_run_jobs(h->nr_devs, h->nr_threads, ptio_health_job, h);
+}
+
+/*
+ * Free a health poller.
+ */
+void ptio_free_health(struct ptio_health *h)
+{
+	struct ptio_health_dev *hd;
+	unsigned int i;
+
+	if (!h)
+		return;
+
+	for (i = 0; i < h->nr_devs; i++) {
+		hd = &h->devs[i];
+		free(hd->counters);
+		free(hd->prev_counters);
+		free(hd->scsi_pages);
+		free(hd->buf);
+	}
+
+	free(h->devs);
+	free(h->pages);
+	free(h);
+}
@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ptio.h"
+
+struct ptio_jobs {
+	unsigned int	nr_jobs;
+	unsigned int	next;
+	unsigned int	nr_workers;
+	ptio_job_fn	fn;
+	void		*data;
+	int		ret;
+};
+
+/*
+ * Job worker: execute jobs until there are no more jobs to execute.
+ */
+static void *ptio_job_worker(void *arg)
+{
+	struct ptio_jobs *jobs = arg;
+	unsigned int idx, worker;
+	int ret, err = 0;
+
+	worker = __atomic_fetch_add(&jobs->nr_workers, 1, __ATOMIC_RELAXED);
+
+	while (1) {
+		idx = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED);
+		if (idx >= jobs->nr_jobs)
+			break;
+
+		ret = jobs->fn(jobs->data, idx, worker);
+		if (ret && !err)
+			err = ret;
+	}
+
+	/* Only remember the first error */
+	if (err)
+		__atomic_compare_exchange_n(&jobs->ret, &(int){ 0 }, err,
+					    false, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+static int ptio_run_jobs_on(unsigned int nr_jobs, unsigned int nr_threads,
+			    ptio_job_fn fn, void *data, cpu_set_t *cpus)
+{
+	struct ptio_jobs jobs = {
+		.nr_jobs = nr_jobs,
+		.fn = fn,
+		.data = data,
+	};
+	pthread_attr_t attr;
+	pthread_t *threads;
+	unsigned int i, nr = 0;
+	int ret;
+
+	if (!nr_jobs)
+		return 0;
+
+	if (nr_threads > nr_jobs)
+		nr_threads = nr_jobs;
+
+	/* No need for threads if we execute jobs one at a time */
+	if (nr_threads <= 1) {
+		ptio_job_worker(&jobs);
+		return jobs.ret;
+	}
+
+	threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!threads)
+		return -ENOMEM;
+
+	pthread_attr_init(&attr);
+	if (cpus)
+		pthread_attr_setaffinity_np(&attr, sizeof(*cpus), cpus);
+
+	for (i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&threads[i], &attr, ptio_job_worker, &jobs);
+		if (ret) {
+			ptio_err("Create job thread failed %d (%s)\n",
+				ret, strerror(ret));
+			break;
+		}
+		nr++;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	/* If we could not create any thread, execute the jobs ourselves */
+	if (!nr)
+		ptio_job_worker(&jobs);
+
+	for (i = 0; i < nr; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	return jobs.ret;
+}
+
+/*
+ * Execute @nr_jobs jobs using up to @nr_threads threads. Jobs are identified
+ * by their index, which is passed to @fn together with @data and with the
+ * index of the worker executing the job (lower than @nr_threads). All jobs are
+ * always executed: the first error returned by a job is returned once all jobs
+ * complete.
+ */
+int ptio_run_jobs(unsigned int nr_jobs, unsigned int nr_threads,
+		  ptio_job_fn fn, void *data)
+{
+	return ptio_run_jobs_on(nr_jobs, nr_threads, fn, data, NULL);
+}
+
+/*
+ * Execute jobs issuing commands to @dev, as ptio_run_jobs() does, with the
+ * job threads running on the CPUs local to the device host adapter.
+ */
+int ptio_run_dev_jobs(struct ptio_dev *dev, unsigned int nr_jobs,
+		      unsigned int nr_threads, ptio_job_fn fn, void *data)
+{
+	cpu_set_t cpus;
+
+	if (dev->numa_node < 0 ||
+	    ptio_numa_get_cpus(dev, dev->numa_node, &cpus))
+		return ptio_run_jobs_on(nr_jobs, nr_threads, fn, data, NULL);
+
+	return ptio_run_jobs_on(nr_jobs, nr_threads, fn, data, &cpus);
+}
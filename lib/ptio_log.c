@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+
+#include "ptio.h"
+
+/*
+ * Default per device rate limit: up to PTIO_LOG_DEFAULT_BURST messages at
+ * once, refilled at PTIO_LOG_DEFAULT_RATE messages per second.
+ */
+#define PTIO_LOG_DEFAULT_RATE	10
+#define PTIO_LOG_DEFAULT_BURST	100
+
+/*
+ * Default log sink: errors and warnings go to stderr, other messages to
+ * stdout.
+ */
+static void ptio_log_stdio(struct ptio_dev *dev, enum ptio_log_level level,
+			   const char *format, va_list ap, void *data)
+{
+	FILE *f = level <= PTIO_LOG_WARNING ? stderr : stdout;
+
+	if (dev) {
+		fprintf(f, "PTIO (%s): ", dev->name);
+		if (level == PTIO_LOG_ERROR)
+			fprintf(f, "[ERROR]: ");
+		else if (level == PTIO_LOG_WARNING)
+			fprintf(f, "[WARNING]: ");
+	}
+
+	vfprintf(f, format, ap);
+}
+
+static ptio_log_fn ptio_log_sink = ptio_log_stdio;
+static void *ptio_log_sink_data;
+
+/*
+ * Set the function used to emit library messages. Messages are passed to
+ * @fn unformatted, together with @data. Passing NULL restores the default
+ * sink printing messages to stdout and stderr. This must be called before
+ * any device is used.
+ */
+void ptio_set_log_fn(ptio_log_fn fn, void *data)
+{
+	if (fn) {
+		ptio_log_sink = fn;
+		ptio_log_sink_data = data;
+	} else {
+		ptio_log_sink = ptio_log_stdio;
+		ptio_log_sink_data = NULL;
+	}
+}
+
+/*
+ * Rate limit device messages using a lock-free token bucket: @log_tat is the
+ * theoretical arrival time of the next message, which may run ahead of the
+ * current time by up to the burst size. Return true if the message must be
+ * dropped.
+ */
+static bool ptio_log_ratelimited(struct ptio_dev *dev)
+{
+	unsigned int rate = dev->log_rate ? dev->log_rate : PTIO_LOG_DEFAULT_RATE;
+	unsigned int burst = dev->log_burst ?
+		dev->log_burst : PTIO_LOG_DEFAULT_BURST;
+	unsigned long long interval, now, tat, next;
+
+	if (rate == UINT_MAX)
+		return false;
+
+	interval = 1000000000ULL / rate;
+	now = ptio_now_ns();
+	tat = __atomic_load_n(&dev->log_tat, __ATOMIC_RELAXED);
+	do {
+		next = (tat > now ? tat : now) + interval;
+		if (next > now + interval * burst)
+			return true;
+	} while (!__atomic_compare_exchange_n(&dev->log_tat, &tat, next,
+					      false, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	return false;
+}
+
+static void ptio_log_emit(struct ptio_dev *dev, enum ptio_log_level level,
+			  const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	ptio_log_sink(dev, level, format, ap, ptio_log_sink_data);
+	va_end(ap);
+}
+
+/*
+ * Emit a message. The caller already checked the message level, so only
+ * rate limiting remains to be done before passing the message to the sink.
+ */
+void ptio_log_msg(struct ptio_dev *dev, enum ptio_log_level level,
+		  const char *format, ...)
+{
+	unsigned int suppressed;
+	va_list ap;
+
+	if (dev) {
+		if (ptio_log_ratelimited(dev)) {
+			__atomic_fetch_add(&dev->log_suppressed, 1,
+					   __ATOMIC_RELAXED);
+			return;
+		}
+
+		suppressed = __atomic_exchange_n(&dev->log_suppressed, 0,
+						 __ATOMIC_RELAXED);
+		if (suppressed)
+			ptio_log_emit(dev, PTIO_LOG_WARNING,
+				      "%u messages suppressed\n", suppressed);
+	}
+
+	va_start(ap, format);
+	ptio_log_sink(dev, level, format, ap, ptio_log_sink_data);
+	va_end(ap);
+}
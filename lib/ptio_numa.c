@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "ptio.h"
+
+/*
+ * Maximum number of NUMA nodes supported for buffer placement.
+ */
+#define PTIO_NUMA_MAX_NODES	1024
+
+/*
+ * Get the NUMA node of the host adapter of a device: the first parent of the
+ * device sysfs entry that has a numa_node attribute is the PCI function of
+ * the adapter. Return -1 if the node is unknown, e.g. on systems that are not
+ * NUMA.
+ */
+int ptio_numa_get_dev_node(struct ptio_dev *dev, struct stat *st)
+{
+	char path[PATH_MAX], *p;
+	long node;
+
+	if (S_ISBLK(st->st_mode))
+		snprintf(path, sizeof(path), "/sys/block/%s/device",
+			 dev->name);
+	else
+		snprintf(path, sizeof(path),
+			 "/sys/class/scsi_generic/%s/device", dev->name);
+
+	p = realpath(path, NULL);
+	if (!p)
+		return -1;
+
+	for (;;) {
+		if (strlen(p) <= strlen("/sys/devices")) {
+			node = -1;
+			break;
+		}
+		if (ptio_sysfs_exists(dev, "%s/numa_node", p)) {
+			/* Not unsigned: the attribute is -1 for no node */
+			node = ptio_sysfs_get_ulong_attr(dev, "%s/numa_node",
+							 p);
+			break;
+		}
+		*strrchr(p, '/') = '\0';
+	}
+
+	free(p);
+
+	if (node < 0 || node >= PTIO_NUMA_MAX_NODES)
+		return -1;
+
+	ptio_dev_verbose(dev, "NUMA node %ld\n", node);
+
+	return node;
+}
+
+/*
+ * Get the CPUs of a NUMA node, from its cpulist attribute, e.g. "0-15,32-47".
+ */
+int ptio_numa_get_cpus(struct ptio_dev *dev, int node, cpu_set_t *cpus)
+{
+	unsigned int first, last, cpu;
+	char buf[4096], *s, *tok;
+	FILE *f;
+
+	snprintf(buf, sizeof(buf), "/sys/devices/system/node/node%d/cpulist",
+		 node);
+	f = fopen(buf, "r");
+	if (!f) {
+		ptio_dev_err(dev, "Open %s failed\n", buf);
+		return -ENOENT;
+	}
+	s = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (!s)
+		return -EIO;
+
+	CPU_ZERO(cpus);
+	for (tok = strtok(buf, ",\n"); tok; tok = strtok(NULL, ",\n")) {
+		switch (sscanf(tok, "%u-%u", &first, &last)) {
+		case 1:
+			last = first;
+			break;
+		case 2:
+			break;
+		default:
+			return -EINVAL;
+		}
+		for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, cpus);
+	}
+
+	if (!CPU_COUNT(cpus))
+		return -ENOENT;
+
+	return 0;
+}
+
+/*
+ * Bind the calling thread to the CPUs of the NUMA node of a device host
+ * adapter, so that commands are submitted and completed on CPUs local to
+ * the adapter. If the device NUMA node is unknown, the thread is not bound.
+ */
+int ptio_dev_bind_thread(struct ptio_dev *dev)
+{
+	cpu_set_t cpus;
+	int ret;
+
+	if (dev->numa_node < 0)
+		return 0;
+
+	ret = ptio_numa_get_cpus(dev, dev->numa_node, &cpus);
+	if (ret)
+		return ret;
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (ret) {
+		ptio_dev_err(dev, "Set thread affinity failed %d (%s)\n",
+			     ret, strerror(ret));
+		return -ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate a command buffer on the NUMA node of a device host adapter. The
+ * buffer can be used with any device, and is freed with free(), as buffers
+ * allocated with ptio_alloc_buf().
+ */
+uint8_t *ptio_alloc_dev_buf(struct ptio_dev *dev, size_t bufsz)
+{
+	unsigned long nodemask[PTIO_NUMA_MAX_NODES / (8 * sizeof(long))] = {};
+	size_t pgsz = sysconf(_SC_PAGESIZE);
+	size_t sz = (bufsz + pgsz - 1) & ~(pgsz - 1);
+	int node = dev->numa_node;
+	void *buf;
+
+	if (node < 0)
+		return ptio_alloc_buf(bufsz);
+
+	/* Use whole pages so that other allocations are not moved */
+	if (posix_memalign(&buf, pgsz, sz)) {
+		ptio_dev_err(dev, "Allocate %zu B buffer failed\n", bufsz);
+		return NULL;
+	}
+
+	/*
+	 * Prefer the device node, without failing if the node has no free
+	 * memory. The pages are allocated when the buffer is cleared, and
+	 * pages that were already allocated are moved.
+	 */
+	nodemask[node / (8 * sizeof(long))] = 1UL << (node % (8 * sizeof(long)));
+	if (syscall(SYS_mbind, buf, sz, MPOL_PREFERRED, nodemask,
+		    PTIO_NUMA_MAX_NODES + 1, MPOL_MF_MOVE) < 0)
+		ptio_dev_verbose(dev, "Bind buffer to node %d failed %d (%s)\n",
+				 node, errno, strerror(errno));
+
+	memset(buf, 0, sz);
+
+	return buf;
+}
+
+/*
+ * Account a command submission as local or remote to the NUMA node of the
+ * device host adapter.
+ */
+void ptio_numa_account(struct ptio_dev *dev)
+{
+	unsigned int cpu, node;
+
+	if (dev->numa_node < 0)
+		return;
+
+#ifdef HAVE_GETCPU
+	if (getcpu(&cpu, &node))
+		return;
+#else
+	if (syscall(SYS_getcpu, &cpu, &node, NULL))
+		return;
+#endif
+
+	if (node == (unsigned int)dev->numa_node)
+		ptio_dev_stat_inc(dev, nr_numa_local);
+	else
+		ptio_dev_stat_inc(dev, nr_numa_remote);
+}
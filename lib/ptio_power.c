@@ -0,0 +1,231 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ptio.h"
+
+/*
+ * A device that completed a command less than PTIO_POWER_ACTIVE_NS ago is
+ * assumed to still be active, which avoids checking the power state before
+ * every command. With PTIO_POWER_GATE_DEFER, the power state is checked
+ * every PTIO_POWER_DEFER_POLL_MS until the device is active.
+ */
+#define PTIO_POWER_ACTIVE_NS		1000000000ULL
+#define PTIO_POWER_DEFER_POLL_MS	1000
+#define PTIO_POWER_DEFAULT_DEFER_MS	60000
+
+/*
+ * Test if a command can be executed without spinning up the device media:
+ * power state checks and power management commands.
+ */
+static bool ptio_power_cmd_allowed(struct ptio_cmd *cmd)
+{
+	uint8_t *cdb = cmd->cdb;
+	uint8_t opcode;
+
+	switch (cdb[0]) {
+	case 0x03: /* REQUEST SENSE */
+	case 0x12: /* INQUIRY */
+	case 0xA0: /* REPORT LUNS */
+	case 0x1B: /* START STOP UNIT */
+		return true;
+	case 0x85: /* ATA PASS-THROUGH (16) */
+		opcode = cdb[14];
+		break;
+	case 0xA1: /* ATA PASS-THROUGH (12) */
+		opcode = cdb[9];
+		break;
+	default:
+		return false;
+	}
+
+	switch (opcode) {
+	case 0xE0: /* STANDBY IMMEDIATE */
+	case 0xE1: /* IDLE IMMEDIATE */
+	case 0xE2: /* STANDBY */
+	case 0xE3: /* IDLE */
+	case 0xE5: /* CHECK POWER MODE */
+	case 0xE6: /* SLEEP */
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Get the ATA power mode using CHECK POWER MODE, with ck_cond set to get
+ * the result in the COUNT register. Return 1 if the device is in standby,
+ * 0 if it is active or idle, and a negative error code otherwise.
+ */
+static int ptio_power_ata_standby(struct ptio_dev *dev)
+{
+	struct ptio_cmd cmd;
+	uint8_t cdb[16];
+	int ret;
+
+	ptio_ata_set_cdb16(cdb, PTIO_SAT_PROT_NON_DATA, PTIO_DXFER_NONE,
+			   0xE5, 0, 0, 0);
+	cdb[1] &= ~0x01; /* 28-bits command */
+
+	ret = ptio_exec_cmd(dev, &cmd, cdb, 16, PTIO_CDB_SCSI,
+			    NULL, 0, PTIO_DXFER_NONE, PTIO_CMD_ATA_CK_COND);
+	if (ret)
+		return ret;
+
+	if (!(cmd.sense.flags & PTIO_SENSE_ATA_REGS))
+		return -EIO;
+
+	/* 00h: standby_z, 01h: standby_y, 40h: NV cache, spun down */
+	switch (cmd.sense.ata.count & 0xff) {
+	case 0x00:
+	case 0x01:
+	case 0x40:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Get the SCSI power condition from the sense data returned by REQUEST
+ * SENSE. Return 1 if the device is in a standby power condition, 0 if it
+ * is active or idle, and a negative error code otherwise.
+ */
+static int ptio_power_scsi_standby(struct ptio_dev *dev)
+{
+	struct ptio_sense sense;
+	struct ptio_cmd cmd;
+	uint8_t buf[252];
+	uint8_t cdb[6] = {};
+	int ret;
+
+	cdb[0] = 0x03; /* REQUEST SENSE */
+	cdb[1] = 0x01; /* Descriptor format */
+	cdb[4] = sizeof(buf);
+
+	ret = ptio_exec_cmd(dev, &cmd, cdb, 6, PTIO_CDB_SCSI,
+			    buf, sizeof(buf), PTIO_DXFER_FROM_DEV, 0);
+	if (ret)
+		return ret;
+
+	ret = ptio_decode_sense(buf, cmd.bufsz, &sense);
+	if (ret)
+		return 0;
+
+	if (sense.asc != 0x5E)
+		return 0;
+
+	switch (sense.ascq) {
+	case 0x02: /* Standby condition activated by timer */
+	case 0x04: /* Standby condition activated by command */
+	case 0x09: /* Standby_y condition activated by timer */
+	case 0x0A: /* Standby_y condition activated by command */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int ptio_power_standby(struct ptio_dev *dev)
+{
+	int ret;
+
+	ptio_dev_stat_inc(dev, nr_power_checks);
+
+	if (ptio_dev_is_ata(dev))
+		ret = ptio_power_ata_standby(dev);
+	else
+		ret = ptio_power_scsi_standby(dev);
+	if (ret == 0)
+		__atomic_store_n(&dev->power_active_ns, ptio_now_ns(),
+				 __ATOMIC_RELAXED);
+
+	return ret;
+}
+
+/*
+ * Check the device power state before executing a command that would spin
+ * up the device media. Return 0 if the command can be issued, 1 if the
+ * command was completed using a previous response, and -EAGAIN if the
+ * command must be skipped because the device is in standby.
+ */
+int ptio_power_gate(struct ptio_dev *dev, struct ptio_cmd *cmd)
+{
+	unsigned long long active, deadline;
+	unsigned int defer_ms;
+	int ret;
+
+	if (dev->power_gate == PTIO_POWER_GATE_NONE ||
+	    ptio_power_cmd_allowed(cmd))
+		return 0;
+
+	active = __atomic_load_n(&dev->power_active_ns, __ATOMIC_RELAXED);
+	if (active && ptio_now_ns() < active + PTIO_POWER_ACTIVE_NS)
+		return 0;
+
+	ret = ptio_power_standby(dev);
+	if (ret <= 0) {
+		/* Do not block commands if the power state is unknown */
+		return 0;
+	}
+
+	switch (dev->power_gate) {
+	case PTIO_POWER_GATE_DEFER:
+		/* Wait for another user to wake up the device */
+		ptio_dev_stat_inc(dev, nr_power_defers);
+		defer_ms = dev->power_defer_ms ?
+			dev->power_defer_ms : PTIO_POWER_DEFAULT_DEFER_MS;
+		deadline = ptio_now_ns() + defer_ms * 1000000ULL;
+		while (ptio_now_ns() < deadline) {
+			usleep(PTIO_POWER_DEFER_POLL_MS * 1000);
+			if (ptio_power_standby(dev) == 0)
+				return 0;
+		}
+		break;
+	case PTIO_POWER_GATE_CACHE:
+		if (ptio_cache_lookup(dev, cmd, 0)) {
+			ptio_dev_stat_inc(dev, nr_power_cached);
+			return 1;
+		}
+		break;
+	default:
+		break;
+	}
+
+	ptio_dev_stat_inc(dev, nr_power_skips);
+	ptio_dev_verbose(dev, "Device in standby: command skipped\n");
+
+	return -EAGAIN;
+}
+
+/*
+ * Note a successful command execution: the device is active, and the
+ * command response is saved to be reused while the device is in standby.
+ */
+void ptio_power_done(struct ptio_dev *dev, struct ptio_cmd *cmd)
+{
+	if (dev->power_gate == PTIO_POWER_GATE_NONE)
+		return;
+
+	/* The power state may have been changed: check it again */
+	if (ptio_power_cmd_allowed(cmd)) {
+		__atomic_store_n(&dev->power_active_ns, 0, __ATOMIC_RELAXED);
+		return;
+	}
+
+	__atomic_store_n(&dev->power_active_ns, ptio_now_ns(),
+			 __ATOMIC_RELAXED);
+
+	if (dev->power_gate == PTIO_POWER_GATE_CACHE &&
+	    ptio_cmd_class(cmd) != PTIO_CMD_CLASS_IO)
+		ptio_cache_store(dev, cmd);
+}
@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ptio.h"
+
+/* Default burst window */
+#define PTIO_QOS_DEFAULT_BURST_MS	100
+
+/*
+ * Adaptive mode: rate scale in per-mille of the configured limits, never
+ * going below PTIO_QOS_MIN_SCALE, and reduced at most once per
+ * PTIO_QOS_ADJUST_NS.
+ */
+#define PTIO_QOS_MAX_SCALE		1000
+#define PTIO_QOS_MIN_SCALE		50
+#define PTIO_QOS_ADJUST_NS		100000000ULL
+
+/*
+ * Initialize a QoS bucket with the given limits. A limit of 0 means no
+ * limit. With @target_lat_us not 0, the limits are lowered while the
+ * average command latency is above @target_lat_us.
+ */
+void ptio_init_qos(struct ptio_qos *qos, unsigned int iops,
+		   unsigned long long bps, unsigned int target_lat_us)
+{
+	memset(qos, 0, sizeof(*qos));
+	qos->iops = iops;
+	qos->bps = bps;
+	qos->target_lat_us = target_lat_us;
+	qos->scale = PTIO_QOS_MAX_SCALE;
+}
+
+/*
+ * Reserve @cost ns of a bucket using the same virtual scheduling as the log
+ * rate limiter: @tat is the theoretical arrival time of the next command,
+ * which may run ahead of the current time by up to the burst window.
+ * Return the time to wait before issuing the command.
+ */
+static unsigned long long ptio_qos_reserve(unsigned long long *tat,
+					   unsigned long long cost,
+					   unsigned long long burst,
+					   unsigned long long now)
+{
+	unsigned long long t, next;
+
+	t = __atomic_load_n(tat, __ATOMIC_RELAXED);
+	do {
+		next = (t > now ? t : now) + cost;
+	} while (!__atomic_compare_exchange_n(tat, &t, next, false,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	if (next <= now + burst)
+		return 0;
+
+	return next - now - burst;
+}
+
+static unsigned long long ptio_qos_delay(struct ptio_qos *qos, size_t bytes,
+					 unsigned long long now)
+{
+	unsigned long long burst, cost, delay = 0, d;
+	unsigned int scale;
+
+	if (!qos->iops && !qos->bps)
+		return 0;
+
+	burst = (unsigned long long)(qos->burst_ms ?
+		qos->burst_ms : PTIO_QOS_DEFAULT_BURST_MS) * 1000000ULL;
+	scale = __atomic_load_n(&qos->scale, __ATOMIC_RELAXED);
+	if (!scale)
+		scale = PTIO_QOS_MAX_SCALE;
+
+	if (qos->iops) {
+		cost = 1000000000ULL * PTIO_QOS_MAX_SCALE /
+			((unsigned long long)qos->iops * scale);
+		delay = ptio_qos_reserve(&qos->iops_tat, cost, burst, now);
+	}
+
+	if (qos->bps && bytes) {
+		cost = (unsigned long long)bytes * 1000000000ULL /
+			qos->bps * PTIO_QOS_MAX_SCALE / scale;
+		d = ptio_qos_reserve(&qos->bytes_tat, cost, burst, now);
+		if (d > delay)
+			delay = d;
+	}
+
+	if (delay) {
+		__atomic_fetch_add(&qos->nr_throttled, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&qos->throttle_ns, delay, __ATOMIC_RELAXED);
+	}
+
+	return delay;
+}
+
+/*
+ * Wait as needed for the device and tenant buckets before issuing @cmd.
+ */
+void ptio_qos_throttle(struct ptio_dev *dev, struct ptio_cmd *cmd)
+{
+	unsigned long long now = ptio_now_ns();
+	unsigned long long delay, d;
+	struct timespec ts;
+
+	delay = ptio_qos_delay(&dev->qos, cmd->bufsz, now);
+	if (dev->tenant) {
+		d = ptio_qos_delay(dev->tenant, cmd->bufsz, now);
+		if (d > delay)
+			delay = d;
+	}
+
+	if (!delay)
+		return;
+
+	__atomic_fetch_add(&dev->stats.nr_throttled, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&dev->stats.throttle_ns, delay, __ATOMIC_RELAXED);
+
+	ts.tv_sec = delay / 1000000000ULL;
+	ts.tv_nsec = delay % 1000000000ULL;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+/*
+ * Adaptive mode: track the average command latency and scale the limits
+ * down when it exceeds the target, and back up slowly otherwise.
+ */
+static void ptio_qos_adapt(struct ptio_qos *qos, unsigned long long lat_ns,
+			   unsigned long long now)
+{
+	unsigned long long avg, last;
+	unsigned int scale;
+
+	if (!qos->target_lat_us)
+		return;
+
+	/* Exponentially weighted moving average, with a weight of 1/8 */
+	avg = __atomic_load_n(&qos->avg_lat_ns, __ATOMIC_RELAXED);
+	if (!avg)
+		avg = lat_ns;
+	else
+		avg = avg - avg / 8 + lat_ns / 8;
+	__atomic_store_n(&qos->avg_lat_ns, avg, __ATOMIC_RELAXED);
+
+	scale = __atomic_load_n(&qos->scale, __ATOMIC_RELAXED);
+	if (!scale)
+		scale = PTIO_QOS_MAX_SCALE;
+
+	if (avg > (unsigned long long)qos->target_lat_us * 1000) {
+		last = __atomic_load_n(&qos->adjust_ns, __ATOMIC_RELAXED);
+		if (now < last + PTIO_QOS_ADJUST_NS ||
+		    !__atomic_compare_exchange_n(&qos->adjust_ns, &last, now,
+						 false, __ATOMIC_RELAXED,
+						 __ATOMIC_RELAXED))
+			return;
+		scale = scale * 3 / 4;
+		if (scale < PTIO_QOS_MIN_SCALE)
+			scale = PTIO_QOS_MIN_SCALE;
+	} else if (scale < PTIO_QOS_MAX_SCALE) {
+		scale++;
+	} else {
+		return;
+	}
+
+	__atomic_store_n(&qos->scale, scale, __ATOMIC_RELAXED);
+}
+
+void ptio_qos_complete(struct ptio_dev *dev, unsigned long long lat_ns)
+{
+	unsigned long long now = ptio_now_ns();
+
+	ptio_qos_adapt(&dev->qos, lat_ns, now);
+	if (dev->tenant)
+		ptio_qos_adapt(dev->tenant, lat_ns, now);
+}
@@ -0,0 +1,590 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "ptio.h"
+
+/*
+ * Devices are indexed by kernel name in a hash table. Only the thread
+ * calling ptio_reg_process() modifies the table, and the lock allows
+ * concurrent lookups from other threads.
+ */
+#define PTIO_REG_NR_BUCKETS	256
+#define PTIO_REG_RCVBUF_SIZE	(1024 * 1024)
+#define PTIO_REG_MSG_SIZE	8192
+
+struct ptio_reg_ent {
+	struct ptio_reg_ent	*next;
+	struct ptio_reg_dev	rdev;
+
+	/* Kernel device path, without the /sys prefix */
+	char			devpath[PATH_MAX];
+	bool			stale;
+	bool			marked;
+};
+
+struct ptio_reg {
+	int			fd;
+	ptio_reg_fn		fn;
+	void			*data;
+
+	pthread_mutex_t		lock;
+	unsigned int		nr_devs;
+	struct ptio_reg_ent	*buckets[PTIO_REG_NR_BUCKETS];
+};
+
+/*
+ * Device classes registered. Events for the SCSI devices to which these
+ * devices are attached are also handled.
+ */
+static const char *ptio_reg_subsys[] = { "block", "scsi_generic" };
+
+static unsigned int ptio_reg_hash(const char *name)
+{
+	unsigned int h = 2166136261U;
+
+	/* FNV-1a */
+	while (*name) {
+		h ^= (uint8_t)*name++;
+		h *= 16777619U;
+	}
+
+	return h % PTIO_REG_NR_BUCKETS;
+}
+
+static struct ptio_reg_ent **ptio_reg_find(struct ptio_reg *reg,
+					   const char *name)
+{
+	struct ptio_reg_ent **e = &reg->buckets[ptio_reg_hash(name)];
+
+	while (*e) {
+		if (strcmp((*e)->rdev.name, name) == 0)
+			break;
+		e = &(*e)->next;
+	}
+
+	return e;
+}
+
+static void ptio_reg_notify(struct ptio_reg *reg, enum ptio_reg_event event,
+			    struct ptio_reg_dev *rdev)
+{
+	if (reg->fn)
+		reg->fn(reg, event, rdev, reg->data);
+}
+
+/*
+ * Probe a device of the block or scsi_generic class: ignore partitions and
+ * devices that are not SCSI devices, and get the device type. Return 1 if
+ * the device is registered, 0 if it must be ignored, and a negative error
+ * code otherwise.
+ */
+static int ptio_reg_probe(const char *subsys, const char *name,
+			  struct ptio_reg_dev *rdev, char *devpath)
+{
+	char path[PATH_MAX], real[PATH_MAX];
+	struct ptio_dev dev = {};
+	struct stat st = {};
+
+	if (strlen(name) >= PTIO_REG_NAME_LEN)
+		return 0;
+
+	dev.fd = -1;
+	dev.name = (char *)name;
+
+	if (!ptio_sysfs_exists(&dev, "/sys/class/%s/%s/device/scsi_device",
+			       subsys, name) ||
+	    ptio_sysfs_exists(&dev, "/sys/class/%s/%s/partition",
+			      subsys, name))
+		return 0;
+
+	/* The device file may not be created yet: use its sysfs class */
+	if (strcmp(subsys, "block") == 0)
+		st.st_mode = S_IFBLK;
+	else
+		st.st_mode = S_IFCHR;
+	if (ptio_dev_get_type(&dev, &st))
+		return -EIO;
+
+	snprintf(path, sizeof(path), "/sys/class/%s/%s", subsys, name);
+	if (!realpath(path, real))
+		return -errno;
+	snprintf(devpath, PATH_MAX, "%s", real + strlen("/sys"));
+
+	memset(rdev, 0, sizeof(*rdev));
+	strcpy(rdev->name, name);
+	snprintf(rdev->path, sizeof(rdev->path), "/dev/%s", name);
+	rdev->flags = dev.flags & PTIO_ATA;
+
+	return 1;
+}
+
+/*
+ * Add a device, or refresh it if it is already registered.
+ */
+static void ptio_reg_update(struct ptio_reg *reg, const char *subsys,
+			    const char *name, bool changed)
+{
+	struct ptio_reg_ent *ent, **e;
+	enum ptio_reg_event event;
+	struct ptio_reg_dev rdev;
+	char devpath[PATH_MAX];
+
+	if (ptio_reg_probe(subsys, name, &rdev, devpath) <= 0)
+		return;
+
+	pthread_mutex_lock(&reg->lock);
+
+	e = ptio_reg_find(reg, name);
+	ent = *e;
+	if (ent) {
+		ent->stale = false;
+		if (!changed && ent->rdev.flags == rdev.flags &&
+		    strcmp(ent->devpath, devpath) == 0) {
+			pthread_mutex_unlock(&reg->lock);
+			return;
+		}
+		rdev.generation = ent->rdev.generation + 1;
+		event = PTIO_REG_CHANGE;
+	} else {
+		ent = calloc(1, sizeof(*ent));
+		if (!ent) {
+			pthread_mutex_unlock(&reg->lock);
+			ptio_err("Allocate registry entry failed\n");
+			return;
+		}
+		*e = ent;
+		reg->nr_devs++;
+		event = PTIO_REG_ADD;
+	}
+
+	ent->rdev = rdev;
+	strcpy(ent->devpath, devpath);
+
+	pthread_mutex_unlock(&reg->lock);
+
+	ptio_reg_notify(reg, event, &rdev);
+}
+
+static void ptio_reg_remove(struct ptio_reg *reg, const char *name)
+{
+	struct ptio_reg_ent *ent, **e;
+	struct ptio_reg_dev rdev;
+
+	pthread_mutex_lock(&reg->lock);
+
+	e = ptio_reg_find(reg, name);
+	ent = *e;
+	if (!ent) {
+		pthread_mutex_unlock(&reg->lock);
+		return;
+	}
+	*e = ent->next;
+	reg->nr_devs--;
+
+	pthread_mutex_unlock(&reg->lock);
+
+	rdev = ent->rdev;
+	free(ent);
+
+	ptio_reg_notify(reg, PTIO_REG_REMOVE, &rdev);
+}
+
+/*
+ * Apply @action to the registered devices attached to the SCSI device
+ * @devpath: a change of the SCSI device, e.g. a rescan, is a change of
+ * its disk and generic nodes.
+ */
+static void ptio_reg_scsi_event(struct ptio_reg *reg, const char *action,
+				const char *devpath)
+{
+	char name[PTIO_REG_NAME_LEN], subsys[16];
+	struct ptio_reg_ent *ent;
+	size_t len = strlen(devpath);
+	bool remove = strcmp(action, "remove") == 0;
+	bool found;
+	char *p;
+	int i;
+
+	if (strcmp(action, "add") == 0)
+		return;
+
+	do {
+		found = false;
+
+		pthread_mutex_lock(&reg->lock);
+		for (i = 0; i < PTIO_REG_NR_BUCKETS && !found; i++) {
+			for (ent = reg->buckets[i]; ent; ent = ent->next) {
+				if (ent->marked ||
+				    strncmp(ent->devpath, devpath, len) != 0 ||
+				    ent->devpath[len] != '/')
+					continue;
+				/* .../<scsi device>/<subsystem>/<name> */
+				snprintf(subsys, sizeof(subsys), "%s",
+					 ent->devpath + len + 1);
+				p = strchr(subsys, '/');
+				if (p)
+					*p = '\0';
+				strcpy(name, ent->rdev.name);
+				ent->marked = true;
+				found = true;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&reg->lock);
+
+		if (!found)
+			break;
+
+		if (remove)
+			ptio_reg_remove(reg, name);
+		else
+			ptio_reg_update(reg, subsys, name, true);
+	} while (found);
+
+	/* Clear the marks of the devices updated */
+	pthread_mutex_lock(&reg->lock);
+	for (i = 0; i < PTIO_REG_NR_BUCKETS; i++)
+		for (ent = reg->buckets[i]; ent; ent = ent->next)
+			ent->marked = false;
+	pthread_mutex_unlock(&reg->lock);
+}
+
+/*
+ * Synchronize the registry with the devices present in sysfs. This is used
+ * to populate the registry and to recover from lost uevents.
+ */
+static int ptio_reg_sync(struct ptio_reg *reg)
+{
+	char path[PATH_MAX], name[PTIO_REG_NAME_LEN];
+	struct ptio_reg_ent *ent;
+	struct dirent *dirent;
+	bool found;
+	size_t i;
+	DIR *d;
+	int ret;
+
+	pthread_mutex_lock(&reg->lock);
+	for (i = 0; i < PTIO_REG_NR_BUCKETS; i++)
+		for (ent = reg->buckets[i]; ent; ent = ent->next)
+			ent->stale = true;
+	pthread_mutex_unlock(&reg->lock);
+
+	for (i = 0; i < sizeof(ptio_reg_subsys) / sizeof(ptio_reg_subsys[0]);
+	     i++) {
+		snprintf(path, sizeof(path), "/sys/class/%s",
+			 ptio_reg_subsys[i]);
+		d = opendir(path);
+		if (!d) {
+			/* No scsi_generic class without the sg driver */
+			if (errno == ENOENT)
+				continue;
+			ret = -errno;
+			ptio_err("Open %s failed %d (%s)\n",
+				 path, errno, strerror(errno));
+			return ret;
+		}
+
+		while ((dirent = readdir(d))) {
+			if (dirent->d_name[0] == '.')
+				continue;
+			ptio_reg_update(reg, ptio_reg_subsys[i],
+					dirent->d_name, false);
+		}
+
+		closedir(d);
+	}
+
+	/* Remove the devices that are gone */
+	do {
+		found = false;
+
+		pthread_mutex_lock(&reg->lock);
+		for (i = 0; i < PTIO_REG_NR_BUCKETS && !found; i++) {
+			for (ent = reg->buckets[i]; ent; ent = ent->next) {
+				if (ent->stale) {
+					strcpy(name, ent->rdev.name);
+					found = true;
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&reg->lock);
+
+		if (found)
+			ptio_reg_remove(reg, name);
+	} while (found);
+
+	return 0;
+}
+
+/*
+ * Handle a uevent message: "<action>@<devpath>" followed by KEY=VALUE
+ * strings.
+ */
+static void ptio_reg_uevent(struct ptio_reg *reg, char *msg, size_t len)
+{
+	const char *action = NULL, *devpath = NULL, *subsys = NULL;
+	const char *devtype = NULL, *name = NULL;
+	char *p = msg, *end = msg + len;
+
+	if (!memchr(msg, '@', strnlen(msg, len)))
+		return;
+
+	for (p += strnlen(p, len) + 1; p < end; p += strnlen(p, end - p) + 1) {
+		if (strncmp(p, "ACTION=", 7) == 0)
+			action = p + 7;
+		else if (strncmp(p, "DEVPATH=", 8) == 0)
+			devpath = p + 8;
+		else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+			subsys = p + 10;
+		else if (strncmp(p, "DEVTYPE=", 8) == 0)
+			devtype = p + 8;
+		else if (strncmp(p, "DEVNAME=", 8) == 0)
+			name = p + 8;
+	}
+
+	if (!action || !devpath || !subsys)
+		return;
+
+	if (strcmp(subsys, "scsi") == 0) {
+		if (devtype && strcmp(devtype, "scsi_device") == 0)
+			ptio_reg_scsi_event(reg, action, devpath);
+		return;
+	}
+
+	if (strcmp(subsys, "scsi_generic") != 0 &&
+	    (strcmp(subsys, "block") != 0 ||
+	     !devtype || strcmp(devtype, "disk") != 0))
+		return;
+
+	/* DEVNAME may be missing: use the last component of DEVPATH */
+	if (!name) {
+		name = strrchr(devpath, '/');
+		if (!name)
+			return;
+		name++;
+	} else if (strncmp(name, "/dev/", 5) == 0) {
+		name += 5;
+	}
+
+	if (strcmp(action, "remove") == 0)
+		ptio_reg_remove(reg, name);
+	else
+		ptio_reg_update(reg, subsys, name,
+				strcmp(action, "add") != 0);
+}
+
+/*
+ * Create a device registry, populated with the devices present, and
+ * subscribe to kernel uevents. @fn is called for each device added,
+ * including the devices already present, removed or changed.
+ */
+struct ptio_reg *ptio_open_reg(ptio_reg_fn fn, void *data)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1, /* Kernel uevents */
+	};
+	int rcvbuf = PTIO_REG_RCVBUF_SIZE;
+	struct ptio_reg *reg;
+
+	reg = calloc(1, sizeof(*reg));
+	if (!reg) {
+		ptio_err("Allocate registry failed\n");
+		return NULL;
+	}
+	pthread_mutex_init(&reg->lock, NULL);
+	reg->fn = fn;
+	reg->data = data;
+
+	/* Subscribe first so that no change is missed while populating */
+	reg->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			 NETLINK_KOBJECT_UEVENT);
+	if (reg->fd < 0) {
+		ptio_err("Open uevent socket failed %d (%s)\n",
+			 errno, strerror(errno));
+		goto err;
+	}
+
+	/* Bursts of events, e.g. on HBA resets, must not overflow */
+	if (setsockopt(reg->fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		       &rcvbuf, sizeof(rcvbuf)))
+		setsockopt(reg->fd, SOL_SOCKET, SO_RCVBUF,
+			   &rcvbuf, sizeof(rcvbuf));
+
+	if (bind(reg->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		ptio_err("Bind uevent socket failed %d (%s)\n",
+			 errno, strerror(errno));
+		goto err;
+	}
+
+	if (ptio_reg_sync(reg))
+		goto err;
+
+	return reg;
+
+err:
+	ptio_close_reg(reg);
+
+	return NULL;
+}
+
+void ptio_close_reg(struct ptio_reg *reg)
+{
+	struct ptio_reg_ent *ent, *next;
+	int i;
+
+	if (!reg)
+		return;
+
+	if (reg->fd >= 0)
+		close(reg->fd);
+
+	for (i = 0; i < PTIO_REG_NR_BUCKETS; i++) {
+		for (ent = reg->buckets[i]; ent; ent = next) {
+			next = ent->next;
+			free(ent);
+		}
+	}
+
+	pthread_mutex_destroy(&reg->lock);
+	free(reg);
+}
+
+/*
+ * Get the registry file descriptor, to wait for events using poll(),
+ * select() or epoll together with other file descriptors.
+ */
+int ptio_reg_fd(struct ptio_reg *reg)
+{
+	return reg->fd;
+}
+
+/*
+ * Wait up to @timeout_ms for uevents (-1 for no limit, 0 to not wait) and
+ * process all pending uevents. Return the number of uevents processed, or
+ * a negative error code.
+ */
+int ptio_reg_process(struct ptio_reg *reg, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = reg->fd, .events = POLLIN };
+	struct sockaddr_nl addr;
+	struct iovec iov;
+	struct msghdr mh;
+	char *msg;
+	ssize_t len;
+	int ret, nr = 0;
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+		ptio_err("Poll uevent socket failed %d (%s)\n",
+			 errno, strerror(errno));
+		return -errno;
+	}
+	if (!ret)
+		return 0;
+
+	msg = malloc(PTIO_REG_MSG_SIZE);
+	if (!msg) {
+		ptio_err("Allocate uevent buffer failed\n");
+		return -ENOMEM;
+	}
+
+	for (;;) {
+		iov.iov_base = msg;
+		iov.iov_len = PTIO_REG_MSG_SIZE - 1;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_name = &addr;
+		mh.msg_namelen = sizeof(addr);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+
+		len = recvmsg(reg->fd, &mh, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			if (errno == ENOBUFS) {
+				/* Events were lost: resynchronize */
+				ptio_err("uevent socket overflow\n");
+				ret = ptio_reg_sync(reg);
+				if (ret)
+					goto out;
+				continue;
+			}
+			ret = -errno;
+			ptio_err("Receive uevent failed %d (%s)\n",
+				 errno, strerror(errno));
+			goto out;
+		}
+
+		/* Only trust messages sent by the kernel */
+		if (addr.nl_pid != 0)
+			continue;
+
+		msg[len] = '\0';
+		ptio_reg_uevent(reg, msg, len);
+		nr++;
+	}
+
+	ret = nr;
+
+out:
+	free(msg);
+
+	return ret;
+}
+
+/*
+ * Get a copy of the registry entry of the device @name (e.g. "sda").
+ * Return -ENOENT if the device is not registered.
+ */
+int ptio_reg_get_dev(struct ptio_reg *reg, const char *name,
+		     struct ptio_reg_dev *rdev)
+{
+	struct ptio_reg_ent *ent;
+	int ret = -ENOENT;
+
+	if (strncmp(name, "/dev/", 5) == 0)
+		name += 5;
+
+	pthread_mutex_lock(&reg->lock);
+	ent = *ptio_reg_find(reg, name);
+	if (ent) {
+		*rdev = ent->rdev;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&reg->lock);
+
+	return ret;
+}
+
+unsigned int ptio_reg_nr_devs(struct ptio_reg *reg)
+{
+	unsigned int nr_devs;
+
+	pthread_mutex_lock(&reg->lock);
+	nr_devs = reg->nr_devs;
+	pthread_mutex_unlock(&reg->lock);
+
+	return nr_devs;
+}
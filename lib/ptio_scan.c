@@ -0,0 +1,489 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "ptio.h"
+
+/* READ VERIFY SECTORS EXT count is 16-bits, with 0 meaning 65536 */
+#define PTIO_SCAN_MAX_CHUNK		65536ULL
+#define PTIO_SCAN_DEFAULT_QD		4
+#define PTIO_SCAN_CHECKPOINT_NS		(60ULL * 1000000000ULL)
+
+#define PTIO_SCAN_CHECKPOINT_MAGIC	"ptio-scan 1"
+
+#define PTIO_SCAN_IDLE			UINT64_MAX
+
+/*
+ * Scan state of a device, shared by the workers issuing verify commands.
+ */
+struct ptio_scan_work {
+	struct ptio_scan_dev	*sd;
+	pthread_mutex_t		lock;
+
+	uint64_t		end;
+	uint64_t		next;
+	uint64_t		chunk;
+	uint64_t		*inflight;
+	unsigned int		qd;
+
+	/* Lowest start LBA of the chunks that failed to verify */
+	uint64_t		fail_lba;
+
+	unsigned long long	ckpt_ns;
+	int			ret;
+};
+
+/*
+ * Verify @nr_blocks logical blocks starting at @lba.
+ */
+static int ptio_scan_verify(struct ptio_dev *dev, struct ptio_cmd *cmd,
+			    uint64_t lba, uint64_t nr_blocks)
+{
+	uint8_t cdb[16] = {};
+
+	if (ptio_dev_is_ata(dev)) {
+		/* READ VERIFY SECTORS EXT */
+		ptio_ata_set_cdb16(cdb, PTIO_SAT_PROT_NON_DATA,
+				   PTIO_DXFER_NONE, 0x42, 0,
+				   nr_blocks & 0xffff, lba);
+	} else {
+		/* VERIFY (16), BYTCHK=0 */
+		cdb[0] = 0x8F;
+		ptio_set_be64(&cdb[2], lba);
+		ptio_set_be32(&cdb[10], nr_blocks);
+	}
+
+	return ptio_exec_cmd(dev, cmd, cdb, 16, PTIO_CDB_SCSI,
+			     NULL, 0, PTIO_DXFER_NONE, 0);
+}
+
+static inline bool ptio_scan_is_media_error(struct ptio_cmd *cmd)
+{
+	return cmd->sense.flags & PTIO_SENSE_MEDIUM_ERROR;
+}
+
+/*
+ * Add the extent [@lba, @lba + @nr_blocks) to the sorted set of bad extents
+ * of @sd, merging it with overlapping and contiguous extents.
+ */
+static int ptio_scan_add_bad(struct ptio_scan_dev *sd,
+			     uint64_t lba, uint64_t nr_blocks)
+{
+	struct ptio_extent *bad;
+	uint64_t end = lba + nr_blocks;
+	unsigned int lo = 0, hi = sd->nr_bad, i, j;
+
+	/* Find the first extent ending at or after @lba */
+	while (lo < hi) {
+		i = (lo + hi) / 2;
+		if (sd->bad[i].lba + sd->bad[i].nr_blocks < lba)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	/* Find the extents overlapping or contiguous with the new one */
+	for (j = lo; j < sd->nr_bad && sd->bad[j].lba <= end; j++) {
+		if (sd->bad[j].lba < lba)
+			lba = sd->bad[j].lba;
+		if (sd->bad[j].lba + sd->bad[j].nr_blocks > end)
+			end = sd->bad[j].lba + sd->bad[j].nr_blocks;
+	}
+
+	if (j > lo) {
+		/* Merge extents lo..j-1 into one */
+		sd->bad[lo].lba = lba;
+		sd->bad[lo].nr_blocks = end - lba;
+		memmove(&sd->bad[lo + 1], &sd->bad[j],
+			(sd->nr_bad - j) * sizeof(struct ptio_extent));
+		sd->nr_bad -= j - lo - 1;
+		return 0;
+	}
+
+	if (sd->nr_bad == sd->max_bad) {
+		bad = realloc(sd->bad, (sd->max_bad + 64) *
+			      sizeof(struct ptio_extent));
+		if (!bad)
+			return -ENOMEM;
+		sd->bad = bad;
+		sd->max_bad += 64;
+	}
+
+	memmove(&sd->bad[lo + 1], &sd->bad[lo],
+		(sd->nr_bad - lo) * sizeof(struct ptio_extent));
+	sd->bad[lo].lba = lba;
+	sd->bad[lo].nr_blocks = end - lba;
+	sd->nr_bad++;
+
+	return 0;
+}
+
+/*
+ * Lowest LBA below which all blocks have been verified. A chunk that failed
+ * is not verified, so it stays above the watermark and is verified again
+ * when the scan is resumed.
+ */
+static uint64_t ptio_scan_watermark(struct ptio_scan_work *w)
+{
+	uint64_t done = w->next;
+	unsigned int i;
+
+	if (w->fail_lba < done)
+		done = w->fail_lba;
+
+	for (i = 0; i < w->qd; i++) {
+		if (w->inflight[i] < done)
+			done = w->inflight[i];
+	}
+
+	return done;
+}
+
+/*
+ * Save the scan progress and the bad extents found so far. The checkpoint
+ * file is replaced atomically so that a crash never leaves a partial file.
+ */
+static int ptio_scan_save(struct ptio_scan_work *w)
+{
+	struct ptio_scan_dev *sd = w->sd;
+	char path[PATH_MAX];
+	unsigned int i;
+	int ret;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s.tmp", sd->checkpoint);
+	f = fopen(path, "w");
+	if (!f) {
+		ret = -errno;
+		ptio_dev_err(sd->dev, "Open %s failed %d (%s)\n",
+			     path, -ret, strerror(-ret));
+		return ret;
+	}
+
+	fprintf(f, "%s\n", PTIO_SCAN_CHECKPOINT_MAGIC);
+	fprintf(f, "range %" PRIu64 " %" PRIu64 "\n",
+		sd->lba, sd->nr_blocks);
+	fprintf(f, "done %" PRIu64 "\n", sd->done);
+	for (i = 0; i < sd->nr_bad; i++)
+		fprintf(f, "bad %" PRIu64 " %" PRIu64 "\n",
+			sd->bad[i].lba, sd->bad[i].nr_blocks);
+
+	if (fflush(f) || fsync(fileno(f))) {
+		ptio_dev_err(sd->dev, "Write %s failed %d (%s)\n",
+			     path, errno, strerror(errno));
+		fclose(f);
+		return -EIO;
+	}
+	fclose(f);
+
+	if (rename(path, sd->checkpoint)) {
+		ret = -errno;
+		ptio_dev_err(sd->dev, "Rename %s failed %d (%s)\n",
+			     path, -ret, strerror(-ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Restore the scan progress from the checkpoint file. A missing checkpoint
+ * file is not an error: the scan starts from the beginning of the range.
+ */
+static int ptio_scan_load(struct ptio_scan_work *w)
+{
+	struct ptio_scan_dev *sd = w->sd;
+	uint64_t lba, nr_blocks, done;
+	char line[128];
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(sd->checkpoint, "r");
+	if (!f) {
+		if (errno == ENOENT)
+			return 0;
+		ret = -errno;
+		ptio_dev_err(sd->dev, "Open %s failed %d (%s)\n",
+			     sd->checkpoint, -ret, strerror(-ret));
+		return ret;
+	}
+
+	if (!fgets(line, sizeof(line), f) ||
+	    strncmp(line, PTIO_SCAN_CHECKPOINT_MAGIC,
+		    strlen(PTIO_SCAN_CHECKPOINT_MAGIC)) ||
+	    fscanf(f, "range %" SCNu64 " %" SCNu64 "\n",
+		   &lba, &nr_blocks) != 2 ||
+	    fscanf(f, "done %" SCNu64 "\n", &done) != 1) {
+		ptio_dev_err(sd->dev, "Invalid checkpoint file %s\n",
+			     sd->checkpoint);
+		ret = -EINVAL;
+		goto close;
+	}
+
+	if (lba != sd->lba || nr_blocks != sd->nr_blocks ||
+	    done < lba || done > lba + nr_blocks) {
+		ptio_dev_err(sd->dev,
+			     "Checkpoint file %s does not match the scan range\n",
+			     sd->checkpoint);
+		ret = -EINVAL;
+		goto close;
+	}
+
+	while (fscanf(f, "bad %" SCNu64 " %" SCNu64 "\n",
+		      &lba, &nr_blocks) == 2) {
+		ret = ptio_scan_add_bad(sd, lba, nr_blocks);
+		if (ret)
+			goto close;
+		sd->nr_bad_blocks += nr_blocks;
+	}
+
+	sd->done = done;
+	w->next = done;
+
+	ptio_dev_verbose(sd->dev,
+			 "Resuming scan at LBA %" PRIu64 ", %u bad extents\n",
+			 done, sd->nr_bad);
+
+close:
+	fclose(f);
+
+	return ret;
+}
+
+/*
+ * Verify [@lba, @lba + @nr_blocks), bisecting the range on media errors
+ * to isolate the bad blocks.
+ */
+static int ptio_scan_isolate(struct ptio_scan_work *w,
+			     uint64_t lba, uint64_t nr_blocks)
+{
+	struct ptio_scan_dev *sd = w->sd;
+	struct ptio_cmd cmd;
+	uint64_t half;
+	int ret;
+
+	ret = ptio_scan_verify(sd->dev, &cmd, lba, nr_blocks);
+	__atomic_fetch_add(&sd->nr_cmds, 1, __ATOMIC_RELAXED);
+	if (!ret)
+		return 0;
+	if (ret != -EIO || !ptio_scan_is_media_error(&cmd))
+		return ret;
+
+	if (nr_blocks > 1) {
+		half = nr_blocks / 2;
+		ret = ptio_scan_isolate(w, lba, half);
+		if (ret)
+			return ret;
+		return ptio_scan_isolate(w, lba + half, nr_blocks - half);
+	}
+
+	pthread_mutex_lock(&w->lock);
+	ret = ptio_scan_add_bad(sd, lba, 1);
+	sd->nr_bad_blocks++;
+	pthread_mutex_unlock(&w->lock);
+
+	return ret;
+}
+
+/*
+ * Scan worker: verify chunks of the range until the end of the range or an
+ * error. The chunk size is reduced after a media error, so that the blocks
+ * around a bad block are verified in small chunks, and grows back when
+ * verify commands succeed.
+ */
+static int ptio_scan_worker(void *data, unsigned int idx, unsigned int worker)
+{
+	struct ptio_scan_work *w = data;
+	struct ptio_scan_dev *sd = w->sd;
+	uint64_t lba, nr_blocks;
+	struct ptio_cmd cmd;
+	int ret = 0;
+
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		if (w->ret || w->next >= w->end) {
+			w->inflight[idx] = PTIO_SCAN_IDLE;
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		lba = w->next;
+		nr_blocks = w->chunk;
+		if (nr_blocks > w->end - lba)
+			nr_blocks = w->end - lba;
+		w->next += nr_blocks;
+		w->inflight[idx] = lba;
+		pthread_mutex_unlock(&w->lock);
+
+		ret = ptio_scan_verify(sd->dev, &cmd, lba, nr_blocks);
+		__atomic_fetch_add(&sd->nr_cmds, 1, __ATOMIC_RELAXED);
+		if (ret == -EIO && ptio_scan_is_media_error(&cmd)) {
+			pthread_mutex_lock(&w->lock);
+			w->chunk = w->chunk / 4 ? w->chunk / 4 : 1;
+			pthread_mutex_unlock(&w->lock);
+			ret = ptio_scan_isolate(w, lba, nr_blocks);
+		}
+
+		pthread_mutex_lock(&w->lock);
+		if (ret) {
+			if (!w->ret)
+				w->ret = ret;
+			if (lba < w->fail_lba)
+				w->fail_lba = lba;
+			w->inflight[idx] = PTIO_SCAN_IDLE;
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+
+		if (w->chunk < sd->max_chunk) {
+			w->chunk *= 2;
+			if (w->chunk > sd->max_chunk)
+				w->chunk = sd->max_chunk;
+		}
+
+		w->inflight[idx] = PTIO_SCAN_IDLE;
+		sd->done = ptio_scan_watermark(w);
+		if (sd->checkpoint &&
+		    ptio_now_ns() - w->ckpt_ns >= PTIO_SCAN_CHECKPOINT_NS) {
+			ptio_scan_save(w);
+			w->ckpt_ns = ptio_now_ns();
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return ret;
+}
+
+static int ptio_scan_dev(struct ptio_scan_dev *sd, unsigned int qd,
+			 unsigned int flags)
+{
+	struct ptio_dev *dev = sd->dev;
+	struct ptio_scan_work w = {
+		.sd = sd,
+		.qd = qd ? qd : PTIO_SCAN_DEFAULT_QD,
+		.fail_lba = PTIO_SCAN_IDLE,
+	};
+	unsigned long long start = ptio_now_ns();
+	uint64_t capacity;
+	unsigned int i;
+	int ret;
+
+	sd->error = 0;
+	sd->nr_cmds = 0;
+	sd->nr_bad = 0;
+	sd->nr_bad_blocks = 0;
+
+	if (!dev->logical_block_size) {
+		ptio_dev_err(dev, "Unknown device capacity\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	capacity = (dev->capacity << 9) / dev->logical_block_size;
+	if (!sd->nr_blocks)
+		sd->nr_blocks = capacity - sd->lba;
+	if (sd->lba >= capacity || sd->nr_blocks > capacity - sd->lba) {
+		ptio_dev_err(dev, "Invalid scan range\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (!sd->max_chunk || sd->max_chunk > PTIO_SCAN_MAX_CHUNK)
+		sd->max_chunk = PTIO_SCAN_MAX_CHUNK;
+
+	w.end = sd->lba + sd->nr_blocks;
+	w.next = sd->lba;
+	w.chunk = sd->max_chunk;
+	sd->done = sd->lba;
+
+	if (sd->checkpoint && (flags & PTIO_SCAN_RESUME)) {
+		ret = ptio_scan_load(&w);
+		if (ret)
+			goto out;
+	}
+
+	w.inflight = malloc(w.qd * sizeof(uint64_t));
+	if (!w.inflight) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < w.qd; i++)
+		w.inflight[i] = PTIO_SCAN_IDLE;
+
+	pthread_mutex_init(&w.lock, NULL);
+	w.ckpt_ns = ptio_now_ns();
+
+	/* Each job is a worker, so that up to qd verify commands are queued */
+	ret = ptio_run_dev_jobs(dev, w.qd, w.qd, ptio_scan_worker, &w);
+
+	sd->done = ptio_scan_watermark(&w);
+	if (sd->checkpoint) {
+		int err = ptio_scan_save(&w);
+
+		if (!ret)
+			ret = err;
+	}
+
+	pthread_mutex_destroy(&w.lock);
+	free(w.inflight);
+
+out:
+	sd->time_ns = ptio_now_ns() - start;
+	sd->error = ret;
+
+	return ret;
+}
+
+struct ptio_scan_devs {
+	struct ptio_scan_dev	*sds;
+	unsigned int		qd;
+	unsigned int		flags;
+};
+
+static int ptio_scan_job(void *data, unsigned int idx, unsigned int worker)
+{
+	struct ptio_scan_devs *s = data;
+
+	return ptio_scan_dev(&s->sds[idx], s->qd, s->flags);
+}
+
+/*
+ * Verify the media of @nr_devs devices, using up to @nr_threads threads to
+ * scan devices in parallel. For each device, up to @qd verify commands are
+ * kept in flight. The result of the scan of each device is in its
+ * ptio_scan_dev structure, and the first error is returned. Media errors
+ * are not errors: they are recorded as bad extents.
+ */
+int ptio_scan_media(struct ptio_scan_dev *sds, unsigned int nr_devs,
+		    unsigned int nr_threads, unsigned int qd,
+		    unsigned int flags)
+{
+	struct ptio_scan_devs s = {
+		.sds = sds,
+		.qd = qd,
+		.flags = flags,
+	};
+
+	return ptio_run_jobs(nr_devs, nr_threads, ptio_scan_job, &s);
+}
+
+/*
+ * Free the bad extents of a scanned device.
+ */
+void ptio_free_scan_dev(struct ptio_scan_dev *sd)
+{
+	free(sd->bad);
+	sd->bad = NULL;
+	sd->nr_bad = 0;
+	sd->max_bad = 0;
+}
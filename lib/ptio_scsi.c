@@ -25,6 +25,12 @@ int ptio_scsi_prepare_cdb(struct ptio_dev *dev, struct ptio_cmd *cmd,
 	cmd->cdbsz = cdbsz;
 	memcpy(cmd->cdb, cdb, cdbsz);
 
+	if ((cmd->flags & PTIO_CMD_ATA_CK_COND) &&
+	    !ptio_ata_set_ck_cond(cmd->cdb, cmd->cdbsz)) {
+		ptio_dev_err(dev, "ck_cond requires an ATA PASS-THROUGH CDB\n");
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <assert.h>
 
 #include "ptio.h"
@@ -23,7 +24,7 @@ struct ptio_val_name {
 /*
  * Sense keys.
  */
-static struct ptio_val_name ptio_sense_keys[] =
+static const struct ptio_val_name ptio_sense_keys[] =
 {
 	{ 0x00, "NO SENSE" },
 	{ 0x01,	"RECOVERED ERROR" },
@@ -47,7 +48,7 @@ static struct ptio_val_name ptio_sense_keys[] =
 /*
  * ASC / ASCQ.
  */
-static struct ptio_val_name ptio_asc_ascq[] =
+static const struct ptio_val_name ptio_asc_ascq[] =
 {
 	{ 0x0000, "NO ADDITIONAL SENSE INFORMATION" },
 	{ 0x0001, "FILEMARK DETECTED" },
@@ -927,7 +928,7 @@ static struct ptio_val_name ptio_asc_ascq[] =
 /*
  * Status codes.
  */
-static struct ptio_val_name ptio_status[] =
+static const struct ptio_val_name ptio_status[] =
 {
 	{ 0x00,	"GOOD" },
 	{ 0x02,	"CHECK CONDITION" },
@@ -959,8 +960,11 @@ static struct ptio_val_name ptio_status[] =
 #define PTIO_DID_BAD_INTR	0x09 /* Got an unexpected interrupt */
 #define PTIO_DID_PASSTHROUGH	0x0a /* Forced command past mid-layer. */
 #define PTIO_DID_SOFT_ERROR	0x0b /* The low level driver wants a retry. */
+#define PTIO_DID_IMM_RETRY	0x0c /* Retry without decrementing retry count */
+#define PTIO_DID_REQUEUE	0x0d /* Requeue command */
+#define PTIO_DID_TRANSPORT_DISRUPTED 0x0e /* Transport error disrupted I/O */
 
-static struct ptio_val_name ptio_host_status[] =
+static const struct ptio_val_name ptio_host_status[] =
 {
 	{ PTIO_DID_OK,		"DID_OK" },
 	{ PTIO_DID_NO_CONNECT,	"DID_NO_CONNECT" },
@@ -974,6 +978,9 @@ static struct ptio_val_name ptio_host_status[] =
 	{ PTIO_DID_BAD_INTR,	"DID_BAD_INTR" },
 	{ PTIO_DID_PASSTHROUGH,	"DID_PASSTHROUGH" },
 	{ PTIO_DID_SOFT_ERROR,	"DID_SOFT_ERROR" },
+	{ PTIO_DID_IMM_RETRY,	"DID_IMM_RETRY" },
+	{ PTIO_DID_REQUEUE,	"DID_REQUEUE" },
+	{ PTIO_DID_TRANSPORT_DISRUPTED, "DID_TRANSPORT_DISRUPTED" },
 
 	{ 0xffff, "unknown" },
 };
@@ -992,7 +999,7 @@ static struct ptio_val_name ptio_host_status[] =
 #define PTIO_DRIVER_SENSE	0x08
 #define PTIO_DRIVER_STATUS_MASK	0x0f
 
-static struct ptio_val_name ptio_driver_status[] =
+static const struct ptio_val_name ptio_driver_status[] =
 {
 	{ PTIO_DRIVER_OK,	"DRIVER_OK" },
 	{ PTIO_DRIVER_BUSY,	"DRIVER_BUSY" },
@@ -1022,9 +1029,10 @@ static struct ptio_val_name ptio_driver_status[] =
 #define ptio_cmd_driver_flags(cmd)	((cmd)->io_hdr.driver_status &  \
 					 PTIO_DRIVER_FLAGS_MASK)
 
-static const char *ptio_find_val_name(struct ptio_val_name *vals, uint16_t val)
+static const char *ptio_find_val_name(const struct ptio_val_name *vals,
+				      uint16_t val)
 {
-	struct ptio_val_name *v = &vals[0];
+	const struct ptio_val_name *v = &vals[0];
 
 	while (v->val != 0xffff) {
 		if (v->val == val)
@@ -1061,36 +1069,407 @@ static inline const char *ptio_driver_status_str(uint8_t status)
 }
 
 /*
- * Get sense key and ASC/ASCQ from sense data.
+ * Sense keys used for classification.
  */
-static void ptio_get_scsi_sense(uint8_t *sense, size_t sensesz,
-				uint8_t *key, uint16_t *asc_ascq)
+#define PTIO_SK_NO_SENSE		0x00
+#define PTIO_SK_RECOVERED_ERROR		0x01
+#define PTIO_SK_NOT_READY		0x02
+#define PTIO_SK_MEDIUM_ERROR		0x03
+#define PTIO_SK_HARDWARE_ERROR		0x04
+#define PTIO_SK_ILLEGAL_REQUEST		0x05
+#define PTIO_SK_UNIT_ATTENTION		0x06
+#define PTIO_SK_DATA_PROTECT		0x07
+#define PTIO_SK_ABORTED_COMMAND		0x0B
+
+/* ATA PASS-THROUGH INFORMATION AVAILABLE */
+#define PTIO_ASC_ATA_PT_INFO		0x001D
+
+static const uint32_t ptio_sense_key_class[16] = {
+	[PTIO_SK_RECOVERED_ERROR]	= PTIO_SENSE_RECOVERED,
+	[PTIO_SK_NOT_READY]		= PTIO_SENSE_NOT_READY,
+	[PTIO_SK_MEDIUM_ERROR]		= PTIO_SENSE_MEDIUM_ERROR,
+	[PTIO_SK_HARDWARE_ERROR]	= PTIO_SENSE_HARDWARE_ERROR,
+	[PTIO_SK_ILLEGAL_REQUEST]	= PTIO_SENSE_ILLEGAL_REQUEST,
+	[PTIO_SK_UNIT_ATTENTION]	= PTIO_SENSE_UNIT_ATTENTION,
+	[PTIO_SK_DATA_PROTECT]		= PTIO_SENSE_DATA_PROTECT,
+	[PTIO_SK_ABORTED_COMMAND]	= PTIO_SENSE_ABORTED,
+};
+
+/*
+ * Status codes used for retries.
+ */
+#define PTIO_STATUS_CHECK_CONDITION	0x02
+#define PTIO_STATUS_BUSY		0x08
+#define PTIO_STATUS_TASK_SET_FULL	0x28
+
+#define PTIO_RETRY_NONE			-1
+
+/*
+ * Retry rules, checked in order: the first rule matching the sense key and
+ * ASC/ASCQ (-1 matches any value) gives the retry class of a failure.
+ */
+struct ptio_retry_rule {
+	uint8_t		key;
+	int16_t		asc;
+	int16_t		ascq;
+	int		class;
+};
+
+static const struct ptio_retry_rule ptio_retry_rules[] = {
+	/* Power on, reset, parameters or capacity changed, ... */
+	{ PTIO_SK_UNIT_ATTENTION,  -1,   -1,   PTIO_RETRY_UNIT_ATTENTION },
+	/* Becoming ready */
+	{ PTIO_SK_NOT_READY,	   0x04, 0x01, PTIO_RETRY_NOT_READY },
+	/* Asymmetric access state transition */
+	{ PTIO_SK_NOT_READY,	   0x04, 0x0A, PTIO_RETRY_NOT_READY },
+	/* Command aborted by an ATA device */
+	{ PTIO_SK_ABORTED_COMMAND, 0x00, 0x00, PTIO_RETRY_NONE },
+	/* Transport errors, e.g. on a busy SAS expander */
+	{ PTIO_SK_ABORTED_COMMAND, -1,   -1,   PTIO_RETRY_ABORTED },
+};
+
+static const char *ptio_retry_class_name[PTIO_RETRY_NR_CLASSES] = {
+	[PTIO_RETRY_UNIT_ATTENTION]	= "unit attention",
+	[PTIO_RETRY_NOT_READY]		= "not ready",
+	[PTIO_RETRY_ABORTED]		= "aborted",
+	[PTIO_RETRY_BUSY]		= "busy",
+};
+
+static int ptio_sense_retry_class(struct ptio_sense *s)
 {
-	*key = 0;
-	*asc_ascq = 0;
+	const struct ptio_retry_rule *rule;
+	size_t i;
+
+	for (i = 0; i < sizeof(ptio_retry_rules) / sizeof(*rule); i++) {
+		rule = &ptio_retry_rules[i];
+		if (rule->key == s->key &&
+		    (rule->asc < 0 || rule->asc == s->asc) &&
+		    (rule->ascq < 0 || rule->ascq == s->ascq))
+			return rule->class;
+	}
 
-	if (sensesz < 4)
-		return;
+	return PTIO_RETRY_NONE;
+}
+
+/*
+ * Parse the ATA Status Return sense data descriptor.
+ */
+static void ptio_decode_ata_desc(uint8_t *desc, struct ptio_sense *s)
+{
+	struct ptio_ata_regs *ata = &s->ata;
+
+	ata->extend = desc[2] & 0x01;
+	ata->error = desc[3];
+	ata->count = (uint16_t)desc[4] << 8 | desc[5];
+	ata->lba = (uint64_t)desc[10] << 40 | (uint64_t)desc[8] << 32 |
+		(uint64_t)desc[6] << 24 | (uint64_t)desc[11] << 16 |
+		(uint64_t)desc[9] << 8 | desc[7];
+	ata->device = desc[12];
+	ata->status = desc[13];
+	s->flags |= PTIO_SENSE_ATA_REGS;
+}
+
+static void ptio_decode_sense_desc(uint8_t *sense, size_t sensesz,
+				   struct ptio_sense *s)
+{
+	size_t i = 8, end, len;
+	uint8_t *desc;
+
+	s->key = sense[1] & 0x0F;
+	s->asc = sense[2];
+	s->ascq = sense[3];
 
-	if ((sense[0] & 0x7F) == 0x72 || (sense[0] & 0x7F) == 0x73) {
-		/* store sense key, ASC/ASCQ */
-		*key = sense[1] & 0x0F;
-		*asc_ascq = ((int)sense[2] << 8) | (int)sense[3];
+	if (sensesz < 8)
 		return;
+
+	end = 8 + sense[7];
+	if (end > sensesz)
+		end = sensesz;
+
+	while (i + 2 <= end) {
+		desc = &sense[i];
+		len = desc[1] + 2;
+		if (i + len > end)
+			break;
+
+		switch (desc[0]) {
+		case 0x00:
+			/* Information */
+			if (len >= 12 && (desc[2] & 0x80)) {
+				s->info = ptio_get_be64(&desc[4]);
+				s->flags |= PTIO_SENSE_INFO;
+			}
+			break;
+		case 0x01:
+			/* Command specific information */
+			if (len >= 12) {
+				s->cmd_info = ptio_get_be64(&desc[4]);
+				s->flags |= PTIO_SENSE_CMD_INFO;
+			}
+			break;
+		case 0x02:
+			/* Sense key specific */
+			if (len >= 7 && (desc[4] & 0x80)) {
+				memcpy(s->sks, &desc[4], 3);
+				s->flags |= PTIO_SENSE_SKS;
+			}
+			break;
+		case 0x09:
+			/* ATA Status Return */
+			if (len >= 14)
+				ptio_decode_ata_desc(desc, s);
+			break;
+		default:
+			break;
+		}
+
+		i += len;
 	}
+}
 
+static void ptio_decode_sense_fixed(uint8_t *sense, size_t sensesz,
+				    struct ptio_sense *s)
+{
+	s->key = sense[2] & 0x0F;
 	if (sensesz < 14)
 		return;
 
-	if ((sense[0] & 0x7F) == 0x70 || (sense[0] & 0x7F) == 0x71) {
-		/* store sense key, ASC/ASCQ */
-		*key = sense[2] & 0x0F;
-		*asc_ascq = ((int)sense[12] << 8) | (int)sense[13];
+	s->asc = sense[12];
+	s->ascq = sense[13];
+
+	if (sense[0] & 0x80) {
+		s->info = ptio_get_be32(&sense[3]);
+		s->flags |= PTIO_SENSE_INFO;
+	}
+
+	s->cmd_info = ptio_get_be32(&sense[8]);
+	s->flags |= PTIO_SENSE_CMD_INFO;
+
+	if (sensesz >= 18 && (sense[15] & 0x80)) {
+		memcpy(s->sks, &sense[15], 3);
+		s->flags |= PTIO_SENSE_SKS;
+	}
+
+	/*
+	 * ATA PASS-THROUGH registers: the information field has the error,
+	 * status, device and count (7:0) registers, the command specific
+	 * information field has the extend bit and LBA (23:0). The upper
+	 * bytes of the count and LBA are not available.
+	 */
+	if (ptio_sense_asc_ascq(s) == PTIO_ASC_ATA_PT_INFO) {
+		s->ata.error = sense[3];
+		s->ata.status = sense[4];
+		s->ata.device = sense[5];
+		s->ata.count = sense[6];
+		s->ata.extend = sense[8] & 0x80;
+		s->ata.lba = (uint64_t)sense[11] << 16 |
+			(uint64_t)sense[10] << 8 | sense[9];
+		s->flags |= PTIO_SENSE_ATA_REGS;
+		if (sense[8] & 0x60)
+			s->flags |= PTIO_SENSE_ATA_PARTIAL;
 	}
 }
 
+/*
+ * Decode fixed or descriptor format sense data into @s, without any memory
+ * allocation. Return -EINVAL if the sense data is not valid.
+ */
+int ptio_decode_sense(uint8_t *sense, size_t sensesz, struct ptio_sense *s)
+{
+	uint8_t rcode;
+
+	memset(s, 0, sizeof(*s));
+
+	if (sensesz < 4)
+		return -EINVAL;
+
+	rcode = sense[0] & 0x7F;
+	switch (rcode) {
+	case 0x71:
+	case 0x73:
+		s->flags |= PTIO_SENSE_DEFERRED;
+		/* fallthrough */
+	case 0x70:
+	case 0x72:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	s->response_code = rcode;
+	if (rcode >= 0x72)
+		ptio_decode_sense_desc(sense, sensesz, s);
+	else
+		ptio_decode_sense_fixed(sense, sensesz, s);
+
+	s->flags |= PTIO_SENSE_VALID | ptio_sense_key_class[s->key];
+
+	/* Progress indication of NO SENSE and NOT READY */
+	if ((s->flags & PTIO_SENSE_SKS) &&
+	    (s->key == PTIO_SK_NO_SENSE || s->key == PTIO_SK_NOT_READY)) {
+		s->progress = (uint16_t)s->sks[1] << 8 | s->sks[2];
+		s->flags |= PTIO_SENSE_PROGRESS;
+	}
+
+	/* UNRECOVERED READ ERROR and WRITE ERROR */
+	if (s->asc == 0x11 || s->asc == 0x0C)
+		s->flags |= PTIO_SENSE_MEDIUM_ERROR;
+
+	if (ptio_sense_retry_class(s) != PTIO_RETRY_NONE)
+		s->flags |= PTIO_SENSE_RETRYABLE;
+
+	return 0;
+}
+
+/*
+ * Initialize a retry policy with the default limits.
+ */
+void ptio_init_retry_policy(struct ptio_retry_policy *policy)
+{
+	policy->max_retries[PTIO_RETRY_UNIT_ATTENTION] = 3;
+	policy->max_retries[PTIO_RETRY_NOT_READY] = 10;
+	policy->max_retries[PTIO_RETRY_ABORTED] = 3;
+	policy->max_retries[PTIO_RETRY_BUSY] = 5;
+	policy->min_delay = 10;
+	policy->max_delay = 5000;
+}
+
+/*
+ * Get the retry class of a failed command, from its host status, status
+ * and decoded sense data.
+ */
+static int ptio_cmd_retry_class(struct ptio_cmd *cmd)
+{
+	switch (cmd->io_hdr.host_status) {
+	case PTIO_DID_OK:
+		break;
+	case PTIO_DID_BUS_BUSY:
+	case PTIO_DID_SOFT_ERROR:
+	case PTIO_DID_IMM_RETRY:
+	case PTIO_DID_REQUEUE:
+	case PTIO_DID_TRANSPORT_DISRUPTED:
+		return PTIO_RETRY_BUSY;
+	default:
+		return PTIO_RETRY_NONE;
+	}
+
+	switch (cmd->io_hdr.status) {
+	case PTIO_STATUS_BUSY:
+	case PTIO_STATUS_TASK_SET_FULL:
+		return PTIO_RETRY_BUSY;
+	case PTIO_STATUS_CHECK_CONDITION:
+		if (cmd->sense.flags & PTIO_SENSE_VALID)
+			return ptio_sense_retry_class(&cmd->sense);
+		return PTIO_RETRY_NONE;
+	default:
+		return PTIO_RETRY_NONE;
+	}
+}
+
+/*
+ * Decide if a failed command must be retried according to the device retry
+ * policy, and if so, wait for an exponential backoff delay with jitter
+ * before returning true.
+ */
+static bool ptio_retry_cmd(struct ptio_dev *dev, struct ptio_cmd *cmd)
+{
+	struct ptio_retry_policy *policy = &dev->retry;
+	unsigned long long delay, rnd, deadline, now;
+	struct timespec ts;
+	int class;
+
+	/* Do not block the submitter of asynchronous commands */
+	if (cmd->async)
+		return false;
+
+	class = ptio_cmd_retry_class(cmd);
+	if (class == PTIO_RETRY_NONE)
+		return false;
+
+	if (cmd->retries >= policy->max_retries[class]) {
+		if (cmd->retries)
+			ptio_dev_stat_inc(dev, nr_retries_exhausted);
+		return false;
+	}
+
+	/* Exponential backoff, with a random delay in [delay / 2, delay] */
+	delay = policy->min_delay ? policy->min_delay : 1;
+	if (cmd->retries < 32)
+		delay <<= cmd->retries;
+	else
+		delay = ULLONG_MAX;
+	if (policy->max_delay && delay > policy->max_delay)
+		delay = policy->max_delay;
+
+	rnd = ptio_now_ns() ^ (unsigned long long)(uintptr_t)cmd;
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 7;
+	rnd ^= rnd << 17;
+	delay = delay / 2 + rnd % (delay / 2 + 1);
+
+	/* Do not wait past the device deadline: the retry would fail anyway */
+	deadline = __atomic_load_n(&dev->deadline, __ATOMIC_RELAXED);
+	if (deadline) {
+		now = ptio_now_ns();
+		if (now >= deadline || delay >= (deadline - now) / 1000000) {
+			ptio_dev_verbose(dev,
+				"Command failed (%s), no retry before the deadline\n",
+				ptio_retry_class_name[class]);
+			return false;
+		}
+	}
+
+	cmd->retries++;
+	ptio_dev_stat_inc(dev, nr_retries);
+	ptio_dev_verbose(dev, "Command failed (%s), retry %u in %llu ms\n",
+			 ptio_retry_class_name[class], cmd->retries, delay);
+
+	/* No usleep(): without max_delay, delay * 1000 overflows its argument */
+	ts.tv_sec = delay / 1000;
+	ts.tv_nsec = (delay % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+
+	/* Do not let the reissued command report this failure sense data */
+	memset(cmd->sense_buf, 0, sizeof(cmd->sense_buf));
+	memset(&cmd->sense, 0, sizeof(cmd->sense));
+	cmd->sense_key = 0;
+	cmd->asc_ascq = 0;
+
+	return true;
+}
+
+/*
+ * With ck_cond set, the SATL reports the ATA output registers of a successful
+ * command with CHECK CONDITION and a NO SENSE or RECOVERED ERROR sense key.
+ * Return true if this is what @cmd completed with.
+ */
+static bool ptio_ata_ck_cond_ok(struct ptio_cmd *cmd)
+{
+	struct ptio_sense *s = &cmd->sense;
+
+	if (cmd->io_hdr.host_status != PTIO_DID_OK ||
+	    !cmd->io_hdr.sb_len_wr)
+		return false;
+
+	ptio_decode_sense(cmd->sense_buf, cmd->io_hdr.sb_len_wr, s);
+	cmd->sense_key = s->key;
+	cmd->asc_ascq = ptio_sense_asc_ascq(s);
+
+	if (!(s->flags & PTIO_SENSE_ATA_REGS))
+		return false;
+	if (s->key != PTIO_SK_NO_SENSE && s->key != PTIO_SK_RECOVERED_ERROR)
+		return false;
+
+	/* ERR and DF clear */
+	return !(s->ata.status & 0x21);
+}
+
 int ptio_get_sense(struct ptio_dev *dev, struct ptio_cmd *cmd)
 {
+	if ((cmd->flags & PTIO_CMD_ATA_CK_COND) && ptio_ata_ck_cond_ok(cmd))
+		return 0;
+
 	if (cmd->io_hdr.status || cmd->io_hdr.host_status != PTIO_DID_OK ||
 	    (ptio_cmd_driver_status(cmd) &&
 	     (ptio_cmd_driver_status(cmd) != PTIO_DRIVER_SENSE))) {
@@ -1100,8 +1479,19 @@ int ptio_get_sense(struct ptio_dev *dev, struct ptio_cmd *cmd)
 			return -ETIMEDOUT;
 		}
 
-		ptio_get_scsi_sense(cmd->sense_buf, cmd->io_hdr.sb_len_wr,
-				    &cmd->sense_key, &cmd->asc_ascq);
+		ptio_decode_sense(cmd->sense_buf, cmd->io_hdr.sb_len_wr,
+				  &cmd->sense);
+		cmd->sense_key = cmd->sense.key;
+		cmd->asc_ascq = ptio_sense_asc_ascq(&cmd->sense);
+
+		/* The device configuration may have changed */
+		if (cmd->sense_key == PTIO_SK_UNIT_ATTENTION) {
+			ptio_dev_stat_inc(dev, nr_cache_invalidations);
+			ptio_cache_invalidate(dev);
+		}
+
+		if (ptio_retry_cmd(dev, cmd))
+			return -EAGAIN;
 
 		ptio_dev_err(dev, "SCSI command failed: host status %s, driver status %s\n",
 			     ptio_host_status_str(cmd->io_hdr.host_status),
@@ -1124,13 +1514,13 @@ int ptio_get_sense(struct ptio_dev *dev, struct ptio_cmd *cmd)
 
 void ptio_print_sense(struct ptio_dev *dev, uint8_t *sense, size_t sensesz)
 {
-	uint16_t asc_ascq;
-	uint8_t key;
+	struct ptio_sense s;
 
-	ptio_get_scsi_sense(sense, sensesz, &key, &asc_ascq);
+	ptio_decode_sense(sense, sensesz, &s);
 
 	ptio_dev_err(dev, "SCSI command sense key : 0x%02x   (%s)\n",
-		     key, ptio_sense_key_str(key));
+		     s.key, ptio_sense_key_str(s.key));
 	ptio_dev_err(dev, "SCSI command asc/ascq  : 0x%04x (%s)\n",
-		     asc_ascq, ptio_asc_ascq_str(asc_ascq));
+		     ptio_sense_asc_ascq(&s),
+		     ptio_asc_ascq_str(ptio_sense_asc_ascq(&s)));
 }
@@ -0,0 +1,479 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ptio.h"
+
+/*
+ * Streaming of large device data to a file: the data is read in chunks into
+ * a ring of buffers, which a writer thread writes to the file in order, so
+ * that device reads overlap with file writes and memory use is bounded by
+ * the number of buffers times the chunk size.
+ */
+#define PTIO_STREAM_DEFAULT_NR_BUFS	2
+#define PTIO_STREAM_MAX_NR_BUFS		64
+
+/* ATA Device Internal Status logs */
+#define PTIO_ATA_LOG_CURRENT_STATUS	0x24
+#define PTIO_ATA_LOG_SAVED_STATUS	0x25
+
+/* SCSI READ BUFFER error history */
+#define PTIO_SCSI_RB_MODE_ERROR_HISTORY	0x1C
+#define PTIO_SCSI_EH_DIR		0x00
+#define PTIO_SCSI_EH_DIR_SNAPSHOT	0x01
+#define PTIO_SCSI_EH_FIRST_BUF		0x10
+#define PTIO_SCSI_EH_LAST_BUF		0xEF
+#define PTIO_SCSI_EH_DIR_LEN		2048
+#define PTIO_SCSI_RB_MAX_OFST		0xFFFFFF
+
+struct ptio_stream;
+
+/*
+ * Read the next chunk of data into @buf, setting @len to the number of
+ * bytes read. A length of 0 signals the end of the data.
+ */
+typedef int (*ptio_stream_read_fn)(struct ptio_stream *s, uint8_t *buf,
+				   size_t *len);
+
+struct ptio_stream {
+	struct ptio_dev		*dev;
+	int			fd;
+	ptio_stream_read_fn	read;
+
+	/* Buffer ring */
+	unsigned int		nr_bufs;
+	size_t			bufsz;
+	uint8_t			**bufs;
+	size_t			*lens;
+	unsigned int		nr_full;
+	bool			eof;
+	int			err;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+
+	unsigned long long	size;
+
+	/* Source state */
+	union {
+		struct {
+			uint8_t		log;
+			unsigned int	next_page;
+			unsigned int	nr_pages;
+		} ata;
+		struct {
+			uint8_t		dir[PTIO_SCSI_EH_DIR_LEN];
+			unsigned int	next_desc;
+			unsigned int	nr_descs;
+			uint8_t		buf_id;
+			uint32_t	ofst;
+			uint32_t	len;
+		} scsi;
+	};
+};
+
+static int ptio_stream_write(struct ptio_stream *s, uint8_t *buf, size_t len)
+{
+	size_t ofst = 0;
+	ssize_t ret;
+
+	while (ofst < len) {
+		ret = write(s->fd, buf + ofst, len - ofst);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			ptio_dev_err(s->dev, "Write stream failed %d (%s)\n",
+				     errno, strerror(errno));
+			return ret;
+		}
+		ofst += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Writer thread: write full buffers in order, until the reader signals the
+ * end of the data.
+ */
+static void *ptio_stream_writer(void *arg)
+{
+	struct ptio_stream *s = arg;
+	unsigned int tail = 0;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		while (!s->nr_full && !s->eof && !s->err)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->err || !s->nr_full) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		ret = ptio_stream_write(s, s->bufs[tail], s->lens[tail]);
+
+		pthread_mutex_lock(&s->lock);
+		if (ret) {
+			s->err = ret;
+		} else {
+			s->size += s->lens[tail];
+			s->nr_full--;
+		}
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		if (ret)
+			break;
+
+		tail = (tail + 1) % s->nr_bufs;
+	}
+
+	return NULL;
+}
+
+/*
+ * Read the data into free buffers, handing them to the writer thread.
+ */
+static int ptio_stream_run(struct ptio_stream *s)
+{
+	unsigned int head = s->nr_full;
+	pthread_t writer;
+	int ret, err;
+
+	ret = pthread_create(&writer, NULL, ptio_stream_writer, s);
+	if (ret) {
+		ptio_dev_err(s->dev, "Create writer thread failed %d (%s)\n",
+			     ret, strerror(ret));
+		return -ret;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		while (s->nr_full == s->nr_bufs && !s->err)
+			pthread_cond_wait(&s->cond, &s->lock);
+		err = s->err;
+		pthread_mutex_unlock(&s->lock);
+		if (err)
+			break;
+
+		ret = s->read(s, s->bufs[head], &s->lens[head]);
+		if (ret || !s->lens[head])
+			break;
+
+		pthread_mutex_lock(&s->lock);
+		s->nr_full++;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+
+		head = (head + 1) % s->nr_bufs;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	if (ret && !s->err)
+		s->err = ret;
+	s->eof = true;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_join(writer, NULL);
+
+	return s->err;
+}
+
+/*
+ * Read the pages of an ATA Device Internal Status log, up to the last page
+ * of data area 3. Reading page 0 of the current log with the initialize bit
+ * set makes the device capture a new snapshot.
+ */
+static int ptio_stream_ata_read(struct ptio_stream *s, uint8_t *buf,
+				size_t *len)
+{
+	struct ptio_dev *dev = s->dev;
+	unsigned int nr_pages;
+	struct ptio_cmd cmd;
+	int ret;
+
+	*len = 0;
+	if (s->ata.next_page >= s->ata.nr_pages)
+		return 0;
+
+	nr_pages = s->bufsz / 512;
+	if (nr_pages > s->ata.nr_pages - s->ata.next_page)
+		nr_pages = s->ata.nr_pages - s->ata.next_page;
+
+	ret = ptio_ata_read_log(dev, s->ata.log, s->ata.next_page, false,
+				&cmd, buf, nr_pages * 512);
+	if (ret) {
+		ptio_dev_err(dev, "Read log 0x%02x page %u failed\n",
+			     s->ata.log, s->ata.next_page);
+		return ret;
+	}
+
+	s->ata.next_page += nr_pages;
+	*len = nr_pages * 512;
+
+	return 0;
+}
+
+static int ptio_stream_ata_init(struct ptio_stream *s,
+				enum ptio_status_log log)
+{
+	struct ptio_dev *dev = s->dev;
+	struct ptio_cmd cmd;
+	unsigned int last;
+	uint8_t *hdr;
+	int ret;
+
+	s->ata.log = log == PTIO_STATUS_LOG_CURRENT ?
+		PTIO_ATA_LOG_CURRENT_STATUS : PTIO_ATA_LOG_SAVED_STATUS;
+
+	ret = ptio_ata_log_nr_pages(dev, s->ata.log);
+	if (ret < 0)
+		return ret;
+	if (!ret) {
+		ptio_dev_err(dev, "Log 0x%02x not supported\n", s->ata.log);
+		return -EOPNOTSUPP;
+	}
+	s->ata.nr_pages = ret;
+
+	/* The header page goes in the first buffer */
+	hdr = s->bufs[0];
+	ret = ptio_ata_read_log(dev, s->ata.log, 0,
+				s->ata.log == PTIO_ATA_LOG_CURRENT_STATUS,
+				&cmd, hdr, 512);
+	if (ret) {
+		ptio_dev_err(dev, "Read log 0x%02x header failed\n",
+			     s->ata.log);
+		return ret;
+	}
+
+	/* Data area 3 last page, which ends the log data */
+	last = ptio_get_le16(&hdr[12]);
+	if (last + 1 < s->ata.nr_pages)
+		s->ata.nr_pages = last + 1;
+
+	s->lens[0] = 512;
+	s->nr_full = 1;
+	s->ata.next_page = 1;
+
+	return 0;
+}
+
+/*
+ * Read the error history buffers listed in the error history directory,
+ * one after the other, using READ BUFFER with increasing offsets.
+ */
+static int ptio_stream_scsi_read(struct ptio_stream *s, uint8_t *buf,
+				 size_t *len)
+{
+	struct ptio_dev *dev = s->dev;
+	uint8_t cdb[10] = {};
+	struct ptio_cmd cmd;
+	uint8_t *desc;
+	size_t sz;
+	int ret;
+
+	*len = 0;
+next:
+	while (s->scsi.ofst >= s->scsi.len) {
+		if (s->scsi.next_desc >= s->scsi.nr_descs)
+			return 0;
+		desc = &s->scsi.dir[32 + s->scsi.next_desc * 8];
+		s->scsi.next_desc++;
+		if (desc[0] < PTIO_SCSI_EH_FIRST_BUF ||
+		    desc[0] > PTIO_SCSI_EH_LAST_BUF)
+			continue;
+		s->scsi.buf_id = desc[0];
+		s->scsi.len = ptio_get_be32(&desc[4]);
+		s->scsi.ofst = 0;
+	}
+
+	if (s->scsi.ofst > PTIO_SCSI_RB_MAX_OFST) {
+		ptio_dev_err(dev,
+			     "Error history buffer 0x%02x too large\n",
+			     s->scsi.buf_id);
+		return -EFBIG;
+	}
+
+	sz = s->bufsz;
+	if (sz > s->scsi.len - s->scsi.ofst)
+		sz = s->scsi.len - s->scsi.ofst;
+
+	cdb[0] = 0x3C; /* READ BUFFER */
+	cdb[1] = PTIO_SCSI_RB_MODE_ERROR_HISTORY;
+	cdb[2] = s->scsi.buf_id;
+	cdb[3] = s->scsi.ofst >> 16;
+	cdb[4] = s->scsi.ofst >> 8;
+	cdb[5] = s->scsi.ofst;
+	cdb[6] = sz >> 16;
+	cdb[7] = sz >> 8;
+	cdb[8] = sz;
+	ret = ptio_exec_cmd(dev, &cmd, cdb, sizeof(cdb), PTIO_CDB_SCSI,
+			    buf, sz, PTIO_DXFER_FROM_DEV, 0);
+	if (ret) {
+		ptio_dev_err(dev,
+			     "Read error history buffer 0x%02x failed\n",
+			     s->scsi.buf_id);
+		return ret;
+	}
+
+	/* The buffer may hold less data than its maximum length */
+	if (!cmd.bufsz) {
+		s->scsi.len = s->scsi.ofst;
+		goto next;
+	}
+	s->scsi.ofst += cmd.bufsz;
+	*len = cmd.bufsz;
+
+	return 0;
+}
+
+static int ptio_stream_scsi_init(struct ptio_stream *s,
+				 enum ptio_status_log log)
+{
+	struct ptio_dev *dev = s->dev;
+	uint8_t cdb[10] = {};
+	struct ptio_cmd cmd;
+	size_t dirsz;
+	int ret;
+
+	/* The current log is a new snapshot of the error history */
+	cdb[0] = 0x3C; /* READ BUFFER */
+	cdb[1] = PTIO_SCSI_RB_MODE_ERROR_HISTORY;
+	cdb[2] = log == PTIO_STATUS_LOG_CURRENT ?
+		PTIO_SCSI_EH_DIR_SNAPSHOT : PTIO_SCSI_EH_DIR;
+	ptio_set_be16(&cdb[7], PTIO_SCSI_EH_DIR_LEN);
+	ret = ptio_exec_cmd(dev, &cmd, cdb, sizeof(cdb), PTIO_CDB_SCSI,
+			    s->scsi.dir, PTIO_SCSI_EH_DIR_LEN,
+			    PTIO_DXFER_FROM_DEV, 0);
+	if (ret) {
+		ptio_dev_err(dev, "Read error history directory failed\n");
+		return ret;
+	}
+
+	dirsz = 32 + ptio_get_be16(&s->scsi.dir[30]);
+	if (dirsz > cmd.bufsz)
+		dirsz = cmd.bufsz;
+	if (dirsz < 32) {
+		ptio_dev_err(dev, "Invalid error history directory\n");
+		return -EIO;
+	}
+	s->scsi.nr_descs = (dirsz - 32) / 8;
+
+	/* The directory goes in the first buffer */
+	memcpy(s->bufs[0], s->scsi.dir, dirsz);
+	s->lens[0] = dirsz;
+	s->nr_full = 1;
+
+	return 0;
+}
+
+static void ptio_stream_free(struct ptio_stream *s)
+{
+	unsigned int i;
+
+	if (s->bufs) {
+		for (i = 0; i < s->nr_bufs; i++)
+			free(s->bufs[i]);
+		free(s->bufs);
+	}
+	free(s->lens);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+}
+
+/*
+ * Write a device internal status log to the file @fd as it is read from the
+ * device: the ATA Current or Saved Device Internal Status log, or for SCSI
+ * devices the READ BUFFER error history directory followed by the error
+ * history buffers. The data is read in chunks of the maximum transfer size
+ * of the device, using @nr_bufs buffers (0 for double buffering) so that
+ * device reads overlap with file writes. If @size is not NULL, it is set to
+ * the number of bytes written.
+ */
+int ptio_dump_status_log(struct ptio_dev *dev, enum ptio_status_log log,
+			 int fd, unsigned int nr_bufs,
+			 unsigned long long *size)
+{
+	struct ptio_stream *s;
+	unsigned int i;
+	size_t max_xfer;
+	int ret;
+
+	if (log != PTIO_STATUS_LOG_CURRENT && log != PTIO_STATUS_LOG_SAVED)
+		return -EINVAL;
+
+	if (!nr_bufs)
+		nr_bufs = PTIO_STREAM_DEFAULT_NR_BUFS;
+	if (nr_bufs < 2 || nr_bufs > PTIO_STREAM_MAX_NR_BUFS)
+		return -EINVAL;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->dev = dev;
+	s->fd = fd;
+	s->nr_bufs = nr_bufs;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	/* Chunks of whole log pages, within the command transfer limits */
+	max_xfer = ptio_dev_max_xfer(dev);
+	if (ptio_dev_is_ata(dev)) {
+		if (max_xfer > 0xffff * 512)
+			max_xfer = 0xffff * 512;
+	} else {
+		if (max_xfer > PTIO_SCSI_RB_MAX_OFST)
+			max_xfer = PTIO_SCSI_RB_MAX_OFST;
+	}
+	s->bufsz = max_xfer & ~511UL;
+	if (s->bufsz < PTIO_SCSI_EH_DIR_LEN)
+		s->bufsz = PTIO_SCSI_EH_DIR_LEN;
+
+	ret = -ENOMEM;
+	s->bufs = calloc(nr_bufs, sizeof(uint8_t *));
+	s->lens = calloc(nr_bufs, sizeof(size_t));
+	if (!s->bufs || !s->lens)
+		goto out;
+	for (i = 0; i < nr_bufs; i++) {
+		s->bufs[i] = ptio_alloc_dev_buf(dev, s->bufsz);
+		if (!s->bufs[i])
+			goto out;
+	}
+
+	ptio_dev_verbose(dev, "Streaming status log with %u x %zu B buffers\n",
+			 nr_bufs, s->bufsz);
+
+	if (ptio_dev_is_ata(dev)) {
+		s->read = ptio_stream_ata_read;
+		ret = ptio_stream_ata_init(s, log);
+	} else {
+		s->read = ptio_stream_scsi_read;
+		ret = ptio_stream_scsi_init(s, log);
+	}
+	if (ret)
+		goto out;
+
+	ret = ptio_stream_run(s);
+
+	if (size)
+		*size = s->size;
+
+out:
+	ptio_stream_free(s);
+	free(s);
+
+	return ret;
+}
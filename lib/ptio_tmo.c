@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <scsi/sg.h>
+
+#include "ptio.h"
+
+/* Not defined by older C library headers */
+#ifndef SG_SCSI_RESET_TARGET
+#define SG_SCSI_RESET_TARGET		4
+#endif
+#ifndef SG_SCSI_RESET_NO_ESCALATE
+#define SG_SCSI_RESET_NO_ESCALATE	0x100
+#endif
+
+/*
+ * Default command timeouts in ms, per command class.
+ */
+static const unsigned int ptio_cmd_class_timeout[PTIO_CMD_NR_CLASSES] = {
+	[PTIO_CMD_CLASS_DEFAULT]	= 30000,
+	[PTIO_CMD_CLASS_QUICK]		= 10000,
+	[PTIO_CMD_CLASS_IO]		= 30000,
+	[PTIO_CMD_CLASS_LONG]		= 600000,
+};
+
+static enum ptio_cmd_class ptio_ata_cmd_class(uint8_t opcode)
+{
+	switch (opcode) {
+	case 0x2F: /* READ LOG EXT */
+	case 0x47: /* READ LOG DMA EXT */
+	case 0xB0: /* SMART */
+	case 0xE5: /* CHECK POWER MODE */
+	case 0xEC: /* IDENTIFY DEVICE */
+	case 0xEF: /* SET FEATURES */
+		return PTIO_CMD_CLASS_QUICK;
+	case 0x06: /* DATA SET MANAGEMENT */
+	case 0x24: /* READ SECTORS EXT */
+	case 0x25: /* READ DMA EXT */
+	case 0x34: /* WRITE SECTORS EXT */
+	case 0x35: /* WRITE DMA EXT */
+	case 0x42: /* READ VERIFY SECTORS EXT */
+	case 0x4A: /* ZAC MANAGEMENT IN */
+	case 0x60: /* READ FPDMA QUEUED */
+	case 0x61: /* WRITE FPDMA QUEUED */
+	case 0x64: /* SEND FPDMA QUEUED */
+	case 0x9F: /* ZAC MANAGEMENT OUT */
+	case 0xC8: /* READ DMA */
+	case 0xCA: /* WRITE DMA */
+	case 0xE7: /* FLUSH CACHE */
+	case 0xEA: /* FLUSH CACHE EXT */
+		return PTIO_CMD_CLASS_IO;
+	case 0x44: /* ZERO EXT */
+	case 0x92: /* DOWNLOAD MICROCODE */
+	case 0x93: /* DOWNLOAD MICROCODE DMA */
+	case 0xB4: /* SANITIZE DEVICE */
+	case 0xF4: /* SECURITY ERASE UNIT */
+		return PTIO_CMD_CLASS_LONG;
+	default:
+		return PTIO_CMD_CLASS_DEFAULT;
+	}
+}
+
+/*
+ * Get the class of a prepared command from its CDB. For ATA PASS-THROUGH
+ * commands, the class of the ATA command is used.
+ */
+enum ptio_cmd_class ptio_cmd_class(struct ptio_cmd *cmd)
+{
+	uint8_t *cdb = cmd->cdb;
+
+	switch (cdb[0]) {
+	case 0x00: /* TEST UNIT READY */
+	case 0x03: /* REQUEST SENSE */
+	case 0x12: /* INQUIRY */
+	case 0x1A: /* MODE SENSE (6) */
+	case 0x25: /* READ CAPACITY (10) */
+	case 0x4D: /* LOG SENSE */
+	case 0x5A: /* MODE SENSE (10) */
+	case 0xA0: /* REPORT LUNS */
+		return PTIO_CMD_CLASS_QUICK;
+	case 0x9E: /* SERVICE ACTION IN (16) */
+		if ((cdb[1] & 0x1F) == 0x10) /* READ CAPACITY (16) */
+			return PTIO_CMD_CLASS_QUICK;
+		return PTIO_CMD_CLASS_DEFAULT;
+	case 0x08: /* READ (6) */
+	case 0x0A: /* WRITE (6) */
+	case 0x28: /* READ (10) */
+	case 0x2A: /* WRITE (10) */
+	case 0x2F: /* VERIFY (10) */
+	case 0x35: /* SYNCHRONIZE CACHE (10) */
+	case 0x42: /* UNMAP */
+	case 0x88: /* READ (16) */
+	case 0x8A: /* WRITE (16) */
+	case 0x8F: /* VERIFY (16) */
+	case 0x91: /* SYNCHRONIZE CACHE (16) */
+	case 0x94: /* ZBC OUT */
+	case 0x95: /* ZBC IN */
+	case 0xA8: /* READ (12) */
+	case 0xAA: /* WRITE (12) */
+		return PTIO_CMD_CLASS_IO;
+	case 0x04: /* FORMAT UNIT */
+	case 0x1D: /* SEND DIAGNOSTIC */
+	case 0x3B: /* WRITE BUFFER */
+	case 0x41: /* WRITE SAME (10) */
+	case 0x48: /* SANITIZE */
+	case 0x93: /* WRITE SAME (16) */
+		return PTIO_CMD_CLASS_LONG;
+	case 0xA1: /* ATA PASS-THROUGH (12) */
+		return ptio_ata_cmd_class(cdb[9]);
+	case 0x85: /* ATA PASS-THROUGH (16) */
+		return ptio_ata_cmd_class(cdb[14]);
+	case 0x7F: /* ATA PASS-THROUGH (32) */
+		if (cmd->cdbsz == 32 && ptio_get_be16(&cdb[8]) == 0x1ff0)
+			return ptio_ata_cmd_class(cdb[25]);
+		return PTIO_CMD_CLASS_DEFAULT;
+	default:
+		return PTIO_CMD_CLASS_DEFAULT;
+	}
+}
+
+/*
+ * Get the timeout in ms to use for a prepared command: @timeout if not 0,
+ * the device timeout for the command class, or the default for the command
+ * class, limited to the time left until the device deadline, if one is set.
+ * Return -ETIME if the deadline already passed.
+ */
+int ptio_cmd_timeout(struct ptio_dev *dev, struct ptio_cmd *cmd,
+		     unsigned int timeout)
+{
+	unsigned long long deadline, now, left;
+	enum ptio_cmd_class class;
+
+	if (!timeout) {
+		class = ptio_cmd_class(cmd);
+		timeout = dev->timeouts[class];
+		if (!timeout)
+			timeout = ptio_cmd_class_timeout[class];
+	}
+
+	deadline = __atomic_load_n(&dev->deadline, __ATOMIC_RELAXED);
+	if (!deadline)
+		return timeout;
+
+	now = ptio_now_ns();
+	if (now >= deadline) {
+		ptio_dev_stat_inc(dev, nr_deadline_expired);
+		return -ETIME;
+	}
+
+	/* Round up so that a command never gets a 0 (default) timeout */
+	left = (deadline - now + 999999) / 1000000;
+	if (left < timeout)
+		timeout = left;
+
+	return timeout;
+}
+
+static int ptio_dev_reset(struct ptio_dev *dev, int type, const char *name)
+{
+	int ret;
+
+	type |= SG_SCSI_RESET_NO_ESCALATE;
+	ret = ioctl(dev->fd, SG_SCSI_RESET, &type);
+	if (ret) {
+		ret = -errno;
+		ptio_dev_err(dev, "%s reset failed %d (%s)\n",
+			     name, errno, strerror(errno));
+		ptio_dev_stat_inc(dev, nr_reset_failures);
+		return ret;
+	}
+
+	ptio_dev_warn(dev, "%s reset done\n", name);
+
+	return 0;
+}
+
+/*
+ * Handle a command timeout. The kernel aborts timed out commands, so if
+ * the device is configured to do so, escalate to a LUN reset and, if that
+ * fails, to a target reset.
+ */
+void ptio_dev_escalate(struct ptio_dev *dev)
+{
+	int ret;
+
+	if (dev->escalation < PTIO_ESCALATE_LUN_RESET)
+		return;
+
+	ptio_dev_stat_inc(dev, nr_lun_resets);
+	ret = ptio_dev_reset(dev, SG_SCSI_RESET_DEVICE, "LUN");
+	if (!ret || dev->escalation < PTIO_ESCALATE_TARGET_RESET)
+		return;
+
+	ptio_dev_stat_inc(dev, nr_target_resets);
+	ptio_dev_reset(dev, SG_SCSI_RESET_TARGET, "Target");
+}
+
+/*
+ * Get a snapshot of the device command statistics.
+ */
+#define ptio_dev_stat_get(dev, stats, field)	\
+	(stats)->field = __atomic_load_n(&(dev)->stats.field, __ATOMIC_RELAXED)
+
+void ptio_get_dev_stats(struct ptio_dev *dev, struct ptio_dev_stats *stats)
+{
+	/* A new counter must also be copied below */
+	_Static_assert(sizeof(struct ptio_dev_stats) ==
+		       20 * sizeof(unsigned long long),
+		       "ptio_dev_stats changed");
+
+	ptio_dev_stat_get(dev, stats, nr_cmds);
+	ptio_dev_stat_get(dev, stats, nr_errors);
+	ptio_dev_stat_get(dev, stats, nr_timeouts);
+	ptio_dev_stat_get(dev, stats, nr_deadline_expired);
+	ptio_dev_stat_get(dev, stats, nr_lun_resets);
+	ptio_dev_stat_get(dev, stats, nr_target_resets);
+	ptio_dev_stat_get(dev, stats, nr_reset_failures);
+	ptio_dev_stat_get(dev, stats, nr_retries);
+	ptio_dev_stat_get(dev, stats, nr_retries_exhausted);
+	ptio_dev_stat_get(dev, stats, nr_throttled);
+	ptio_dev_stat_get(dev, stats, throttle_ns);
+	ptio_dev_stat_get(dev, stats, nr_power_checks);
+	ptio_dev_stat_get(dev, stats, nr_power_skips);
+	ptio_dev_stat_get(dev, stats, nr_power_defers);
+	ptio_dev_stat_get(dev, stats, nr_power_cached);
+	ptio_dev_stat_get(dev, stats, nr_cache_hits);
+	ptio_dev_stat_get(dev, stats, nr_cache_misses);
+	ptio_dev_stat_get(dev, stats, nr_cache_invalidations);
+	ptio_dev_stat_get(dev, stats, nr_numa_local);
+	ptio_dev_stat_get(dev, stats, nr_numa_remote);
+}
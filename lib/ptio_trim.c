@@ -0,0 +1,434 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ptio.h"
+
+/* NCQ Send and Receive log */
+#define PTIO_ATA_LOG_NCQ_SEND_RECV	0x13
+#define PTIO_ATA_LOG_NCQ_SEND_RECV_DSM	0x00
+#define PTIO_ATA_LOG_NCQ_SEND_RECV_TRIM	0x04
+
+/* ATA DSM range entries: 48-bits LBA and 16-bits length */
+#define PTIO_ATA_DSM_ENTRY_SIZE		8
+#define PTIO_ATA_DSM_MAX_BLOCKS		0xffffULL
+
+/* SCSI UNMAP block descriptors */
+#define PTIO_SCSI_UNMAP_HDR_SIZE	8
+#define PTIO_SCSI_UNMAP_DESC_SIZE	16
+#define PTIO_SCSI_UNMAP_MAX_DESC	\
+	((0xffff - PTIO_SCSI_UNMAP_HDR_SIZE) / PTIO_SCSI_UNMAP_DESC_SIZE)
+
+/*
+ * Device limits for packing extents into deallocation commands.
+ */
+struct ptio_trim_limits {
+	uint64_t		max_entry_blocks;
+	uint64_t		max_cmd_blocks;
+	unsigned int		max_entries;
+	bool			ncq;
+};
+
+/*
+ * Deallocation command: @nr_entries entries starting at @entry.
+ */
+struct ptio_trim_cmd {
+	unsigned int		entry;
+	unsigned int		nr_entries;
+	uint64_t		nr_blocks;
+};
+
+struct ptio_trim_work {
+	struct ptio_dev		*dev;
+	struct ptio_trim_limits	*lim;
+	struct ptio_extent	*entries;
+	struct ptio_trim_cmd	*cmds;
+	uint8_t			**bufs;
+	size_t			bufsz;
+};
+
+static int ptio_trim_cmp(const void *a, const void *b)
+{
+	const struct ptio_extent *e1 = a, *e2 = b;
+
+	if (e1->lba < e2->lba)
+		return -1;
+	return e1->lba > e2->lba;
+}
+
+/*
+ * Sort and coalesce overlapping and contiguous extents, dropping empty
+ * extents. Return the number of extents left.
+ */
+static unsigned int ptio_trim_coalesce(struct ptio_extent *ext,
+				       unsigned int nr_ext)
+{
+	unsigned int i, n = 0;
+	uint64_t end;
+
+	qsort(ext, nr_ext, sizeof(struct ptio_extent), ptio_trim_cmp);
+
+	for (i = 0; i < nr_ext; i++) {
+		if (!ext[i].nr_blocks)
+			continue;
+		if (n) {
+			end = ext[n - 1].lba + ext[n - 1].nr_blocks;
+			if (ext[i].lba <= end) {
+				if (ext[i].lba + ext[i].nr_blocks > end)
+					ext[n - 1].nr_blocks =
+						ext[i].lba + ext[i].nr_blocks -
+						ext[n - 1].lba;
+				continue;
+			}
+		}
+		ext[n++] = ext[i];
+	}
+
+	return n;
+}
+
+/*
+ * Get the DSM TRIM limits of an ATA device and check if queued TRIM
+ * (SEND FPDMA QUEUED DATA SET MANAGEMENT) is supported.
+ */
+static int ptio_trim_probe_ata(struct ptio_dev *dev,
+			       struct ptio_trim_limits *lim,
+			       unsigned int flags)
+{
+	uint8_t buf[512];
+	struct ptio_cmd cmd;
+	unsigned int max_pages;
+	int ret;
+
+	ret = ptio_ata_identify(dev, buf);
+	if (ret)
+		return ret;
+
+	if (!(ptio_get_le16(&buf[169 * 2]) & 0x0001)) {
+		ptio_dev_err(dev, "DSM TRIM is not supported\n");
+		return -EOPNOTSUPP;
+	}
+
+	max_pages = ptio_get_le16(&buf[105 * 2]);
+	if (!max_pages)
+		max_pages = 1;
+
+	lim->max_entry_blocks = PTIO_ATA_DSM_MAX_BLOCKS;
+	lim->max_cmd_blocks = UINT64_MAX;
+	lim->max_entries = max_pages * (512 / PTIO_ATA_DSM_ENTRY_SIZE);
+
+	/* Queued TRIM requires NCQ support (word 76 bit 8) */
+	if ((flags & PTIO_TRIM_NO_NCQ) ||
+	    !(ptio_get_le16(&buf[76 * 2]) & 0x0100) ||
+	    ptio_ata_log_nr_pages(dev, PTIO_ATA_LOG_NCQ_SEND_RECV) <= 0)
+		return 0;
+
+	ret = ptio_ata_read_log(dev, PTIO_ATA_LOG_NCQ_SEND_RECV, 0, false,
+				&cmd, buf, 512);
+	if (!ret && (buf[PTIO_ATA_LOG_NCQ_SEND_RECV_DSM] & 0x01) &&
+	    (buf[PTIO_ATA_LOG_NCQ_SEND_RECV_TRIM] & 0x01))
+		lim->ncq = true;
+
+	ptio_dev_verbose(dev, "Queued TRIM %ssupported\n",
+			 lim->ncq ? "" : "not ");
+
+	return 0;
+}
+
+/*
+ * Get the UNMAP limits of a SCSI device from the Logical Block Provisioning
+ * and Block Limits VPD pages.
+ */
+static int ptio_trim_probe_scsi(struct ptio_dev *dev,
+				struct ptio_trim_limits *lim)
+{
+	uint8_t buf[64] = {};
+	uint32_t max_lba, max_desc;
+	int ret;
+
+	ret = ptio_scsi_vpd_inquiry(dev, 0xB2, buf, 8);
+	if (ret)
+		return ret;
+	if (!(buf[5] & 0x80)) {
+		ptio_dev_err(dev, "UNMAP is not supported\n");
+		return -EOPNOTSUPP;
+	}
+
+	ret = ptio_scsi_vpd_inquiry(dev, 0xB0, buf, 64);
+	if (ret)
+		return ret;
+
+	max_lba = ptio_get_be32(&buf[20]);
+	max_desc = ptio_get_be32(&buf[24]);
+	if (!max_lba || !max_desc) {
+		ptio_dev_err(dev, "UNMAP is not supported\n");
+		return -EOPNOTSUPP;
+	}
+
+	/* 0xffffffff means no limit */
+	lim->max_entry_blocks = max_lba;
+	if (max_lba == 0xffffffff)
+		lim->max_cmd_blocks = UINT64_MAX;
+	else
+		lim->max_cmd_blocks = max_lba;
+	lim->max_entries = max_desc;
+	if (lim->max_entries > PTIO_SCSI_UNMAP_MAX_DESC)
+		lim->max_entries = PTIO_SCSI_UNMAP_MAX_DESC;
+
+	return 0;
+}
+
+/*
+ * Split the extents into entries and group entries into commands.
+ * Return the number of commands.
+ */
+static unsigned int ptio_trim_pack(struct ptio_trim_limits *lim,
+				   struct ptio_extent *ext, unsigned int nr_ext,
+				   struct ptio_extent *entries,
+				   struct ptio_trim_cmd *cmds)
+{
+	struct ptio_trim_cmd *tc = NULL;
+	unsigned int i, nr_entries = 0, nr_cmds = 0;
+	uint64_t lba, end, len;
+
+	for (i = 0; i < nr_ext; i++) {
+		lba = ext[i].lba;
+		end = ext[i].lba + ext[i].nr_blocks;
+		while (lba < end) {
+			if (!tc || tc->nr_entries == lim->max_entries ||
+			    tc->nr_blocks == lim->max_cmd_blocks) {
+				tc = &cmds[nr_cmds++];
+				tc->entry = nr_entries;
+				tc->nr_entries = 0;
+				tc->nr_blocks = 0;
+			}
+
+			len = end - lba;
+			if (len > lim->max_entry_blocks)
+				len = lim->max_entry_blocks;
+			if (len > lim->max_cmd_blocks - tc->nr_blocks)
+				len = lim->max_cmd_blocks - tc->nr_blocks;
+
+			entries[nr_entries].lba = lba;
+			entries[nr_entries].nr_blocks = len;
+			nr_entries++;
+			tc->nr_entries++;
+			tc->nr_blocks += len;
+			lba += len;
+		}
+	}
+
+	return nr_cmds;
+}
+
+/*
+ * Get the maximum number of entries needed for the extents: each extent is
+ * split into entries of at most max_entry_blocks blocks, and each command
+ * limited by max_cmd_blocks may split one more extent.
+ */
+static size_t ptio_trim_nr_entries(struct ptio_trim_limits *lim,
+				   struct ptio_extent *ext, unsigned int nr_ext)
+{
+	uint64_t total = 0;
+	size_t i, nr = 0;
+
+	for (i = 0; i < nr_ext; i++) {
+		nr += (ext[i].nr_blocks + lim->max_entry_blocks - 1) /
+			lim->max_entry_blocks;
+		total += ext[i].nr_blocks;
+	}
+
+	if (lim->max_cmd_blocks != UINT64_MAX)
+		nr += (total + lim->max_cmd_blocks - 1) / lim->max_cmd_blocks;
+
+	return nr;
+}
+
+static int ptio_trim_exec(struct ptio_trim_work *w, struct ptio_trim_cmd *tc,
+			  uint8_t *buf)
+{
+	struct ptio_dev *dev = w->dev;
+	struct ptio_extent *e = &w->entries[tc->entry];
+	uint8_t cdb[32] = {};
+	struct ptio_cmd cmd;
+	size_t len, cdbsz;
+	unsigned int i;
+
+	if (ptio_dev_is_ata(dev)) {
+		/* Range entries, padded with zero-length entries */
+		len = tc->nr_entries * PTIO_ATA_DSM_ENTRY_SIZE;
+		len = (len + 511) & ~511UL;
+		memset(buf, 0, len);
+		for (i = 0; i < tc->nr_entries; i++)
+			ptio_set_le64(&buf[i * PTIO_ATA_DSM_ENTRY_SIZE],
+				      e[i].nr_blocks << 48 | e[i].lba);
+
+		if (w->lim->ncq) {
+			/*
+			 * SEND FPDMA QUEUED, DATA SET MANAGEMENT subcommand
+			 * (0), TRIM bit in the auxiliary field.
+			 */
+			ptio_ata_set_cdb32(cdb, PTIO_SAT_PROT_NCQ,
+					   PTIO_DXFER_TO_DEV, 0x64,
+					   len >> 9, 0, 0, 0x01);
+			cdbsz = 32;
+		} else {
+			/* DATA SET MANAGEMENT, TRIM */
+			ptio_ata_set_cdb16(cdb, PTIO_SAT_PROT_DMA,
+					   PTIO_DXFER_TO_DEV, 0x06,
+					   0x01, len >> 9, 0);
+			cdbsz = 16;
+		}
+	} else {
+		len = PTIO_SCSI_UNMAP_HDR_SIZE +
+			tc->nr_entries * PTIO_SCSI_UNMAP_DESC_SIZE;
+		memset(buf, 0, len);
+		ptio_set_be16(&buf[0], len - 2);
+		ptio_set_be16(&buf[2], len - PTIO_SCSI_UNMAP_HDR_SIZE);
+		for (i = 0; i < tc->nr_entries; i++) {
+			uint8_t *desc = &buf[PTIO_SCSI_UNMAP_HDR_SIZE +
+					     i * PTIO_SCSI_UNMAP_DESC_SIZE];
+
+			ptio_set_be64(&desc[0], e[i].lba);
+			ptio_set_be32(&desc[8], e[i].nr_blocks);
+		}
+
+		cdb[0] = 0x42; /* UNMAP */
+		ptio_set_be16(&cdb[7], len);
+		cdbsz = 10;
+	}
+
+	return ptio_exec_cmd(dev, &cmd, cdb, cdbsz, PTIO_CDB_SCSI,
+			     buf, len, PTIO_DXFER_TO_DEV, 0);
+}
+
+static int ptio_trim_job(void *data, unsigned int idx, unsigned int worker)
+{
+	struct ptio_trim_work *w = data;
+
+	return ptio_trim_exec(w, &w->cmds[idx], w->bufs[worker]);
+}
+
+/*
+ * Deallocate (trim or unmap) the @nr_extents extents of @extents. The
+ * extents do not need to be sorted and may overlap: they are sorted and
+ * coalesced into the fewest commands allowed by the device limits, which
+ * are then executed with up to @qd commands in flight. For ATA devices,
+ * queued TRIM is used if supported, unless @flags has PTIO_TRIM_NO_NCQ.
+ * The device information must have been obtained with
+ * ptio_get_dev_information().
+ */
+int ptio_trim(struct ptio_dev *dev, struct ptio_extent *extents,
+	      unsigned int nr_extents, unsigned int qd, unsigned int flags)
+{
+	struct ptio_trim_limits lim = {};
+	struct ptio_trim_work w = {
+		.dev = dev,
+		.lim = &lim,
+	};
+	struct ptio_extent *ext = NULL;
+	uint64_t capacity;
+	unsigned int i, nr_ext, nr_bufs = 0;
+	size_t nr_entries, nr_cmds, maxsz;
+	int ret;
+
+	if (!nr_extents)
+		return 0;
+
+	if (!dev->logical_block_size) {
+		ptio_dev_err(dev, "Unknown device capacity\n");
+		return -EINVAL;
+	}
+
+	if (ptio_dev_is_ata(dev))
+		ret = ptio_trim_probe_ata(dev, &lim, flags);
+	else
+		ret = ptio_trim_probe_scsi(dev, &lim);
+	if (ret)
+		return ret;
+
+	/* Limit the payload size to what the adapter can transfer */
+	maxsz = ptio_dev_max_xfer(dev);
+	if (ptio_dev_is_ata(dev)) {
+		if (lim.max_entries > maxsz / PTIO_ATA_DSM_ENTRY_SIZE)
+			lim.max_entries = maxsz / PTIO_ATA_DSM_ENTRY_SIZE;
+		w.bufsz = lim.max_entries * PTIO_ATA_DSM_ENTRY_SIZE;
+		w.bufsz = (w.bufsz + 511) & ~511UL;
+	} else {
+		if (lim.max_entries > (maxsz - PTIO_SCSI_UNMAP_HDR_SIZE) /
+		    PTIO_SCSI_UNMAP_DESC_SIZE)
+			lim.max_entries = (maxsz - PTIO_SCSI_UNMAP_HDR_SIZE) /
+				PTIO_SCSI_UNMAP_DESC_SIZE;
+		w.bufsz = PTIO_SCSI_UNMAP_HDR_SIZE +
+			lim.max_entries * PTIO_SCSI_UNMAP_DESC_SIZE;
+	}
+
+	ext = malloc(nr_extents * sizeof(struct ptio_extent));
+	if (!ext)
+		return -ENOMEM;
+	memcpy(ext, extents, nr_extents * sizeof(struct ptio_extent));
+	nr_ext = ptio_trim_coalesce(ext, nr_extents);
+
+	capacity = (dev->capacity << 9) / dev->logical_block_size;
+	if (nr_ext && ext[nr_ext - 1].lba + ext[nr_ext - 1].nr_blocks >
+	    capacity) {
+		ptio_dev_err(dev, "Extent beyond the device capacity\n");
+		ret = -EINVAL;
+		goto free;
+	}
+
+	/* Each command has at least one entry */
+	nr_entries = ptio_trim_nr_entries(&lim, ext, nr_ext);
+	w.entries = calloc(nr_entries, sizeof(struct ptio_extent));
+	w.cmds = calloc(nr_entries, sizeof(struct ptio_trim_cmd));
+	if (!w.entries || !w.cmds) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	nr_cmds = ptio_trim_pack(&lim, ext, nr_ext, w.entries, w.cmds);
+
+	ptio_dev_verbose(dev,
+			 "Deallocating %u extents with %zu commands\n",
+			 nr_ext, nr_cmds);
+
+	/* One payload buffer per worker */
+	nr_bufs = qd ? qd : 1;
+	if (nr_bufs > nr_cmds)
+		nr_bufs = nr_cmds;
+	w.bufs = calloc(nr_bufs, sizeof(uint8_t *));
+	if (!w.bufs) {
+		ret = -ENOMEM;
+		goto free;
+	}
+	for (i = 0; i < nr_bufs; i++) {
+		w.bufs[i] = ptio_alloc_dev_buf(dev, w.bufsz);
+		if (!w.bufs[i]) {
+			ret = -ENOMEM;
+			goto free;
+		}
+	}
+
+	ret = ptio_run_dev_jobs(dev, nr_cmds, nr_bufs, ptio_trim_job, &w);
+
+free:
+	if (w.bufs) {
+		for (i = 0; i < nr_bufs; i++)
+			free(w.bufs[i]);
+		free(w.bufs);
+	}
+	free(w.cmds);
+	free(w.entries);
+	free(ext);
+
+	return ret;
+}
@@ -0,0 +1,528 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "ptio.h"
+
+/* Size of the zero buffer used for writes */
+#define PTIO_ZERO_BUFSZ			(4 * 1024 * 1024)
+
+/* ZERO EXT count is 16-bits, with 0 meaning 65536 */
+#define PTIO_ZERO_EXT_MAX_BLOCKS	65536ULL
+/* WRITE SAME limit if the device does not report one */
+#define PTIO_WRITE_SAME_MAX_BLOCKS	(1ULL << 19)
+
+#define PTIO_ZERO_DEFAULT_QD		4
+#define PTIO_SANITIZE_POLL_US		(1000 * 1000)
+
+/* ATA SANITIZE DEVICE */
+#define PTIO_ATA_SANITIZE_STATUS	0x0000
+#define PTIO_ATA_SANITIZE_OVERWRITE	0x0014
+#define PTIO_ATA_SANITIZE_OVERWRITE_KEY	0x4F57ULL
+
+/* LOGICAL UNIT NOT READY, SANITIZE IN PROGRESS */
+#define PTIO_ASC_SANITIZE_IN_PROGRESS	0x041B
+
+struct ptio_zero_devs {
+	struct ptio_zero_dev	*zds;
+	unsigned int		qd;
+	unsigned int		flags;
+	ptio_zero_progress_fn	progress;
+	void			*data;
+
+	/* Read-only mapping backed by the zero page */
+	uint8_t			*zbuf;
+};
+
+/*
+ * Zeroing state of a device, shared by the workers issuing commands.
+ */
+struct ptio_zero_work {
+	struct ptio_zero_devs	*z;
+	struct ptio_zero_dev	*zd;
+	pthread_mutex_t		lock;
+
+	uint64_t		next;
+	uint64_t		end;
+	uint64_t		chunk;
+	unsigned long long	start_ns;
+	int			ret;
+};
+
+static const char *ptio_zero_method_name[] = {
+	[PTIO_ZERO_METHOD_NONE]			= "none",
+	[PTIO_ZERO_METHOD_SANITIZE]		= "sanitize overwrite",
+	[PTIO_ZERO_METHOD_ZERO_EXT]		= "ZERO EXT",
+	[PTIO_ZERO_METHOD_WRITE_SAME]		= "WRITE SAME",
+	[PTIO_ZERO_METHOD_WRITE]		= "WRITE",
+};
+
+/*
+ * Update the progress and throughput of a device.
+ */
+static void ptio_zero_progress(struct ptio_zero_work *w, uint64_t done)
+{
+	struct ptio_zero_dev *zd = w->zd;
+	unsigned long long bytes;
+
+	zd->done = done;
+	zd->time_ns = ptio_now_ns() - w->start_ns;
+	if (zd->time_ns) {
+		bytes = zd->done * zd->dev->logical_block_size;
+		/* bytes * 10^9 overflows 64-bits past 18 GB */
+		zd->bytes_per_sec = (double)bytes * 1000000000.0 /
+			zd->time_ns;
+	}
+
+	if (w->z->progress)
+		w->z->progress(zd, w->z->data);
+}
+
+/*
+ * Zero @nr_blocks blocks starting at @lba using the device current method.
+ */
+static int ptio_zero_exec(struct ptio_zero_work *w, struct ptio_cmd *cmd,
+			  uint64_t lba, uint64_t nr_blocks)
+{
+	struct ptio_zero_dev *zd = w->zd;
+	struct ptio_dev *dev = zd->dev;
+	bool unmap = w->z->flags & PTIO_ZERO_UNMAP;
+	enum ptio_dxfer dxfer = PTIO_DXFER_TO_DEV;
+	uint8_t cdb[16] = {};
+	size_t bufsz = 0;
+
+	switch (zd->method) {
+	case PTIO_ZERO_METHOD_ZERO_EXT:
+		/* ZERO EXT, with the TRIM bit if allowed */
+		ptio_ata_set_cdb16(cdb, PTIO_SAT_PROT_NON_DATA,
+				   PTIO_DXFER_NONE, 0x44, unmap ? 0x01 : 0,
+				   nr_blocks & 0xffff, lba);
+		dxfer = PTIO_DXFER_NONE;
+		break;
+	case PTIO_ZERO_METHOD_WRITE_SAME:
+		/* WRITE SAME (16) of a single zero block */
+		cdb[0] = 0x93;
+		if (unmap)
+			cdb[1] = 0x08;
+		ptio_set_be64(&cdb[2], lba);
+		ptio_set_be32(&cdb[10], nr_blocks);
+		bufsz = dev->logical_block_size;
+		break;
+	case PTIO_ZERO_METHOD_WRITE:
+		/* WRITE (16) */
+		cdb[0] = 0x8A;
+		ptio_set_be64(&cdb[2], lba);
+		ptio_set_be32(&cdb[10], nr_blocks);
+		bufsz = nr_blocks * dev->logical_block_size;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return ptio_exec_cmd(dev, cmd, cdb, 16, PTIO_CDB_SCSI,
+			     bufsz ? w->z->zbuf : NULL, bufsz, dxfer, 0);
+}
+
+/*
+ * Maximum number of blocks per command for the device current method.
+ */
+static uint64_t ptio_zero_max_blocks(struct ptio_zero_dev *zd)
+{
+	struct ptio_dev *dev = zd->dev;
+	uint8_t buf[64] = {};
+	uint64_t max;
+	size_t bufsz;
+
+	switch (zd->method) {
+	case PTIO_ZERO_METHOD_ZERO_EXT:
+		return PTIO_ZERO_EXT_MAX_BLOCKS;
+	case PTIO_ZERO_METHOD_WRITE_SAME:
+		/* Block Limits VPD page MAXIMUM WRITE SAME LENGTH */
+		if (ptio_scsi_vpd_inquiry(dev, 0xB0, buf, 64))
+			return PTIO_WRITE_SAME_MAX_BLOCKS;
+		max = ptio_get_be64(&buf[36]);
+		if (!max || max > 0xffffffff)
+			return PTIO_WRITE_SAME_MAX_BLOCKS;
+		return max;
+	case PTIO_ZERO_METHOD_WRITE:
+	default:
+		bufsz = ptio_dev_max_xfer(dev);
+		if (bufsz > PTIO_ZERO_BUFSZ)
+			bufsz = PTIO_ZERO_BUFSZ;
+		return bufsz / dev->logical_block_size;
+	}
+}
+
+/*
+ * A method is not supported if the device rejects the command.
+ */
+static inline bool ptio_zero_unsupported(struct ptio_cmd *cmd, int ret)
+{
+	/* ILLEGAL REQUEST or ABORTED COMMAND (ATA command aborted) */
+	return ret == -EIO &&
+		((cmd->sense.flags & PTIO_SENSE_ILLEGAL_REQUEST) ||
+		 ((cmd->sense.flags & PTIO_SENSE_ABORTED) &&
+		  !(cmd->sense.flags & PTIO_SENSE_RETRYABLE)));
+}
+
+/*
+ * Zeroing worker: zero chunks of the range until the end of the range or
+ * an error.
+ */
+static int ptio_zero_worker(void *data, unsigned int idx, unsigned int worker)
+{
+	struct ptio_zero_work *w = data;
+	uint64_t lba, nr_blocks;
+	struct ptio_cmd cmd;
+	int ret = 0;
+
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		if (w->ret || w->next >= w->end) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		lba = w->next;
+		nr_blocks = w->chunk;
+		if (nr_blocks > w->end - lba)
+			nr_blocks = w->end - lba;
+		w->next += nr_blocks;
+		pthread_mutex_unlock(&w->lock);
+
+		ret = ptio_zero_exec(w, &cmd, lba, nr_blocks);
+
+		pthread_mutex_lock(&w->lock);
+		if (ret) {
+			ptio_dev_err(w->zd->dev,
+				     "Zeroing %" PRIu64 " blocks at LBA %"
+				     PRIu64 " failed\n", nr_blocks, lba);
+			if (!w->ret)
+				w->ret = ret;
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		ptio_zero_progress(w, w->zd->done + nr_blocks);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return ret;
+}
+
+/*
+ * Zero the device range using @method. The first command also probes the
+ * method: -EOPNOTSUPP is returned if the device rejects it.
+ */
+static int ptio_zero_range(struct ptio_zero_work *w,
+			   enum ptio_zero_method method)
+{
+	struct ptio_zero_dev *zd = w->zd;
+	struct ptio_cmd cmd;
+	uint64_t nr_blocks;
+	int ret;
+
+	zd->method = method;
+	w->chunk = ptio_zero_max_blocks(zd);
+	nr_blocks = w->end - w->next;
+	if (nr_blocks > w->chunk)
+		nr_blocks = w->chunk;
+
+	ptio_dev_verbose(zd->dev, "Zeroing using %s, %" PRIu64 " blocks "
+			 "per command\n",
+			 ptio_zero_method_name[method], w->chunk);
+
+	ret = ptio_zero_exec(w, &cmd, w->next, nr_blocks);
+	if (ret) {
+		if (ptio_zero_unsupported(&cmd, ret)) {
+			ptio_dev_verbose(zd->dev, "%s not supported\n",
+					 ptio_zero_method_name[method]);
+			return -EOPNOTSUPP;
+		}
+		return ret;
+	}
+
+	w->next += nr_blocks;
+	ptio_zero_progress(w, w->zd->done + nr_blocks);
+
+	return ptio_run_dev_jobs(zd->dev, w->z->qd, w->z->qd,
+				 ptio_zero_worker, w);
+}
+
+/*
+ * Get the ATA sanitize status using SANITIZE STATUS EXT with ck_cond set so
+ * that the device returns its output registers in the sense data.
+ */
+static int ptio_zero_ata_sanitize_status(struct ptio_dev *dev,
+					 bool *in_progress,
+					 unsigned int *progress)
+{
+	struct ptio_sense *sense;
+	struct ptio_cmd cmd;
+	uint8_t cdb[16];
+	int ret;
+
+	ptio_ata_set_cdb16(cdb, PTIO_SAT_PROT_NON_DATA, PTIO_DXFER_NONE,
+			   0xB4, PTIO_ATA_SANITIZE_STATUS, 0, 0);
+
+	ret = ptio_exec_cmd(dev, &cmd, cdb, 16, PTIO_CDB_SCSI,
+			    NULL, 0, PTIO_DXFER_NONE, PTIO_CMD_ATA_CK_COND);
+	if (ret)
+		return ret;
+
+	sense = &cmd.sense;
+	if (!(sense->flags & PTIO_SENSE_ATA_REGS))
+		return -EIO;
+
+	*progress = sense->ata.lba & 0xffff;
+	if (sense->flags & PTIO_SENSE_ATA_PARTIAL)
+		/* Only the low byte of the count is known */
+		*in_progress = *progress != 0xffff;
+	else
+		*in_progress = sense->ata.count & 0x4000;
+
+	return 0;
+}
+
+/*
+ * Get the SCSI sanitize status using REQUEST SENSE.
+ */
+static int ptio_zero_scsi_sanitize_status(struct ptio_dev *dev,
+					  bool *in_progress,
+					  unsigned int *progress)
+{
+	uint8_t buf[252] = {};
+	uint8_t cdb[6] = {};
+	struct ptio_sense sense;
+	struct ptio_cmd cmd;
+	int ret;
+
+	cdb[0] = 0x03; /* REQUEST SENSE */
+	cdb[4] = sizeof(buf);
+	ret = ptio_exec_cmd(dev, &cmd, cdb, 6, PTIO_CDB_SCSI,
+			    buf, sizeof(buf), PTIO_DXFER_FROM_DEV, 0);
+	if (ret)
+		return ret;
+
+	if (ptio_decode_sense(buf, cmd.bufsz, &sense))
+		return -EIO;
+
+	/* SANITIZE COMMAND FAILED */
+	if (ptio_sense_asc_ascq(&sense) == 0x3103) {
+		ptio_dev_err(dev, "Sanitize failed\n");
+		return -EIO;
+	}
+
+	*progress = sense.flags & PTIO_SENSE_PROGRESS ? sense.progress : 0;
+	*in_progress = (sense.flags & PTIO_SENSE_NOT_READY) &&
+		ptio_sense_asc_ascq(&sense) == PTIO_ASC_SANITIZE_IN_PROGRESS;
+
+	return 0;
+}
+
+/*
+ * Start a sanitize overwrite operation with a single zero pattern pass.
+ */
+static int ptio_zero_sanitize_start(struct ptio_dev *dev)
+{
+	uint8_t cdb[16] = {};
+	uint8_t buf[512] = {};
+	struct ptio_cmd cmd;
+	uint16_t w59;
+	int ret;
+
+	if (ptio_dev_is_ata(dev)) {
+		ret = ptio_ata_identify(dev, buf);
+		if (ret)
+			return ret;
+
+		/* Sanitize and overwrite supported */
+		w59 = ptio_get_le16(&buf[59 * 2]);
+		if ((w59 & 0x5000) != 0x5000)
+			return -EOPNOTSUPP;
+
+		ptio_ata_set_cdb16(cdb, PTIO_SAT_PROT_NON_DATA,
+				   PTIO_DXFER_NONE, 0xB4,
+				   PTIO_ATA_SANITIZE_OVERWRITE, 1,
+				   PTIO_ATA_SANITIZE_OVERWRITE_KEY << 32);
+		ret = ptio_exec_cmd(dev, &cmd, cdb, 16, PTIO_CDB_SCSI,
+				    NULL, 0, PTIO_DXFER_NONE, 0);
+	} else {
+		/* SANITIZE, IMMED, AUSE, OVERWRITE */
+		cdb[0] = 0x48;
+		cdb[1] = 0x80 | 0x20 | 0x01;
+		ptio_set_be16(&cdb[7], 8);
+
+		/* One pass of a 4 B zero pattern */
+		buf[0] = 0x01;
+		ptio_set_be16(&buf[2], 4);
+
+		ret = ptio_exec_cmd(dev, &cmd, cdb, 10, PTIO_CDB_SCSI,
+				    buf, 8, PTIO_DXFER_TO_DEV, 0);
+	}
+
+	if (ptio_zero_unsupported(&cmd, ret))
+		return -EOPNOTSUPP;
+
+	return ret;
+}
+
+/*
+ * Zero the entire device with a sanitize overwrite operation and wait for
+ * the operation to complete.
+ */
+static int ptio_zero_sanitize(struct ptio_zero_work *w)
+{
+	struct ptio_zero_dev *zd = w->zd;
+	struct ptio_dev *dev = zd->dev;
+	uint64_t nr_blocks = w->end - w->next;
+	unsigned int progress = 0;
+	bool in_progress = true;
+	int ret;
+
+	zd->method = PTIO_ZERO_METHOD_SANITIZE;
+	ret = ptio_zero_sanitize_start(dev);
+	if (ret) {
+		if (ret == -EOPNOTSUPP)
+			ptio_dev_verbose(dev, "Sanitize overwrite not supported\n");
+		return ret;
+	}
+
+	while (in_progress) {
+		usleep(PTIO_SANITIZE_POLL_US);
+
+		if (ptio_dev_is_ata(dev))
+			ret = ptio_zero_ata_sanitize_status(dev, &in_progress,
+							    &progress);
+		else
+			ret = ptio_zero_scsi_sanitize_status(dev, &in_progress,
+							     &progress);
+		if (ret)
+			return ret;
+
+		if (in_progress)
+			ptio_zero_progress(w, nr_blocks * progress / 65536);
+	}
+
+	w->next = w->end;
+	ptio_zero_progress(w, nr_blocks);
+
+	return 0;
+}
+
+static int ptio_zero_dev(struct ptio_zero_devs *z, struct ptio_zero_dev *zd)
+{
+	struct ptio_dev *dev = zd->dev;
+	struct ptio_zero_work w = {
+		.z = z,
+		.zd = zd,
+	};
+	uint64_t capacity;
+	int ret = -EOPNOTSUPP;
+
+	zd->error = 0;
+	zd->done = 0;
+	zd->bytes_per_sec = 0;
+	zd->method = PTIO_ZERO_METHOD_NONE;
+	w.start_ns = ptio_now_ns();
+
+	/* Also needed by ptio_zero_max_blocks() */
+	if (!dev->logical_block_size) {
+		ptio_dev_err(dev, "Unknown device capacity\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	capacity = (dev->capacity << 9) / dev->logical_block_size;
+	if (!zd->nr_blocks)
+		zd->nr_blocks = capacity - zd->lba;
+	if (zd->lba >= capacity || zd->nr_blocks > capacity - zd->lba) {
+		ptio_dev_err(dev, "Invalid zeroing range\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	w.next = zd->lba;
+	w.end = zd->lba + zd->nr_blocks;
+	pthread_mutex_init(&w.lock, NULL);
+
+	/* Sanitize is only for whole device zeroing */
+	if ((z->flags & PTIO_ZERO_SANITIZE) &&
+	    !zd->lba && zd->nr_blocks == capacity)
+		ret = ptio_zero_sanitize(&w);
+
+	if (ret == -EOPNOTSUPP) {
+		if (ptio_dev_is_ata(dev))
+			ret = ptio_zero_range(&w, PTIO_ZERO_METHOD_ZERO_EXT);
+		else
+			ret = ptio_zero_range(&w, PTIO_ZERO_METHOD_WRITE_SAME);
+	}
+	if (ret == -EOPNOTSUPP)
+		ret = ptio_zero_range(&w, PTIO_ZERO_METHOD_WRITE);
+
+	pthread_mutex_destroy(&w.lock);
+
+out:
+	zd->time_ns = ptio_now_ns() - w.start_ns;
+	zd->error = ret;
+
+	return ret;
+}
+
+static int ptio_zero_job(void *data, unsigned int idx, unsigned int worker)
+{
+	struct ptio_zero_devs *z = data;
+
+	return ptio_zero_dev(z, &z->zds[idx]);
+}
+
+/*
+ * Zero ranges of @nr_devs devices, using up to @nr_threads threads to zero
+ * devices in parallel. For each device, the cheapest supported method is
+ * used: sanitize overwrite (if allowed with PTIO_ZERO_SANITIZE and the whole
+ * device is zeroed), ZERO EXT for ATA devices, WRITE SAME for SCSI devices,
+ * and finally writes of zeroes with up to @qd commands in flight. If not
+ * NULL, @progress is called whenever the progress of a device is updated.
+ * The result for each device is in its ptio_zero_dev structure and the first
+ * error is returned.
+ */
+int ptio_zero(struct ptio_zero_dev *zds, unsigned int nr_devs,
+	      unsigned int nr_threads, unsigned int qd, unsigned int flags,
+	      ptio_zero_progress_fn progress, void *data)
+{
+	struct ptio_zero_devs z = {
+		.zds = zds,
+		.qd = qd ? qd : PTIO_ZERO_DEFAULT_QD,
+		.flags = flags,
+		.progress = progress,
+		.data = data,
+	};
+	int ret;
+
+	/*
+	 * All pages of a private anonymous read-only mapping are the zero
+	 * page: writes use no memory and nothing needs to be cleared.
+	 */
+	z.zbuf = mmap(NULL, PTIO_ZERO_BUFSZ, PROT_READ,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (z.zbuf == MAP_FAILED) {
+		ptio_err("Map zero buffer failed %d (%s)\n",
+			errno, strerror(errno));
+		return -ENOMEM;
+	}
+
+	ret = ptio_run_jobs(nr_devs, nr_threads, ptio_zero_job, &z);
+
+	munmap(z.zbuf, PTIO_ZERO_BUFSZ);
+
+	return ret;
+}
@@ -0,0 +1,862 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ptio.h"
+
+#define PTIO_ZONE_DESC_SIZE		64
+#define PTIO_ZONES_DEFAULT_BUFSZ	(1024 * 1024)
+#define PTIO_ZONES_MIN_BUFSZ		4096
+
+/*
+ * A range of zones to report.
+ */
+struct ptio_zones_req {
+	unsigned int		zno;
+	unsigned int		nr_zones;
+};
+
+struct ptio_zones_work {
+	struct ptio_dev		*dev;
+	struct ptio_zones	*zones;
+	unsigned int		nr_reqs;
+	struct ptio_zones_req	*reqs;
+	uint8_t			**bufs;
+	unsigned long long	zone_size;
+};
+
+/*
+ * ZAC reports are little endian and ZBC reports big endian.
+ */
+static inline uint32_t ptio_zones_get32(struct ptio_dev *dev, uint8_t *buf)
+{
+	if (ptio_dev_is_ata(dev))
+		return ptio_get_le32(buf);
+	return ptio_get_be32(buf);
+}
+
+static inline uint64_t ptio_zones_get64(struct ptio_dev *dev, uint8_t *buf)
+{
+	if (ptio_dev_is_ata(dev))
+		return ptio_get_le64(buf);
+	return ptio_get_be64(buf);
+}
+
+/*
+ * Execute a REPORT ZONES command: REPORT ZONES EXT (ZAC MANAGEMENT IN) for ATA
+ * devices and REPORT ZONES (ZBC IN) for SCSI devices. With @partial set, the
+ * device does not need to count the zones that do not fit in the buffer.
+ */
+static int ptio_exec_report_zones(struct ptio_dev *dev, struct ptio_cmd *cmd,
+				  uint64_t lba, bool partial,
+				  uint8_t *buf, size_t bufsz)
+{
+	uint8_t cdb[16] = {};
+
+	if (ptio_dev_is_ata(dev)) {
+		/* Reporting options and partial bit in FEATURE (15:8) */
+		ptio_ata_set_cdb16(cdb, PTIO_SAT_PROT_DMA, PTIO_DXFER_FROM_DEV,
+				   0x4a, partial ? 0x8000 : 0x0000,
+				   bufsz / 512, lba);
+	} else {
+		cdb[0] = 0x95; /* ZBC IN, REPORT ZONES service action */
+		ptio_set_be64(&cdb[2], lba);
+		ptio_set_be32(&cdb[10], bufsz);
+		if (partial)
+			cdb[14] = 0x80;
+	}
+
+	return ptio_exec_cmd(dev, cmd, cdb, 16, PTIO_CDB_SCSI,
+			     buf, bufsz, PTIO_DXFER_FROM_DEV, 0);
+}
+
+/*
+ * Parse the zone descriptors of a report into the zone cache, starting with
+ * zone @zno and for at most @nr_zones zones. If @check is true, the start of
+ * the reported zones must match the expected start of the zones. Return the
+ * number of zones parsed and the LBA following the last zone parsed in
+ * @next_lba.
+ */
+static int ptio_zones_parse(struct ptio_dev *dev, struct ptio_zones *zones,
+			    unsigned int zno, unsigned int nr_zones,
+			    bool check, unsigned long long zone_size,
+			    uint8_t *buf, size_t len, uint64_t *next_lba)
+{
+	unsigned int i, n;
+	uint64_t start;
+	uint8_t *d;
+
+	if (len < PTIO_ZONE_DESC_SIZE * 2) {
+		ptio_dev_err(dev, "Invalid zone report length %zu B\n", len);
+		return -EIO;
+	}
+
+	n = ptio_zones_get32(dev, buf) / PTIO_ZONE_DESC_SIZE;
+	if (n > len / PTIO_ZONE_DESC_SIZE - 1)
+		n = len / PTIO_ZONE_DESC_SIZE - 1;
+	if (n > nr_zones)
+		n = nr_zones;
+	if (n > zones->nr_zones - zno)
+		n = zones->nr_zones - zno;
+
+	for (i = 0; i < n; i++) {
+		d = &buf[PTIO_ZONE_DESC_SIZE * (i + 1)];
+		start = ptio_zones_get64(dev, &d[16]);
+		if (check) {
+			if (zone_size &&
+			    start != (unsigned long long)(zno + i) * zone_size)
+				return -EAGAIN;
+			if (!zone_size && start != zones->start[zno + i])
+				return -EAGAIN;
+		}
+
+		zones->type[zno + i] = d[0] & 0x0f;
+		zones->cond[zno + i] = (d[1] >> 4) & 0x0f;
+		zones->start[zno + i] = start;
+		zones->wp[zno + i] = ptio_zones_get64(dev, &d[24]);
+
+		*next_lba = start + ptio_zones_get64(dev, &d[8]);
+	}
+
+	return n;
+}
+
+static void ptio_zones_clear_dirty(struct ptio_zones *zones,
+				   unsigned int zno, unsigned int nr_zones)
+{
+	unsigned int i;
+
+	for (i = zno; i < zno + nr_zones; i++)
+		__atomic_fetch_and(&zones->dirty[i / 64],
+				   ~(1ULL << (i % 64)), __ATOMIC_RELAXED);
+}
+
+static inline bool ptio_zones_is_dirty(struct ptio_zones *zones,
+				       unsigned int zno)
+{
+	return zones->dirty[zno / 64] & (1ULL << (zno % 64));
+}
+
+/*
+ * Report a range of zones, using as many partial reports as needed.
+ */
+static int ptio_zones_job(void *data, unsigned int idx, unsigned int worker)
+{
+	struct ptio_zones_work *w = data;
+	struct ptio_zones *zones = w->zones;
+	struct ptio_zones_req *req = &w->reqs[idx];
+	unsigned int zno = req->zno, nr_zones = req->nr_zones;
+	uint8_t *buf = w->bufs[worker];
+	struct ptio_cmd cmd;
+	uint64_t lba;
+	size_t bufsz;
+	int ret;
+
+	if (w->zone_size)
+		lba = (unsigned long long)zno * w->zone_size;
+	else
+		lba = zones->start[zno];
+
+	while (nr_zones) {
+		/* Do not transfer more than needed */
+		bufsz = (size_t)(nr_zones + 1) * PTIO_ZONE_DESC_SIZE;
+		bufsz = (bufsz + 511) & ~511UL;
+		if (bufsz > zones->bufsz)
+			bufsz = zones->bufsz;
+
+		ret = ptio_exec_report_zones(w->dev, &cmd, lba, true,
+					     buf, bufsz);
+		if (ret)
+			return ret;
+
+		ret = ptio_zones_parse(w->dev, zones, zno, nr_zones,
+				       true, w->zone_size,
+				       buf, cmd.bufsz, &lba);
+		if (ret < 0)
+			return ret;
+		if (!ret) {
+			ptio_dev_err(w->dev, "No zone reported at LBA %llu\n",
+				     (unsigned long long)lba);
+			return -EIO;
+		}
+
+		ptio_zones_clear_dirty(zones, zno, ret);
+		zno += ret;
+		nr_zones -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Execute zone report requests, with up to @zones->qd reports in flight.
+ */
+static int ptio_zones_run(struct ptio_dev *dev, struct ptio_zones *zones,
+			  struct ptio_zones_req *reqs, unsigned int nr_reqs,
+			  unsigned long long zone_size)
+{
+	struct ptio_zones_work w = {
+		.dev = dev,
+		.zones = zones,
+		.nr_reqs = nr_reqs,
+		.reqs = reqs,
+		.zone_size = zone_size,
+	};
+	unsigned int i, nr_bufs;
+	int ret = -ENOMEM;
+
+	if (!nr_reqs)
+		return 0;
+
+	nr_bufs = zones->qd < nr_reqs ? zones->qd : nr_reqs;
+	w.bufs = calloc(nr_bufs, sizeof(uint8_t *));
+	if (!w.bufs)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_bufs; i++) {
+		w.bufs[i] = ptio_alloc_dev_buf(dev, zones->bufsz);
+		if (!w.bufs[i])
+			goto out;
+	}
+
+	ret = ptio_run_dev_jobs(dev, nr_reqs, nr_bufs, ptio_zones_job, &w);
+
+out:
+	for (i = 0; i < nr_bufs; i++)
+		free(w.bufs[i]);
+	free(w.bufs);
+
+	return ret;
+}
+
+static inline unsigned int ptio_zones_per_buf(struct ptio_zones *zones)
+{
+	return zones->bufsz / PTIO_ZONE_DESC_SIZE - 1;
+}
+
+/*
+ * Split the zone range [@zno, @zno + @nr_zones) into report requests.
+ */
+static unsigned int ptio_zones_add_reqs(struct ptio_zones *zones,
+					struct ptio_zones_req *reqs,
+					unsigned int nr_reqs,
+					unsigned int zno,
+					unsigned int nr_zones)
+{
+	unsigned int zones_per_buf = ptio_zones_per_buf(zones);
+	unsigned int n;
+
+	while (nr_zones) {
+		n = nr_zones < zones_per_buf ? nr_zones : zones_per_buf;
+		reqs[nr_reqs].zno = zno;
+		reqs[nr_reqs].nr_zones = n;
+		nr_reqs++;
+		zno += n;
+		nr_zones -= n;
+	}
+
+	return nr_reqs;
+}
+
+static unsigned long long ptio_zones_get_zone_size(struct ptio_zones *zones,
+						   unsigned int nr_zones)
+{
+	unsigned long long zone_size;
+	unsigned int i;
+
+	if (nr_zones < 2)
+		return zones->capacity;
+
+	/* The last zone may be smaller than the other zones */
+	zone_size = zones->start[1];
+	for (i = 1; i < nr_zones; i++) {
+		if (zones->start[i] != (unsigned long long)i * zone_size)
+			return 0;
+	}
+
+	return zone_size;
+}
+
+/*
+ * Get all zones of a device: the first report is used to get the number of
+ * zones. If the zones reported all have the same size, the start of all zones
+ * is known and the remaining zones are fetched with up to @qd partial reports
+ * in flight. Otherwise, the remaining zones are fetched sequentially.
+ */
+static int ptio_zones_load(struct ptio_dev *dev, struct ptio_zones *zones)
+{
+	struct ptio_zones_req *reqs = NULL;
+	unsigned long long zone_size;
+	unsigned int zno, nr_reqs;
+	struct ptio_cmd cmd;
+	uint64_t next_lba = 0;
+	uint8_t *buf;
+	int ret;
+
+	buf = ptio_alloc_dev_buf(dev, zones->bufsz);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = ptio_exec_report_zones(dev, &cmd, 0, false, buf, zones->bufsz);
+	if (ret) {
+		ptio_dev_err(dev, "Report zones failed\n");
+		goto out;
+	}
+
+	if (cmd.bufsz < PTIO_ZONE_DESC_SIZE) {
+		ret = -EIO;
+		goto out;
+	}
+
+	zones->nr_zones = ptio_zones_get32(dev, buf) / PTIO_ZONE_DESC_SIZE;
+	zones->capacity = ptio_zones_get64(dev, &buf[8]) + 1;
+	if (!zones->nr_zones) {
+		ptio_dev_err(dev, "No zones reported\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	zones->start = calloc(zones->nr_zones, sizeof(uint64_t));
+	zones->wp = calloc(zones->nr_zones, sizeof(uint64_t));
+	zones->type = calloc(zones->nr_zones, sizeof(uint8_t));
+	zones->cond = calloc(zones->nr_zones, sizeof(uint8_t));
+	zones->dirty = calloc((zones->nr_zones + 63) / 64, sizeof(uint64_t));
+	if (!zones->start || !zones->wp || !zones->type || !zones->cond ||
+	    !zones->dirty) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = ptio_zones_parse(dev, zones, 0, zones->nr_zones, false, 0,
+			       buf, cmd.bufsz, &next_lba);
+	if (ret <= 0) {
+		ret = -EIO;
+		goto out;
+	}
+	zno = ret;
+
+	if (zno == zones->nr_zones)
+		goto done;
+
+	/*
+	 * If the zones reported so far have the same size, assume that all
+	 * zones have the same size and issue the remaining reports in parallel.
+	 * The zone start of all reported zones is checked against this
+	 * assumption.
+	 */
+	if (zno == 1)
+		zone_size = next_lba;
+	else
+		zone_size = ptio_zones_get_zone_size(zones, zno);
+	if (zone_size) {
+		reqs = calloc(zones->nr_zones / ptio_zones_per_buf(zones) + 1,
+			      sizeof(struct ptio_zones_req));
+		if (!reqs) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		nr_reqs = ptio_zones_add_reqs(zones, reqs, 0, zno,
+					      zones->nr_zones - zno);
+		ret = ptio_zones_run(dev, zones, reqs, nr_reqs, zone_size);
+		if (ret != -EAGAIN)
+			goto done;
+
+		ptio_dev_verbose(dev, "Zones do not have the same size\n");
+	}
+
+	/* Sequentially report zones */
+	while (zno < zones->nr_zones) {
+		ret = ptio_exec_report_zones(dev, &cmd, next_lba, true,
+					     buf, zones->bufsz);
+		if (ret) {
+			ptio_dev_err(dev, "Report zones failed\n");
+			goto out;
+		}
+
+		ret = ptio_zones_parse(dev, zones, zno, zones->nr_zones - zno,
+				       false, 0, buf, cmd.bufsz, &next_lba);
+		if (ret <= 0) {
+			ret = -EIO;
+			goto out;
+		}
+		zno += ret;
+	}
+
+	ret = 0;
+
+done:
+	if (!ret)
+		zones->zone_size =
+			ptio_zones_get_zone_size(zones, zones->nr_zones);
+out:
+	free(reqs);
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Get the zones of a zoned device into a zone cache. Zones are reported using
+ * buffers of @bufsz bytes (default 1 MiB, limited by the device maximum
+ * transfer size) and up to @qd reports in flight.
+ */
+struct ptio_zones *ptio_report_zones(struct ptio_dev *dev,
+				     size_t bufsz, unsigned int qd)
+{
+	struct ptio_zones *zones;
+	size_t max_bufsz;
+	int ret;
+
+	zones = calloc(1, sizeof(struct ptio_zones));
+	if (!zones)
+		return NULL;
+
+	if (!bufsz)
+		bufsz = PTIO_ZONES_DEFAULT_BUFSZ;
+	max_bufsz = ptio_dev_max_xfer(dev);
+	if (bufsz > max_bufsz)
+		bufsz = max_bufsz;
+	/* The ATA count field limits reports to 65535 pages of 512 B */
+	if (bufsz > 65535 * 512)
+		bufsz = 65535 * 512;
+	bufsz &= ~511UL;
+	if (bufsz < PTIO_ZONES_MIN_BUFSZ)
+		bufsz = PTIO_ZONES_MIN_BUFSZ;
+
+	zones->bufsz = bufsz;
+	zones->qd = qd ? qd : 1;
+
+	ret = ptio_zones_load(dev, zones);
+	if (ret) {
+		ptio_free_zones(zones);
+		return NULL;
+	}
+
+	return zones;
+}
+
+/*
+ * Mark zones as needing a refresh.
+ */
+void ptio_invalidate_zones(struct ptio_zones *zones,
+			   unsigned int zno, unsigned int nr_zones)
+{
+	unsigned int i;
+
+	if (zno >= zones->nr_zones)
+		return;
+	if (nr_zones > zones->nr_zones - zno)
+		nr_zones = zones->nr_zones - zno;
+
+	for (i = zno; i < zno + nr_zones; i++)
+		__atomic_fetch_or(&zones->dirty[i / 64], 1ULL << (i % 64),
+				  __ATOMIC_RELAXED);
+}
+
+/*
+ * Refresh the zones that were invalidated.
+ */
+int ptio_refresh_zones(struct ptio_dev *dev, struct ptio_zones *zones)
+{
+	struct ptio_zones_req *reqs = NULL;
+	unsigned int zno = 0, start, nr_reqs = 0, max_reqs = 0, n;
+	struct ptio_zones_req *r;
+	int ret;
+
+	while (zno < zones->nr_zones) {
+		/* Skip quickly clean zones */
+		if (!zones->dirty[zno / 64] && !(zno % 64)) {
+			zno += 64;
+			continue;
+		}
+		if (!ptio_zones_is_dirty(zones, zno)) {
+			zno++;
+			continue;
+		}
+
+		start = zno;
+		while (zno < zones->nr_zones && ptio_zones_is_dirty(zones, zno))
+			zno++;
+
+		/* Each dirty zone range needs at least one request */
+		n = (zno - start) / ptio_zones_per_buf(zones) + 1;
+		if (nr_reqs + n > max_reqs) {
+			max_reqs = (nr_reqs + n) * 2;
+			r = realloc(reqs,
+				    max_reqs * sizeof(struct ptio_zones_req));
+			if (!r) {
+				free(reqs);
+				return -ENOMEM;
+			}
+			reqs = r;
+		}
+
+		nr_reqs = ptio_zones_add_reqs(zones, reqs, nr_reqs,
+					      start, zno - start);
+	}
+
+	ret = ptio_zones_run(dev, zones, reqs, nr_reqs, zones->zone_size);
+	if (ret == -EAGAIN) {
+		ptio_dev_err(dev, "Zone configuration changed\n");
+		ret = -EIO;
+	}
+
+	free(reqs);
+
+	return ret;
+}
+
+#define PTIO_ATA_LOG_NCQ_NON_DATA		0x12
+#define PTIO_ATA_LOG_NCQ_NON_DATA_ZAC_MGMT	0x1c
+
+struct ptio_zone_op_work {
+	struct ptio_dev		*dev;
+	struct ptio_zones	*zones;
+	enum ptio_zone_op	op;
+	unsigned int		*znos;
+	int			*status;
+};
+
+/*
+ * Check if the NCQ NON-DATA variant of ZAC MANAGEMENT OUT is supported by an
+ * ATA device, using the NCQ Non-Data log.
+ */
+static void ptio_zones_probe_ncq(struct ptio_dev *dev,
+				 struct ptio_zones *zones)
+{
+	struct ptio_cmd cmd;
+	uint8_t *buf;
+	int ret;
+
+	if (zones->ncq_probed)
+		return;
+	zones->ncq_probed = true;
+
+	if (!ptio_dev_is_ata(dev))
+		return;
+
+	if (ptio_ata_log_nr_pages(dev, PTIO_ATA_LOG_NCQ_NON_DATA) <= 0)
+		return;
+
+	buf = ptio_alloc_buf(512);
+	if (!buf)
+		return;
+
+	ret = ptio_ata_read_log(dev, PTIO_ATA_LOG_NCQ_NON_DATA, 0, false,
+				&cmd, buf, 512);
+	if (!ret && (buf[PTIO_ATA_LOG_NCQ_NON_DATA_ZAC_MGMT] & 0x01))
+		zones->ncq_mgmt_out = true;
+
+	free(buf);
+
+	ptio_dev_verbose(dev, "NCQ ZAC MANAGEMENT OUT %ssupported\n",
+			 zones->ncq_mgmt_out ? "" : "not ");
+}
+
+/*
+ * Execute a zone operation. For ATA devices, use NCQ NON-DATA ZAC MANAGEMENT
+ * OUT if supported: the action and ALL bit then go in the AUXILIARY field,
+ * which requires an ATA PASS-THROUGH (32) CDB.
+ */
+static int ptio_exec_zone_op(struct ptio_dev *dev, struct ptio_zones *zones,
+			     enum ptio_zone_op op, uint64_t lba, bool all)
+{
+	uint8_t cdb[32] = {};
+	struct ptio_cmd cmd;
+	size_t cdbsz = 16;
+
+	if (ptio_dev_is_ata(dev)) {
+		if (zones->ncq_mgmt_out) {
+			ptio_ata_set_cdb32(cdb, PTIO_SAT_PROT_NCQ,
+					   PTIO_DXFER_NONE, 0x63, 0x07, 0,
+					   lba, op | (all ? 0x100 : 0));
+			cdbsz = 32;
+		} else {
+			ptio_ata_set_cdb16(cdb, PTIO_SAT_PROT_NON_DATA,
+					   PTIO_DXFER_NONE, 0x9f,
+					   op | (all ? 0x100 : 0), 0, lba);
+		}
+	} else {
+		cdb[0] = 0x94; /* ZBC OUT */
+		cdb[1] = op;
+		ptio_set_be64(&cdb[2], lba);
+		if (all)
+			cdb[14] = 0x01;
+	}
+
+	return ptio_exec_cmd(dev, &cmd, cdb, cdbsz, PTIO_CDB_SCSI,
+			     NULL, 0, PTIO_DXFER_NONE, 0);
+}
+
+static inline bool ptio_zone_has_wp(struct ptio_zones *zones, unsigned int zno)
+{
+	return zones->type[zno] != PTIO_ZONE_TYPE_CONVENTIONAL &&
+		zones->type[zno] != PTIO_ZONE_TYPE_GAP;
+}
+
+/*
+ * Test if a zone operation would not change a zone.
+ */
+static bool ptio_zone_op_is_nop(struct ptio_zones *zones,
+				enum ptio_zone_op op, unsigned int zno)
+{
+	uint8_t cond = zones->cond[zno];
+
+	/* Do not trust stale zone information */
+	if (ptio_zones_is_dirty(zones, zno))
+		return false;
+
+	switch (op) {
+	case PTIO_ZONE_OP_CLOSE:
+		return cond == PTIO_ZONE_COND_EMPTY ||
+			cond == PTIO_ZONE_COND_CLOSED ||
+			cond == PTIO_ZONE_COND_FULL;
+	case PTIO_ZONE_OP_FINISH:
+		return cond == PTIO_ZONE_COND_FULL;
+	case PTIO_ZONE_OP_OPEN:
+		return cond == PTIO_ZONE_COND_EXP_OPEN;
+	case PTIO_ZONE_OP_RESET:
+		return cond == PTIO_ZONE_COND_EMPTY;
+	}
+
+	return false;
+}
+
+/*
+ * With the ALL bit set, RESET and CLOSE apply to every zone that the
+ * operation changes, but FINISH only applies to open and closed zones, and
+ * OPEN only to closed zones. Return true if the ALL form of @op has the same
+ * effect on zone @zno as the operation on that zone only.
+ */
+static bool ptio_zone_op_all_applies(struct ptio_zones *zones,
+				     enum ptio_zone_op op, unsigned int zno)
+{
+	uint8_t cond = zones->cond[zno];
+
+	switch (op) {
+	case PTIO_ZONE_OP_CLOSE:
+	case PTIO_ZONE_OP_RESET:
+		return true;
+	case PTIO_ZONE_OP_FINISH:
+		if (ptio_zones_is_dirty(zones, zno))
+			return false;
+		return cond == PTIO_ZONE_COND_IMP_OPEN ||
+			cond == PTIO_ZONE_COND_EXP_OPEN ||
+			cond == PTIO_ZONE_COND_CLOSED;
+	case PTIO_ZONE_OP_OPEN:
+		if (ptio_zones_is_dirty(zones, zno))
+			return false;
+		return cond == PTIO_ZONE_COND_CLOSED;
+	}
+
+	return false;
+}
+
+/*
+ * Update the zone cache after a successful zone operation.
+ */
+static void ptio_zone_op_update(struct ptio_zones *zones,
+				enum ptio_zone_op op, unsigned int zno)
+{
+	/* Zone operations with the ALL bit set ignore these zones */
+	if (zones->cond[zno] == PTIO_ZONE_COND_READONLY ||
+	    zones->cond[zno] == PTIO_ZONE_COND_OFFLINE)
+		return;
+
+	switch (op) {
+	case PTIO_ZONE_OP_CLOSE:
+		if (zones->wp[zno] == zones->start[zno])
+			zones->cond[zno] = PTIO_ZONE_COND_EMPTY;
+		else
+			zones->cond[zno] = PTIO_ZONE_COND_CLOSED;
+		break;
+	case PTIO_ZONE_OP_FINISH:
+		zones->cond[zno] = PTIO_ZONE_COND_FULL;
+		zones->wp[zno] = zones->start[zno] + ptio_zone_len(zones, zno);
+		break;
+	case PTIO_ZONE_OP_OPEN:
+		zones->cond[zno] = PTIO_ZONE_COND_EXP_OPEN;
+		break;
+	case PTIO_ZONE_OP_RESET:
+		zones->cond[zno] = PTIO_ZONE_COND_EMPTY;
+		zones->wp[zno] = zones->start[zno];
+		break;
+	}
+}
+
+static int ptio_zone_op_job(void *data, unsigned int idx, unsigned int worker)
+{
+	struct ptio_zone_op_work *w = data;
+	unsigned int zno = w->znos[idx];
+	int ret;
+
+	ret = ptio_exec_zone_op(w->dev, w->zones, w->op,
+				w->zones->start[zno], false);
+	if (ret)
+		ptio_invalidate_zones(w->zones, zno, 1);
+	else
+		ptio_zone_op_update(w->zones, w->op, zno);
+
+	if (w->status)
+		w->status[zno] = ret;
+
+	return ret;
+}
+
+/*
+ * Execute the zone operation @op on all zones with a write pointer in the
+ * zone ranges @ranges. If all zones with a write pointer are targeted, a
+ * single command with the ALL bit set is used. Otherwise, one command per zone
+ * is executed, with up to @qd commands in flight. Zones that are known to not
+ * be changed by the operation are skipped. If @status is not NULL, it must
+ * have one entry per zone of the device and the result of the operation for
+ * each target zone is stored in it. The zone cache is updated to reflect the
+ * operation result.
+ */
+int ptio_zone_op(struct ptio_dev *dev, struct ptio_zones *zones,
+		 enum ptio_zone_op op, struct ptio_zone_range *ranges,
+		 unsigned int nr_ranges, unsigned int qd, int *status)
+{
+	struct ptio_zone_op_work w = {
+		.dev = dev,
+		.zones = zones,
+		.op = op,
+		.status = status,
+	};
+	unsigned int i, zno, nr_wp_zones = 0, nr_target_zones = 0;
+	unsigned int nr_zones = 0;
+	bool all = true;
+	uint64_t *target;
+	int ret = 0;
+
+	if (op < PTIO_ZONE_OP_CLOSE || op > PTIO_ZONE_OP_RESET) {
+		ptio_dev_err(dev, "Invalid zone operation %d\n", op);
+		return -EINVAL;
+	}
+
+	target = calloc((zones->nr_zones + 63) / 64, sizeof(uint64_t));
+	w.znos = calloc(zones->nr_zones, sizeof(unsigned int));
+	if (!target || !w.znos) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_ranges; i++) {
+		if (ranges[i].zno >= zones->nr_zones ||
+		    ranges[i].nr_zones > zones->nr_zones - ranges[i].zno) {
+			ptio_dev_err(dev, "Invalid zone range %u + %u\n",
+				     ranges[i].zno, ranges[i].nr_zones);
+			ret = -EINVAL;
+			goto out;
+		}
+		for (zno = ranges[i].zno;
+		     zno < ranges[i].zno + ranges[i].nr_zones; zno++)
+			target[zno / 64] |= 1ULL << (zno % 64);
+	}
+
+	for (zno = 0; zno < zones->nr_zones; zno++) {
+		if (!ptio_zone_has_wp(zones, zno))
+			continue;
+		nr_wp_zones++;
+		if (!(target[zno / 64] & (1ULL << (zno % 64))))
+			continue;
+		nr_target_zones++;
+		if (status)
+			status[zno] = 0;
+		if (ptio_zone_op_is_nop(zones, op, zno))
+			continue;
+		if (!ptio_zone_op_all_applies(zones, op, zno))
+			all = false;
+		w.znos[nr_zones++] = zno;
+	}
+
+	if (!nr_zones)
+		goto out;
+
+	ptio_zones_probe_ncq(dev, zones);
+
+	/*
+	 * Use a single command if all zones are targeted, including the zones
+	 * that the operation does not change, and if the ALL form of the
+	 * operation changes all the zones that need to be changed.
+	 */
+	if (nr_zones > 1 && nr_target_zones == nr_wp_zones && all) {
+		ret = ptio_exec_zone_op(dev, zones, op, 0, true);
+		for (i = 0; i < nr_zones; i++) {
+			zno = w.znos[i];
+			if (status)
+				status[zno] = ret;
+			if (!ret && op == PTIO_ZONE_OP_RESET)
+				ptio_zone_op_update(zones, op, zno);
+		}
+		/*
+		 * Operations other than reset only apply to zones in some
+		 * conditions: get the zones new condition on the next refresh.
+		 */
+		if (ret || op != PTIO_ZONE_OP_RESET)
+			ptio_invalidate_zones(zones, 0, zones->nr_zones);
+		goto out;
+	}
+
+	ret = ptio_run_dev_jobs(dev, nr_zones, qd ? qd : 1,
+				ptio_zone_op_job, &w);
+
+out:
+	free(w.znos);
+	free(target);
+
+	return ret;
+}
+
+/*
+ * Get the number of the zone containing @lba, or -1 if @lba is out of range.
+ */
+int ptio_zone_no(struct ptio_zones *zones, unsigned long long lba)
+{
+	unsigned int lo = 0, hi, mid;
+
+	if (lba >= zones->capacity)
+		return -1;
+
+	if (zones->zone_size) {
+		mid = lba / zones->zone_size;
+		return mid < zones->nr_zones ? (int)mid : -1;
+	}
+
+	hi = zones->nr_zones;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (zones->start[mid] <= lba)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Free a zone cache.
+ */
+void ptio_free_zones(struct ptio_zones *zones)
+{
+	if (!zones)
+		return;
+
+	free(zones->start);
+	free(zones->wp);
+	free(zones->type);
+	free(zones->cond);
+	free(zones->dirty);
+	free(zones);
+}
@@ -12,12 +12,48 @@
 #include <errno.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/utsname.h>
 
 #include "libptio/ptio.h"
 #include "config.h"
+#include "ptio_out.h"
 
-static int ptio_information(struct ptio_dev *dev)
+/*
+ * With machine readable output formats, all library messages go to stderr
+ * so that stdout only has the formatted output.
+ */
+static void ptio_log_stderr(struct ptio_dev *dev, enum ptio_log_level level,
+			    const char *format, va_list ap, void *data)
+{
+	if (dev)
+		fprintf(stderr, "PTIO (%s): ", dev->name);
+	vfprintf(stderr, format, ap);
+}
+
+static void ptio_out_information(struct ptio_out *out, struct ptio_dev *dev)
+{
+	ptio_out_begin_map(out, NULL);
+	ptio_out_str(out, "device", dev->path);
+	ptio_out_str(out, "vendor", dev->vendor);
+	ptio_out_str(out, "product", dev->id);
+	ptio_out_str(out, "revision", dev->rev);
+	ptio_out_uint(out, "capacity", dev->capacity);
+	ptio_out_uint(out, "logical_block_size", dev->logical_block_size);
+	ptio_out_uint(out, "physical_block_size",
+		      dev->physical_block_size);
+	ptio_out_str(out, "interface", ptio_dev_is_ata(dev) ? "ATA" : "SAS");
+	if (ptio_dev_is_ata(dev)) {
+		ptio_out_str(out, "acs_version", ptio_ata_acs_ver(dev));
+		ptio_out_str(out, "sat_vendor", dev->sat_vendor);
+		ptio_out_str(out, "sat_product", dev->sat_product);
+		ptio_out_str(out, "sat_revision", dev->sat_rev);
+	}
+	ptio_out_int(out, "numa_node", dev->numa_node);
+	ptio_out_end_map(out);
+}
+
+static int ptio_information(struct ptio_dev *dev, struct ptio_out *out)
 {
 	int ret;
 
@@ -27,6 +63,11 @@ static int ptio_information(struct ptio_dev *dev)
 		return ret;
 	}
 
+	if (ptio_out_structured(out)) {
+		ptio_out_information(out, dev);
+		return 0;
+	}
+
 	printf("Device: /dev/%s\n", dev->name);
 	printf("    Vendor: %s\n", dev->vendor);
 	printf("    Product: %s\n", dev->id);
@@ -43,16 +84,24 @@ static int ptio_information(struct ptio_dev *dev)
 		printf("      SAT Product: %s\n", dev->sat_product);
 		printf("      SAT revision: %s\n", dev->sat_rev);
 	}
+	if (dev->numa_node >= 0)
+		printf("    NUMA node: %d\n", dev->numa_node);
 
 	return 0;
 }
 
 
-static int ptio_revalidate(struct ptio_dev *dev)
+static int ptio_revalidate(struct ptio_dev *dev, struct ptio_out *out)
 {
 	int ret;
 
 	ret = ptio_revalidate_dev(dev);
+	if (ptio_out_structured(out)) {
+		ptio_out_begin_map(out, NULL);
+		ptio_out_str(out, "device", dev->path);
+		ptio_out_int(out, "error", ret);
+		ptio_out_end_map(out);
+	}
 	if (ret) {
 		fprintf(stderr, "Revalidate failed\n");
 		return ret;
@@ -61,10 +110,135 @@ static int ptio_revalidate(struct ptio_dev *dev)
 	return 0;
 }
 
+/*
+ * Write a device internal status log to @path, or to stdout with the raw
+ * output format, as the log is read from the device.
+ */
+static int ptio_status_log(struct ptio_dev *dev, enum ptio_status_log log,
+			   char *path, unsigned int nr_bufs,
+			   struct ptio_out *out)
+{
+	const char *name = log == PTIO_STATUS_LOG_CURRENT ?
+		"current" : "saved";
+	unsigned long long size = 0;
+	int fd = STDOUT_FILENO;
+	int ret;
+
+	if (path) {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "Open %s failed %d (%s)\n",
+				path, errno, strerror(errno));
+			return -1;
+		}
+	}
+
+	ret = ptio_dump_status_log(dev, log, fd, nr_bufs, &size);
+	if (path && close(fd) && !ret) {
+		fprintf(stderr, "Close %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		ret = -1;
+	}
+
+	if (ptio_out_structured(out)) {
+		ptio_out_begin_map(out, NULL);
+		ptio_out_str(out, "device", dev->path);
+		ptio_out_str(out, "log", name);
+		ptio_out_int(out, "error", ret);
+		ptio_out_uint(out, "size", size);
+		if (path)
+			ptio_out_str(out, "path", path);
+		ptio_out_end_map(out);
+	}
+	if (ret) {
+		fprintf(stderr, "Dump %s status log failed\n", name);
+		return ret;
+	}
+
+	if (out->fmt == PTIO_OUT_TEXT)
+		printf("%s status log: %llu Bytes written to %s\n",
+		       log == PTIO_STATUS_LOG_CURRENT ? "Current" : "Saved",
+		       size, path);
+
+	return 0;
+}
+
+static void ptio_out_sense(struct ptio_out *out, struct ptio_sense *s)
+{
+	ptio_out_begin_map(out, "sense");
+	ptio_out_uint(out, "response_code", s->response_code);
+	ptio_out_uint(out, "key", s->key);
+	ptio_out_uint(out, "asc", s->asc);
+	ptio_out_uint(out, "ascq", s->ascq);
+	ptio_out_bool(out, "deferred", s->flags & PTIO_SENSE_DEFERRED);
+	ptio_out_bool(out, "retryable", s->flags & PTIO_SENSE_RETRYABLE);
+	ptio_out_bool(out, "medium_error",
+		      s->flags & PTIO_SENSE_MEDIUM_ERROR);
+	if (s->flags & PTIO_SENSE_INFO)
+		ptio_out_uint(out, "information", s->info);
+	if (s->flags & PTIO_SENSE_CMD_INFO)
+		ptio_out_uint(out, "command_information", s->cmd_info);
+	if (s->flags & PTIO_SENSE_SKS)
+		ptio_out_bytes(out, "sense_key_specific", s->sks, 3);
+	if (s->flags & PTIO_SENSE_PROGRESS)
+		ptio_out_uint(out, "progress", s->progress);
+	ptio_out_end_map(out);
+}
+
+static void ptio_out_ata_regs(struct ptio_out *out, struct ptio_sense *s)
+{
+	ptio_out_begin_map(out, "ata_registers");
+	ptio_out_uint(out, "status", s->ata.status);
+	ptio_out_uint(out, "error", s->ata.error);
+	ptio_out_uint(out, "device", s->ata.device);
+	ptio_out_uint(out, "count", s->ata.count);
+	ptio_out_uint(out, "lba", s->ata.lba);
+	ptio_out_bool(out, "partial", s->flags & PTIO_SENSE_ATA_PARTIAL);
+	ptio_out_end_map(out);
+}
+
+/*
+ * Output a command execution result: the command status, sense data, ATA
+ * registers and data returned, if any.
+ */
+static void ptio_out_cmd(struct ptio_out *out, struct ptio_dev *dev,
+			 struct ptio_cmd *cmd, int ret,
+			 unsigned long long time_ns, bool data)
+{
+	ptio_out_begin_map(out, NULL);
+	ptio_out_str(out, "device", dev->path);
+	ptio_out_bytes(out, "cdb", cmd->cdb, cmd->cdbsz);
+	ptio_out_int(out, "error", ret);
+	ptio_out_uint(out, "time_ns", time_ns);
+	ptio_out_uint(out, "status", cmd->io_hdr.status);
+	ptio_out_uint(out, "host_status", cmd->io_hdr.host_status);
+	ptio_out_uint(out, "driver_status", cmd->io_hdr.driver_status);
+	ptio_out_uint(out, "residual", cmd->io_hdr.resid);
+	if (cmd->sense.flags & PTIO_SENSE_VALID)
+		ptio_out_sense(out, &cmd->sense);
+	if (cmd->sense.flags & PTIO_SENSE_ATA_REGS)
+		ptio_out_ata_regs(out, &cmd->sense);
+	if (data)
+		ptio_out_bytes(out, "data", cmd->buf, cmd->bufsz);
+	ptio_out_end_map(out);
+}
+
+static unsigned long long ptio_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 static int ptio_exec(struct ptio_dev *dev, char *cdb_str,
 		     enum ptio_cdb_type cdb_type, enum ptio_dxfer dxfer,
-		     char *buf_path, size_t bufsz)
+		     char *buf_path, size_t bufsz, uint32_t flags,
+		     enum ptio_dump_fmt dump_fmt, unsigned int dump_flags,
+		     struct ptio_out *out, unsigned int timeout)
 {
+	unsigned long long start;
 	struct ptio_cmd cmd;
 	uint8_t cdb[PTIO_CDB_MAX_SIZE];
 	uint8_t *buf = NULL;
@@ -86,30 +260,64 @@ static int ptio_exec(struct ptio_dev *dev, char *cdb_str,
 	if (buf_path && dxfer == PTIO_DXFER_TO_DEV)
 		buf = ptio_read_buf(buf_path, &bufsz);
 	else if (dxfer != PTIO_DXFER_NONE)
-		buf = ptio_alloc_buf(bufsz);
+		buf = ptio_alloc_dev_buf(dev, bufsz);
 	if (!buf)
 		return -1;
 
 	/* Execute the command */
-	ret = ptio_exec_cmd(dev, &cmd, cdb, cdbsz, cdb_type, buf, bufsz,
-			    dxfer, 0);
+	start = ptio_clock_ns();
+	ret = ptio_exec_cmd_timeout(dev, &cmd, cdb, cdbsz, cdb_type,
+				    buf, bufsz, dxfer, flags, timeout);
+	if (ret == -EAGAIN && dev->power_gate != PTIO_POWER_GATE_NONE)
+		fprintf(stderr, "Device in standby: command not executed\n");
+	if (ptio_out_structured(out)) {
+		ptio_out_cmd(out, dev, &cmd, ret, ptio_clock_ns() - start,
+			     !ret && dxfer == PTIO_DXFER_FROM_DEV && !buf_path);
+		if (ret || !buf_path)
+			return ret;
+	}
 	if (ret)
 		return ret;
 
+	if (out->fmt == PTIO_OUT_TEXT && (flags & PTIO_CMD_ATA_CK_COND)) {
+		struct ptio_ata_regs *ata = &cmd.sense.ata;
+
+		if (!(cmd.sense.flags & PTIO_SENSE_ATA_REGS)) {
+			printf("No ATA registers returned\n");
+		} else {
+			printf("ATA registers%s:\n",
+			       cmd.sense.flags & PTIO_SENSE_ATA_PARTIAL ?
+			       " (partial)" : "");
+			printf("    Status: 0x%02x\n", ata->status);
+			printf("    Error: 0x%02x\n", ata->error);
+			printf("    Device: 0x%02x\n", ata->device);
+			printf("    Count: 0x%04x\n", ata->count);
+			printf("    LBA: 0x%012llx\n",
+			       (unsigned long long)ata->lba);
+		}
+	}
+
 	if (dxfer == PTIO_DXFER_FROM_DEV) {
 		if (buf_path) {
 			ret = ptio_write_buf(buf_path, buf, cmd.bufsz);
 			if (ret)
 				return ret;
-			printf("Command result %zu Bytes written to %s\n",
-			       cmd.bufsz, buf_path);
+			if (out->fmt == PTIO_OUT_TEXT)
+				printf("Command result %zu Bytes written to %s\n",
+				       cmd.bufsz, buf_path);
 		} else {
-			printf("Command result %zu Bytes:\n", cmd.bufsz);
-			ptio_print_buf(buf, cmd.bufsz);
+			/* Only the hex table gets a header */
+			if (out->fmt == PTIO_OUT_TEXT &&
+			    dump_fmt == PTIO_DUMP_HEX)
+				printf("Command result %zu Bytes:\n",
+				       cmd.bufsz);
+			fflush(stdout);
+			ret = ptio_dump_buf(STDOUT_FILENO, buf, cmd.bufsz,
+					    dump_fmt, dump_flags);
 		}
 	}
 
-	return 0;
+	return ret;
 }
 
 /*
@@ -139,7 +347,30 @@ static void ptio_usage(void)
 	       "                     --in-buf is used.\n"
 	       "  --to-dev         : Specify that the command transfers data\n"
 	       "                     from the host to the device.\n"
-	       "  --from-dev       : Data transfer from device to host.\n");
+	       "  --from-dev       : Data transfer from device to host.\n"
+	       "  --ck-cond        : Set ck_cond for an ATA command and\n"
+	       "                     display the ATA output registers.\n"
+	       "  --dump <fmt>     : Output format of the command result\n"
+	       "                     buffer: hex (default), base64 or raw.\n"
+	       "  --squeeze        : With hex output, display runs of\n"
+	       "                     identical lines as a single \"*\" line.\n"
+	       "  --format <fmt>   : Output format: text (default), json,\n"
+	       "                     cbor or raw. With raw, only the command\n"
+	       "                     result data is written, as-is.\n"
+	       "  --timeout <ms>   : Command timeout in milliseconds\n"
+	       "                     (default: depends on the command).\n"
+	       "  --retry          : Retry commands failing with a transient\n"
+	       "                     error, e.g. a unit attention.\n"
+	       "  --queue-at-tail  : Queue the command at the tail of the\n"
+	       "                     device queue instead of at the head.\n"
+	       "  --no-spinup      : Do not execute the command if the device\n"
+	       "                     is in standby and the command would\n"
+	       "                     spin it up.\n"
+	       "  --status-log <log> : Save the current or saved device\n"
+	       "                     internal status log to the file\n"
+	       "                     specified with --out-buf, and return.\n"
+	       "  --nr-bufs <num>  : Number of buffers used to stream the\n"
+	       "                     status log (default: 2).\n");
 	printf("See \"man ptio\" for more information.\n");
 }
 
@@ -147,6 +378,7 @@ enum ptio_operation {
 	PTIO_OP_EXEC_CMD,
 	PTIO_OP_INFO,
 	PTIO_OP_REVALIDATE,
+	PTIO_OP_STATUS_LOG,
 };
 
 /*
@@ -160,6 +392,14 @@ int main(int argc, char **argv)
 	enum ptio_cdb_type cdb_type = PTIO_CDB_NONE;
 	enum ptio_dxfer dxfer = PTIO_DXFER_NONE;
 	char *buf_path = NULL;
+	enum ptio_dump_fmt dump_fmt = PTIO_DUMP_HEX;
+	unsigned int dump_flags = 0;
+	uint32_t cmd_flags = 0;
+	enum ptio_out_fmt out_fmt = PTIO_OUT_TEXT;
+	struct ptio_out out;
+	unsigned int timeout = 0;
+	enum ptio_status_log status_log = PTIO_STATUS_LOG_CURRENT;
+	unsigned int nr_bufs = 0;
 	int bufsz = 0;
 	int i, ret;
 
@@ -267,6 +507,107 @@ int main(int argc, char **argv)
 			continue;
 		}
 
+		if (strcmp(argv[i], "--ck-cond") == 0) {
+			cmd_flags |= PTIO_CMD_ATA_CK_COND;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--dump") == 0) {
+			i++;
+			if (i >= argc)
+				goto invalid_cmdline;
+			if (strcmp(argv[i], "hex") == 0) {
+				dump_fmt = PTIO_DUMP_HEX;
+			} else if (strcmp(argv[i], "base64") == 0) {
+				dump_fmt = PTIO_DUMP_BASE64;
+			} else if (strcmp(argv[i], "raw") == 0) {
+				dump_fmt = PTIO_DUMP_RAW;
+			} else {
+				fprintf(stderr, "Invalid dump format\n");
+				return 1;
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "--format") == 0) {
+			i++;
+			if (i >= argc)
+				goto invalid_cmdline;
+			if (strcmp(argv[i], "text") == 0) {
+				out_fmt = PTIO_OUT_TEXT;
+			} else if (strcmp(argv[i], "json") == 0) {
+				out_fmt = PTIO_OUT_JSON;
+			} else if (strcmp(argv[i], "cbor") == 0) {
+				out_fmt = PTIO_OUT_CBOR;
+			} else if (strcmp(argv[i], "raw") == 0) {
+				out_fmt = PTIO_OUT_RAW;
+			} else {
+				fprintf(stderr, "Invalid output format\n");
+				return 1;
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "--timeout") == 0) {
+			i++;
+			if (i >= argc)
+				goto invalid_cmdline;
+			if (atoi(argv[i]) <= 0) {
+				fprintf(stderr, "Invalid timeout\n");
+				return 1;
+			}
+			timeout = atoi(argv[i]);
+			continue;
+		}
+
+		if (strcmp(argv[i], "--retry") == 0) {
+			ptio_init_retry_policy(&dev.retry);
+			continue;
+		}
+
+		if (strcmp(argv[i], "--queue-at-tail") == 0) {
+			dev.flags |= PTIO_QUEUE_AT_TAIL;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--no-spinup") == 0) {
+			dev.power_gate = PTIO_POWER_GATE_SKIP;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--status-log") == 0) {
+			i++;
+			if (i >= argc)
+				goto invalid_cmdline;
+			if (strcmp(argv[i], "current") == 0) {
+				status_log = PTIO_STATUS_LOG_CURRENT;
+			} else if (strcmp(argv[i], "saved") == 0) {
+				status_log = PTIO_STATUS_LOG_SAVED;
+			} else {
+				fprintf(stderr, "Invalid status log\n");
+				return 1;
+			}
+			op = PTIO_OP_STATUS_LOG;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--nr-bufs") == 0) {
+			i++;
+			if (i >= argc)
+				goto invalid_cmdline;
+			if (atoi(argv[i]) < 2) {
+				fprintf(stderr, "Invalid number of buffers\n");
+				return 1;
+			}
+			nr_bufs = atoi(argv[i]);
+			continue;
+		}
+
+		if (strcmp(argv[i], "--squeeze") == 0) {
+			dump_flags |= PTIO_DUMP_SQUEEZE;
+			continue;
+		}
+
 		if (argv[i][0] != '-')
 			break;
 
@@ -280,6 +621,22 @@ invalid_cmdline:
 		return 1;
 	}
 
+	ptio_out_init(&out, out_fmt, stdout);
+	if (out_fmt != PTIO_OUT_TEXT)
+		ptio_set_log_fn(ptio_log_stderr, NULL);
+	if (out_fmt == PTIO_OUT_RAW) {
+		if (op != PTIO_OP_EXEC_CMD && op != PTIO_OP_STATUS_LOG) {
+			fprintf(stderr,
+				"raw format is only valid for command execution\n");
+			return 1;
+		}
+		dump_fmt = PTIO_DUMP_RAW;
+	}
+	if (op == PTIO_OP_STATUS_LOG && !buf_path && out_fmt != PTIO_OUT_RAW) {
+		fprintf(stderr, "No status log output file specified\n");
+		return 1;
+	}
+
 	/* Get device path */
 	dev.path = realpath(argv[i], NULL);
 	if (!dev.path) {
@@ -294,13 +651,18 @@ invalid_cmdline:
 
 	switch (op) {
 	case PTIO_OP_INFO:
-		ret = ptio_information(&dev);
+		ret = ptio_information(&dev, &out);
 		break;
 	case PTIO_OP_REVALIDATE:
-		ret = ptio_revalidate(&dev);
+		ret = ptio_revalidate(&dev, &out);
+		break;
+	case PTIO_OP_STATUS_LOG:
+		ret = ptio_status_log(&dev, status_log, buf_path, nr_bufs,
+				      &out);
 		break;
 	case PTIO_OP_EXEC_CMD:
-		ret = ptio_exec(&dev, cdb_str, cdb_type, dxfer, buf_path, bufsz);
+		ret = ptio_exec(&dev, cdb_str, cdb_type, dxfer, buf_path, bufsz,
+				cmd_flags, dump_fmt, dump_flags, &out, timeout);
 		break;
 	default:
 		fprintf(stderr, "Undefined operation\n");
@@ -0,0 +1,227 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * SPDX-FileCopyrightText: 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ptio_out.h"
+
+/*
+ * CBOR major types.
+ */
+#define PTIO_CBOR_UINT		0
+#define PTIO_CBOR_NINT		1
+#define PTIO_CBOR_BYTES		2
+#define PTIO_CBOR_TEXT		3
+
+#define PTIO_CBOR_MAP_INDEF	0xbf
+#define PTIO_CBOR_FALSE		0xf4
+#define PTIO_CBOR_TRUE		0xf5
+#define PTIO_CBOR_BREAK		0xff
+
+static const char ptio_out_hex[] = "0123456789abcdef";
+
+/*
+ * Write a CBOR data item head: the major type and argument, using the
+ * shortest encoding.
+ */
+static void ptio_cbor_head(FILE *f, uint8_t major, uint64_t val)
+{
+	uint8_t head[9];
+	size_t len;
+	int i;
+
+	major <<= 5;
+	if (val < 24) {
+		head[0] = major | val;
+		len = 1;
+	} else if (val <= 0xff) {
+		head[0] = major | 24;
+		len = 2;
+	} else if (val <= 0xffff) {
+		head[0] = major | 25;
+		len = 3;
+	} else if (val <= 0xffffffff) {
+		head[0] = major | 26;
+		len = 5;
+	} else {
+		head[0] = major | 27;
+		len = 9;
+	}
+
+	for (i = len - 1; i > 0; i--, val >>= 8)
+		head[i] = val & 0xff;
+
+	fwrite(head, 1, len, f);
+}
+
+static void ptio_cbor_text(FILE *f, const char *str)
+{
+	size_t len = strlen(str);
+
+	ptio_cbor_head(f, PTIO_CBOR_TEXT, len);
+	fwrite(str, 1, len, f);
+}
+
+static void ptio_json_str(FILE *f, const char *str)
+{
+	const unsigned char *p = (const unsigned char *)str;
+
+	fputc('"', f);
+	for (; *p; p++) {
+		switch (*p) {
+		case '"':
+			fputs("\\\"", f);
+			break;
+		case '\\':
+			fputs("\\\\", f);
+			break;
+		case '\n':
+			fputs("\\n", f);
+			break;
+		case '\t':
+			fputs("\\t", f);
+			break;
+		default:
+			if (*p < 0x20)
+				fprintf(f, "\\u%04x", *p);
+			else
+				fputc(*p, f);
+			break;
+		}
+	}
+	fputc('"', f);
+}
+
+/*
+ * Start a new value, writing its key if the value is a map member.
+ */
+static void ptio_out_key(struct ptio_out *o, const char *key)
+{
+	if (o->fmt == PTIO_OUT_CBOR) {
+		if (key)
+			ptio_cbor_text(o->f, key);
+		return;
+	}
+
+	if (!o->first)
+		fputc(',', o->f);
+	o->first = false;
+	if (key) {
+		ptio_json_str(o->f, key);
+		fputc(':', o->f);
+	}
+}
+
+void ptio_out_init(struct ptio_out *o, enum ptio_out_fmt fmt, FILE *f)
+{
+	o->fmt = fmt;
+	o->f = f;
+	o->depth = 0;
+	o->first = true;
+}
+
+void ptio_out_begin_map(struct ptio_out *o, const char *key)
+{
+	ptio_out_key(o, key);
+	if (o->fmt == PTIO_OUT_CBOR)
+		fputc(PTIO_CBOR_MAP_INDEF, o->f);
+	else
+		fputc('{', o->f);
+	o->depth++;
+	o->first = true;
+}
+
+void ptio_out_end_map(struct ptio_out *o)
+{
+	if (o->fmt == PTIO_OUT_CBOR)
+		fputc(PTIO_CBOR_BREAK, o->f);
+	else
+		fputc('}', o->f);
+	o->first = false;
+
+	/* Top level documents are newline separated in JSON */
+	if (!--o->depth) {
+		if (o->fmt == PTIO_OUT_JSON)
+			fputc('\n', o->f);
+		o->first = true;
+		fflush(o->f);
+	}
+}
+
+void ptio_out_str(struct ptio_out *o, const char *key, const char *str)
+{
+	ptio_out_key(o, key);
+	if (o->fmt == PTIO_OUT_CBOR)
+		ptio_cbor_text(o->f, str);
+	else
+		ptio_json_str(o->f, str);
+}
+
+void ptio_out_uint(struct ptio_out *o, const char *key,
+		   unsigned long long val)
+{
+	ptio_out_key(o, key);
+	if (o->fmt == PTIO_OUT_CBOR)
+		ptio_cbor_head(o->f, PTIO_CBOR_UINT, val);
+	else
+		fprintf(o->f, "%llu", val);
+}
+
+void ptio_out_int(struct ptio_out *o, const char *key, long long val)
+{
+	if (val >= 0) {
+		ptio_out_uint(o, key, val);
+		return;
+	}
+
+	ptio_out_key(o, key);
+	if (o->fmt == PTIO_OUT_CBOR)
+		ptio_cbor_head(o->f, PTIO_CBOR_NINT, -1 - val);
+	else
+		fprintf(o->f, "%lld", val);
+}
+
+void ptio_out_bool(struct ptio_out *o, const char *key, bool val)
+{
+	ptio_out_key(o, key);
+	if (o->fmt == PTIO_OUT_CBOR)
+		fputc(val ? PTIO_CBOR_TRUE : PTIO_CBOR_FALSE, o->f);
+	else
+		fputs(val ? "true" : "false", o->f);
+}
+
+/*
+ * Binary data is a CBOR byte string, and a hexadecimal string in JSON.
+ */
+void ptio_out_bytes(struct ptio_out *o, const char *key,
+		    const uint8_t *buf, size_t len)
+{
+	char hex[512];
+	size_t i, n;
+
+	ptio_out_key(o, key);
+	if (o->fmt == PTIO_OUT_CBOR) {
+		ptio_cbor_head(o->f, PTIO_CBOR_BYTES, len);
+		fwrite(buf, 1, len, o->f);
+		return;
+	}
+
+	fputc('"', o->f);
+	while (len) {
+		n = len < sizeof(hex) / 2 ? len : sizeof(hex) / 2;
+		for (i = 0; i < n; i++) {
+			hex[i * 2] = ptio_out_hex[buf[i] >> 4];
+			hex[i * 2 + 1] = ptio_out_hex[buf[i] & 0x0f];
+		}
+		fwrite(hex, 1, n * 2, o->f);
+		buf += n;
+		len -= n;
+	}
+	fputc('"', o->f);
+}
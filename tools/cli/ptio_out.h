@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * SPDX-FileCopyrightText: 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#ifndef PTIO_OUT_H
+#define PTIO_OUT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Output formats.
+ */
+enum ptio_out_fmt {
+	PTIO_OUT_TEXT,
+	PTIO_OUT_JSON,
+	PTIO_OUT_CBOR,
+	PTIO_OUT_RAW,
+};
+
+/*
+ * Streaming JSON and CBOR writer: values are written as they are added,
+ * without building the document in memory. CBOR maps use the indefinite
+ * length encoding so that the number of members does not need to be known
+ * in advance.
+ */
+struct ptio_out {
+	enum ptio_out_fmt	fmt;
+	FILE			*f;
+	unsigned int		depth;
+	bool			first;
+};
+
+void ptio_out_init(struct ptio_out *o, enum ptio_out_fmt fmt, FILE *f);
+void ptio_out_begin_map(struct ptio_out *o, const char *key);
+void ptio_out_end_map(struct ptio_out *o);
+void ptio_out_str(struct ptio_out *o, const char *key, const char *str);
+void ptio_out_uint(struct ptio_out *o, const char *key,
+		   unsigned long long val);
+void ptio_out_int(struct ptio_out *o, const char *key, long long val);
+void ptio_out_bool(struct ptio_out *o, const char *key, bool val);
+void ptio_out_bytes(struct ptio_out *o, const char *key,
+		    const uint8_t *buf, size_t len);
+
+static inline bool ptio_out_structured(struct ptio_out *o)
+{
+	return o->fmt == PTIO_OUT_JSON || o->fmt == PTIO_OUT_CBOR;
+}
+
+#endif /* PTIO_OUT_H */
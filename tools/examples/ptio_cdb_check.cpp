@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * SPDX-FileCopyrightText: 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+/*
+ * Check of the constexpr CDB builders of libptio/ptio.hpp: CDBs built from
+ * constant arguments are compared with literal CDBs using static_assert, so
+ * this program only builds if the builders are evaluated at compile time and
+ * produce the expected bytes. At run time, CDBs built from variable
+ * arguments are compared with hand-packed CDBs, and the time taken to build
+ * them in a loop is measured for both.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <libptio/ptio.hpp>
+
+using ptio::cdb;
+
+static_assert(ptio::scsi::test_unit_ready() ==
+	      cdb<6>{{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+		     PTIO_DXFER_NONE});
+
+static_assert(ptio::scsi::inquiry_vpd(0x83, 0x200) ==
+	      cdb<6>{{ 0x12, 0x01, 0x83, 0x02, 0x00, 0x00 },
+		     PTIO_DXFER_FROM_DEV});
+
+static_assert(ptio::scsi::verify16(0x0123456789ABCDEFULL, 0x800) ==
+	      cdb<16>{{ 0x8F, 0x00,
+			0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF,
+			0x00, 0x00, 0x08, 0x00,
+			0x00, 0x00 },
+		      PTIO_DXFER_NONE});
+
+static_assert(ptio::scsi::read16(0x1000, 8, true) ==
+	      cdb<16>{{ 0x88, 0x08,
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+			0x00, 0x00, 0x00, 0x08,
+			0x00, 0x00 },
+		      PTIO_DXFER_FROM_DEV});
+
+/* PIO data-in, 28-bits, 1 block in COUNT, ck_cond clear */
+static_assert(ptio::ata::identify_device() ==
+	      cdb<16>{{ 0x85, 0x08, 0x0E,
+			0x00, 0x00, 0x00, 0x01,
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			0x00, 0xEC, 0x00 },
+		      PTIO_DXFER_FROM_DEV});
+
+/* NCQ, 48-bits, 32 blocks in FEATURE, tag 5 in COUNT 7:3 */
+static_assert(ptio::ata::read_fpdma_queued(0x123456789AULL, 32, 5) ==
+	      cdb<16>{{ 0x85, 0x19, 0x0D,
+			0x00, 0x20, 0x00, 0x28,
+			0x34, 0x9A, 0x12, 0x78, 0x00, 0x56,
+			0x40, 0x60, 0x00 },
+		      PTIO_DXFER_FROM_DEV});
+
+/*
+ * CDBs packed by hand, as done by C callers of ptio_exec_cmd().
+ */
+static void hand_verify16(uint8_t *c, uint64_t lba, uint32_t nr_blocks)
+{
+	int i;
+
+	memset(c, 0, 16);
+	c[0] = 0x8F;
+	for (i = 0; i < 8; i++)
+		c[2 + i] = lba >> (56 - i * 8);
+	for (i = 0; i < 4; i++)
+		c[10 + i] = nr_blocks >> (24 - i * 8);
+}
+
+static void hand_read_dma_ext(uint8_t *c, uint64_t lba, uint16_t nr_sectors)
+{
+	memset(c, 0, 16);
+	c[0] = 0x85;
+	c[1] = 0x06 << 1 | 0x01; /* DMA, extend */
+	c[2] = 1 << 3 | 1 << 2 | 0x2; /* t_dir in, byt_blk, t_length COUNT */
+	c[5] = nr_sectors >> 8;
+	c[6] = nr_sectors;
+	c[7] = lba >> 24;
+	c[8] = lba;
+	c[9] = lba >> 32;
+	c[10] = lba >> 8;
+	c[11] = lba >> 40;
+	c[12] = lba >> 16;
+	c[13] = 0x40;
+	c[14] = 0x25;
+}
+
+/* Keep the compiler from dropping CDBs that are never used */
+static inline void cdb_use(const uint8_t *c)
+{
+	asm volatile("" : : "r"(c) : "memory");
+}
+
+template <typename F>
+static double bench_ns(F &&fn, unsigned long nr)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned long i = 0; i < nr; i++)
+		fn(i);
+
+	std::chrono::duration<double, std::nano> d =
+		std::chrono::steady_clock::now() - start;
+
+	return d.count() / nr;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long nr = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000000;
+	uint64_t lba = 0x0123456789ABULL;
+	uint8_t hand[16];
+	double b, h;
+
+	/* Variable arguments: the CDBs are built at run time */
+	for (unsigned long i = 0; i < 1000000; i++) {
+		auto c = ptio::scsi::verify16(lba + i, i);
+		auto a = ptio::ata::read_dma_ext(lba + i, i);
+
+		hand_verify16(hand, lba + i, i);
+		if (memcmp(c.bytes.data(), hand, 16) != 0) {
+			fprintf(stderr, "verify16 differs at %lu\n", i);
+			return 1;
+		}
+		hand_read_dma_ext(hand, lba + i, i);
+		if (memcmp(a.bytes.data(), hand, 16) != 0) {
+			fprintf(stderr, "read_dma_ext differs at %lu\n", i);
+			return 1;
+		}
+	}
+
+	if (!nr) {
+		fprintf(stderr, "Invalid number of iterations\n");
+		return 1;
+	}
+
+	b = bench_ns([&](unsigned long i) {
+		auto c = ptio::scsi::verify16(lba + i, i);
+		cdb_use(c.bytes.data());
+	}, nr);
+	h = bench_ns([&](unsigned long i) {
+		hand_verify16(hand, lba + i, i);
+		cdb_use(hand);
+	}, nr);
+	printf("verify16:     builder %.2f ns, hand-packed %.2f ns\n", b, h);
+
+	b = bench_ns([&](unsigned long i) {
+		auto c = ptio::ata::read_dma_ext(lba + i, i);
+		cdb_use(c.bytes.data());
+	}, nr);
+	h = bench_ns([&](unsigned long i) {
+		hand_read_dma_ext(hand, lba + i, i);
+		cdb_use(hand);
+	}, nr);
+	printf("read_dma_ext: builder %.2f ns, hand-packed %.2f ns\n", b, h);
+
+	return 0;
+}
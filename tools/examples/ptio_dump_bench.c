@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * SPDX-FileCopyrightText: 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+/*
+ * Benchmark of the hex table buffer dump: compare ptio_dump_buf() with the
+ * previous implementation of ptio_print_buf(), which used one printf() call
+ * per byte. Both outputs are first checked to be identical.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <libptio/ptio.h>
+
+static unsigned long long bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * The printf() based ptio_print_buf(), writing to @f instead of stdout.
+ */
+static void bench_printf_dump(FILE *f, uint8_t *buf, size_t bufsz)
+{
+	unsigned int l = 0, i;
+
+	fprintf(f, "  +----------+-------------------------------------------------+\n");
+	fprintf(f, "  |  OFFSET  | 00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F |\n");
+	fprintf(f, "  +----------+-------------------------------------------------+\n");
+
+	while (l < bufsz) {
+		fprintf(f, "  | %08x |", l);
+		for (i = 0; i < 16; i++, l++) {
+			if (l < bufsz)
+				fprintf(f, " %02x", (unsigned int)buf[l]);
+			else
+				fprintf(f, "   ");
+		}
+		fprintf(f, " |\n");
+	}
+
+	fprintf(f, "  +----------+-------------------------------------------------+\n");
+}
+
+static char *bench_read_file(FILE *f, size_t *len)
+{
+	char *s;
+
+	fflush(f);
+	*len = ftell(f);
+	s = malloc(*len);
+	if (!s)
+		return NULL;
+	rewind(f);
+	if (fread(s, 1, *len, f) != *len) {
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+/*
+ * Check that both implementations output the same text for @bufsz bytes.
+ */
+static int bench_check(uint8_t *buf, size_t bufsz)
+{
+	FILE *f1 = tmpfile(), *f2 = tmpfile();
+	char *s1 = NULL, *s2 = NULL;
+	size_t len1, len2;
+	int ret = -1;
+
+	if (!f1 || !f2)
+		goto out;
+
+	bench_printf_dump(f1, buf, bufsz);
+	fflush(f2);
+	if (ptio_dump_buf(fileno(f2), buf, bufsz, PTIO_DUMP_HEX, 0))
+		goto out;
+	fseek(f2, 0, SEEK_END);
+
+	s1 = bench_read_file(f1, &len1);
+	s2 = bench_read_file(f2, &len2);
+	if (s1 && s2 && len1 == len2 && memcmp(s1, s2, len1) == 0)
+		ret = 0;
+
+out:
+	free(s1);
+	free(s2);
+	if (f1)
+		fclose(f1);
+	if (f2)
+		fclose(f2);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long start, printf_ns, dump_ns;
+	size_t bufsz = 32 * 1024 * 1024, i;
+	uint8_t *buf;
+	FILE *f;
+
+	if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+		printf("Usage: ptio-dump-bench [buffer size in MB (default 32)]\n");
+		return argc == 2 && strcmp(argv[1], "-h") &&
+			strcmp(argv[1], "--help");
+	}
+	if (argc == 2)
+		bufsz = strtoul(argv[1], NULL, 0) * 1024 * 1024;
+	if (!bufsz) {
+		fprintf(stderr, "Invalid buffer size\n");
+		return 1;
+	}
+
+	buf = ptio_alloc_buf(bufsz);
+	f = fopen("/dev/null", "w");
+	if (!buf || !f) {
+		fprintf(stderr, "Setup failed\n");
+		return 1;
+	}
+
+	srand(1);
+	for (i = 0; i < bufsz; i++)
+		buf[i] = rand();
+
+	/* Include a partial last line */
+	if (bench_check(buf, 4096 + 7)) {
+		fprintf(stderr, "Dump outputs differ\n");
+		return 1;
+	}
+
+	start = bench_now_ns();
+	bench_printf_dump(f, buf, bufsz);
+	fflush(f);
+	printf_ns = bench_now_ns() - start;
+
+	start = bench_now_ns();
+	if (ptio_dump_buf(fileno(f), buf, bufsz, PTIO_DUMP_HEX, 0)) {
+		fprintf(stderr, "Dump failed\n");
+		return 1;
+	}
+	dump_ns = bench_now_ns() - start;
+
+	printf("%zu MB hex dump: printf %.3f s, ptio_dump_buf %.3f s, x%.1f\n",
+	       bufsz >> 20, printf_ns / 1e9, dump_ns / 1e9,
+	       (double)printf_ns / dump_ns);
+
+	fclose(f);
+	free(buf);
+
+	return 0;
+}
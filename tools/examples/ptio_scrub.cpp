@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * SPDX-FileCopyrightText: 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+/*
+ * Example: verify the media of many drives concurrently, running for each
+ * drive a number of coroutines that each verify the next chunk of the drive
+ * until the whole capacity is verified.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <latch>
+#include <memory>
+#include <vector>
+
+#include <libptio/ptio.hpp>
+
+struct drive {
+	explicit drive(const char *path) : dev(path, PTIO_DXFER_NONE) {}
+
+	ptio::device			dev;
+	uint64_t			nr_lbas = 0;
+	std::atomic<uint64_t>		next_lba = 0;
+	std::atomic<unsigned long long>	nr_verified = 0;
+	std::atomic<unsigned long long>	nr_errors = 0;
+};
+
+static ptio::task scrub(ptio::scheduler &sched, drive &d,
+			uint32_t chunk, std::latch &done)
+{
+	uint64_t lba;
+	uint32_t nr;
+	int ret;
+
+	for (;;) {
+		lba = d.next_lba.fetch_add(chunk);
+		if (lba >= d.nr_lbas)
+			break;
+		nr = std::min<uint64_t>(chunk, d.nr_lbas - lba);
+
+		ret = co_await sched.exec(d.dev, ptio::scsi::verify16(lba, nr));
+		if (ret) {
+			fprintf(stderr, "%s: verify %llu + %u failed %d\n",
+				d.dev->name, (unsigned long long)lba, nr, ret);
+			d.nr_errors++;
+		}
+		d.nr_verified += nr;
+	}
+
+	done.count_down();
+}
+
+static void ptio_scrub_usage(void)
+{
+	printf("Usage: ptio-scrub [options] <sg device path> ...\n");
+	printf("Options:\n"
+	       "  --help | -h       : Print this usage\n"
+	       "  --threads <num>   : Number of completion threads (default 1)\n"
+	       "  --qd <num>        : Number of coroutines per drive (default 32)\n"
+	       "  --chunk <blocks>  : Number of blocks per VERIFY (default 2048)\n");
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<std::unique_ptr<drive>> drives;
+	unsigned int nr_threads = 1, qd = 32;
+	uint32_t chunk = 2048;
+	int i, ret = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--help") == 0 ||
+		    strcmp(argv[i], "-h") == 0) {
+			ptio_scrub_usage();
+			return 0;
+		}
+		if (strcmp(argv[i], "--threads") == 0 ||
+		    strcmp(argv[i], "--qd") == 0 ||
+		    strcmp(argv[i], "--chunk") == 0) {
+			const char *opt = argv[i];
+			unsigned long val;
+
+			if (++i >= argc) {
+				fprintf(stderr, "Missing %s value\n", opt);
+				return 1;
+			}
+			val = strtoul(argv[i], NULL, 0);
+			if (!val) {
+				fprintf(stderr, "Invalid %s value\n", opt);
+				return 1;
+			}
+			if (strcmp(opt, "--threads") == 0)
+				nr_threads = val;
+			else if (strcmp(opt, "--qd") == 0)
+				qd = val;
+			else
+				chunk = val;
+			continue;
+		}
+		if (argv[i][0] == '-') {
+			fprintf(stderr, "Unknown option \"%s\"\n", argv[i]);
+			return 1;
+		}
+		break;
+	}
+
+	if (i >= argc) {
+		ptio_scrub_usage();
+		return 1;
+	}
+
+	try {
+		ptio::scheduler sched(nr_threads);
+
+		for (; i < argc; i++) {
+			auto d = std::make_unique<drive>(argv[i]);
+
+			ret = d->dev.get_information();
+			if (ret) {
+				fprintf(stderr, "%s: get information failed\n",
+					argv[i]);
+				return 1;
+			}
+			d->nr_lbas = (d->dev->capacity << 9) /
+				d->dev->logical_block_size;
+			sched.add(d->dev);
+			drives.push_back(std::move(d));
+		}
+
+		std::latch done(drives.size() * qd);
+
+		for (auto &d : drives)
+			for (unsigned int q = 0; q < qd; q++)
+				scrub(sched, *d, chunk, done);
+
+		done.wait();
+	} catch (const std::exception &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	for (auto &d : drives) {
+		printf("%s: %llu / %llu blocks verified, %llu errors\n",
+		       d->dev->name, d->nr_verified.load(),
+		       (unsigned long long)d->nr_lbas, d->nr_errors.load());
+		if (d->nr_errors)
+			ret = 1;
+	}
+
+	return ret;
+}
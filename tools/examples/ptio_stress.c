@@ -0,0 +1,328 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * SPDX-FileCopyrightText: 2024 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+/*
+ * Stress test and scaling benchmark of concurrent command execution: a
+ * number of threads issue a mix of commands to one or many shared devices,
+ * each thread using its own command descriptors and buffers, as allowed by
+ * the library concurrency contract. The data returned by each command is
+ * checked against the data read before the threads were started.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libptio/ptio.h>
+
+#define STRESS_INQ_LEN		36
+#define STRESS_RCAP_LEN		8
+#define STRESS_IDENT_LEN	512
+
+struct stress_dev {
+	struct ptio_dev		dev;
+	uint8_t			inq[STRESS_INQ_LEN];
+	uint8_t			rcap[STRESS_RCAP_LEN];
+	uint8_t			ident[STRESS_IDENT_LEN];
+};
+
+struct stress_ctx {
+	struct stress_dev	*sdevs;
+	unsigned int		nr_devs;
+	unsigned long long	end_ns;
+};
+
+struct stress_thread {
+	pthread_t		thread;
+	struct stress_ctx	*ctx;
+	unsigned int		id;
+	int			ret;
+	unsigned long long	nr_cmds;
+	unsigned long long	nr_errors;
+	unsigned long long	nr_mismatches;
+};
+
+enum stress_op {
+	STRESS_TUR,
+	STRESS_INQUIRY,
+	STRESS_READ_CAPACITY,
+	STRESS_IDENTIFY,
+	STRESS_NR_OPS,
+};
+
+static unsigned long long stress_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Execute one command of type @op, returning the data in @buf and its
+ * expected value in @ref (NULL if there is no data).
+ */
+static int stress_exec(struct stress_dev *sd, enum stress_op op,
+		       uint8_t *buf, uint8_t **ref, size_t *len)
+{
+	struct ptio_dev *dev = &sd->dev;
+	uint8_t cdb[16] = {};
+	struct ptio_cmd cmd;
+
+	switch (op) {
+	case STRESS_TUR:
+		*ref = NULL;
+		*len = 0;
+		return ptio_exec_cmd(dev, &cmd, cdb, 6, PTIO_CDB_SCSI,
+				     NULL, 0, PTIO_DXFER_NONE, 0);
+	case STRESS_INQUIRY:
+		cdb[0] = 0x12;
+		cdb[4] = STRESS_INQ_LEN;
+		*ref = sd->inq;
+		*len = STRESS_INQ_LEN;
+		return ptio_exec_cmd(dev, &cmd, cdb, 6, PTIO_CDB_SCSI,
+				     buf, *len, PTIO_DXFER_FROM_DEV, 0);
+	case STRESS_READ_CAPACITY:
+		cdb[0] = 0x25;
+		*ref = sd->rcap;
+		*len = STRESS_RCAP_LEN;
+		return ptio_exec_cmd(dev, &cmd, cdb, 10, PTIO_CDB_SCSI,
+				     buf, *len, PTIO_DXFER_FROM_DEV, 0);
+	case STRESS_IDENTIFY:
+		cdb[7] = 0xEC;
+		*ref = sd->ident;
+		*len = STRESS_IDENT_LEN;
+		return ptio_exec_cmd(dev, &cmd, cdb, 8, PTIO_CDB_ATA,
+				     buf, *len, PTIO_DXFER_FROM_DEV, 0);
+	default:
+		return -1;
+	}
+}
+
+static int stress_init_dev(struct stress_dev *sd)
+{
+	uint8_t *ref;
+	size_t len;
+	int ret;
+
+	ret = stress_exec(sd, STRESS_INQUIRY, sd->inq, &ref, &len);
+	if (!ret)
+		ret = stress_exec(sd, STRESS_READ_CAPACITY, sd->rcap,
+				  &ref, &len);
+	if (!ret && ptio_dev_is_ata(&sd->dev))
+		ret = stress_exec(sd, STRESS_IDENTIFY, sd->ident, &ref, &len);
+
+	return ret;
+}
+
+static void *stress_thread_fn(void *arg)
+{
+	struct stress_thread *t = arg;
+	struct stress_ctx *ctx = t->ctx;
+	struct stress_dev *sd;
+	unsigned int i = t->id;
+	enum stress_op op;
+	uint8_t *buf, *ref;
+	size_t len;
+
+	buf = ptio_alloc_buf(STRESS_IDENT_LEN);
+	if (!buf) {
+		t->ret = -1;
+		return NULL;
+	}
+
+	/* Start on a different device and command than the other threads */
+	while (stress_now_ns() < ctx->end_ns) {
+		sd = &ctx->sdevs[i % ctx->nr_devs];
+		op = (i / ctx->nr_devs) % STRESS_NR_OPS;
+		i++;
+		if (op == STRESS_IDENTIFY && !ptio_dev_is_ata(&sd->dev))
+			continue;
+
+		t->nr_cmds++;
+		if (stress_exec(sd, op, buf, &ref, &len)) {
+			t->nr_errors++;
+			continue;
+		}
+		if (ref && memcmp(buf, ref, len) != 0) {
+			fprintf(stderr, "%s: thread %u, command %d: data mismatch\n",
+				sd->dev.name, t->id, op);
+			t->nr_mismatches++;
+		}
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+/*
+ * Run @nr_threads threads for @secs seconds and return the total number of
+ * commands executed, or -1 on failure.
+ */
+static long long stress_run(struct stress_ctx *ctx, unsigned int nr_threads,
+			    unsigned int secs, bool *failed)
+{
+	struct stress_thread *threads;
+	unsigned long long nr_cmds = 0;
+	unsigned int i;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		return -1;
+
+	ctx->end_ns = stress_now_ns() + secs * 1000000000ULL;
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].ctx = ctx;
+		threads[i].id = i;
+		if (pthread_create(&threads[i].thread, NULL,
+				   stress_thread_fn, &threads[i])) {
+			fprintf(stderr, "Create thread failed\n");
+			ctx->end_ns = 0;
+			nr_threads = i;
+			*failed = true;
+			break;
+		}
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		nr_cmds += threads[i].nr_cmds;
+		if (threads[i].ret || threads[i].nr_errors ||
+		    threads[i].nr_mismatches) {
+			fprintf(stderr,
+				"Thread %u: %llu commands, %llu errors, %llu mismatches\n",
+				i, threads[i].nr_cmds, threads[i].nr_errors,
+				threads[i].nr_mismatches);
+			*failed = true;
+		}
+	}
+
+	free(threads);
+
+	return nr_cmds;
+}
+
+static void ptio_stress_usage(void)
+{
+	printf("Usage: ptio-stress [options] <device path> ...\n");
+	printf("Options:\n"
+	       "  --help | -h       : Print this usage\n"
+	       "  --threads <num>   : Number of threads (default 4)\n"
+	       "  --time <sec>      : Run time in seconds (default 10)\n"
+	       "  --scale           : Run with 1, 2, 4 ... up to the number of\n"
+	       "                      threads and report the command rate of\n"
+	       "                      each run\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr_threads = 4, secs = 10, n;
+	struct stress_ctx ctx = {};
+	bool scale = false, failed = false;
+	long long nr_cmds, nr_cmds1 = 0;
+	int i, ret = 1;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--help") == 0 ||
+		    strcmp(argv[i], "-h") == 0) {
+			ptio_stress_usage();
+			return 0;
+		}
+		if (strcmp(argv[i], "--scale") == 0) {
+			scale = true;
+			continue;
+		}
+		if (strcmp(argv[i], "--threads") == 0 ||
+		    strcmp(argv[i], "--time") == 0) {
+			const char *opt = argv[i];
+			unsigned long val;
+
+			if (++i >= argc) {
+				fprintf(stderr, "Missing %s value\n", opt);
+				return 1;
+			}
+			val = strtoul(argv[i], NULL, 0);
+			if (!val) {
+				fprintf(stderr, "Invalid %s value\n", opt);
+				return 1;
+			}
+			if (strcmp(opt, "--threads") == 0)
+				nr_threads = val;
+			else
+				secs = val;
+			continue;
+		}
+		if (argv[i][0] == '-') {
+			fprintf(stderr, "Unknown option \"%s\"\n", argv[i]);
+			return 1;
+		}
+		break;
+	}
+
+	if (i >= argc) {
+		ptio_stress_usage();
+		return 1;
+	}
+
+	ctx.sdevs = calloc(argc - i, sizeof(*ctx.sdevs));
+	if (!ctx.sdevs)
+		return 1;
+
+	for (; i < argc; i++) {
+		struct stress_dev *sd = &ctx.sdevs[ctx.nr_devs];
+
+		sd->dev.path = realpath(argv[i], NULL);
+		if (!sd->dev.path) {
+			fprintf(stderr, "Failed to get %s real path\n", argv[i]);
+			goto out;
+		}
+		if (ptio_open_dev(&sd->dev, PTIO_DXFER_FROM_DEV)) {
+			free(sd->dev.path);
+			goto out;
+		}
+		ctx.nr_devs++;
+		if (stress_init_dev(sd)) {
+			fprintf(stderr, "%s: get reference data failed\n",
+				sd->dev.name);
+			goto out;
+		}
+	}
+
+	n = scale ? 1 : nr_threads;
+	for (;;) {
+		nr_cmds = stress_run(&ctx, n, secs, &failed);
+		if (nr_cmds < 0)
+			goto out;
+		if (n == 1)
+			nr_cmds1 = nr_cmds;
+		printf("%u devices, %3u threads: %lld commands, %.0f cmd/s",
+		       ctx.nr_devs, n, nr_cmds, (double)nr_cmds / secs);
+		if (scale && nr_cmds1)
+			printf(", x%.2f", (double)nr_cmds / nr_cmds1);
+		printf("\n");
+		if (failed)
+			goto out;
+		if (n == nr_threads)
+			break;
+		n = n * 2 < nr_threads ? n * 2 : nr_threads;
+	}
+
+	ret = 0;
+
+out:
+	while (ctx.nr_devs--) {
+		ptio_close_dev(&ctx.sdevs[ctx.nr_devs].dev);
+		free(ctx.sdevs[ctx.nr_devs].dev.path);
+	}
+	free(ctx.sdevs);
+
+	return ret;
+}